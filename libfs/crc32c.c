@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* CRC-32C polynomial, bit-reversed */
+#define POLY 0x82f63b78
+
+/* Bytes run by each of the three streams of the crc32 instruction in one
+ * pass, the long ones first. Powers of two, see crc32c_zeros_op(). */
+#define STREAM_LONG 1024
+#define STREAM_SHORT 256
+
+/* Slicing-by-8 tables of the portable version */
+static uint32_t table_sw[8][256];
+
+/* Operators appending STREAM_LONG and STREAM_SHORT zero bytes to a CRC, one
+ * table per byte of the CRC */
+static uint32_t zeros_long[4][256];
+static uint32_t zeros_short[4][256];
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int hw_enabled;
+
+static uint32_t read64_lo(const uint8_t *p, uint32_t *hi)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	*hi = (uint32_t)(v >> 32);
+	return (uint32_t)v;
+}
+
+/* Multiply 32x32 matrix @mat by vector @vec over GF(2) */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++) {
+		if (vec & 1)
+			sum ^= *mat;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Build in @even the operator appending @len zero bytes to a CRC, @len being
+ * a power of two */
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32], row = 1;
+
+	/* one zero bit */
+	odd[0] = POLY;
+	for (int n = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	/* two, then four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+	/* one zero byte in @even, then two in @odd, and so on */
+	for (;;) {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+		if (len == 0)
+			break;
+	}
+	memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t op[32];
+
+	crc32c_zeros_op(op, len);
+	for (uint32_t n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	       zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		table_sw[0][n] = crc;
+	}
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = table_sw[0][n];
+		for (int k = 1; k < 8; k++) {
+			crc = table_sw[0][crc & 0xff] ^ (crc >> 8);
+			table_sw[k][n] = crc;
+		}
+	}
+#if defined(__x86_64__)
+	hw_enabled = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+	if (hw_enabled) {
+		crc32c_zeros(zeros_long, STREAM_LONG);
+		crc32c_zeros(zeros_short, STREAM_SHORT);
+	}
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *next = buf;
+	uint32_t hi;
+
+	pthread_once(&init_once, crc32c_init);
+	crc = ~crc;
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc = table_sw[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	for (; len >= 8; len -= 8, next += 8) {
+		crc ^= read64_lo(next, &hi);
+		crc = table_sw[7][crc & 0xff] ^ table_sw[6][(crc >> 8) & 0xff] ^
+		      table_sw[5][(crc >> 16) & 0xff] ^ table_sw[4][crc >> 24] ^
+		      table_sw[3][hi & 0xff] ^ table_sw[2][(hi >> 8) & 0xff] ^
+		      table_sw[1][(hi >> 16) & 0xff] ^ table_sw[0][hi >> 24];
+	}
+	while (len--)
+		crc = table_sw[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+/* Run @stream bytes three times over: the crc32 instruction takes three
+ * cycles but starts one per cycle, so three independent CRCs cost the same as
+ * one. They are then combined by appending zeros to the first two. */
+#define CRC32C_STREAMS(stream, zeros)					\
+	while (len >= (stream) * 3) {					\
+		uint64_t crc1 = 0, crc2 = 0;				\
+		const uint8_t *end = next + (stream);			\
+		do {							\
+			uint64_t v0, v1, v2;				\
+			memcpy(&v0, next, 8);				\
+			memcpy(&v1, next + (stream), 8);		\
+			memcpy(&v2, next + 2 * (stream), 8);		\
+			crc0 = _mm_crc32_u64(crc0, v0);			\
+			crc1 = _mm_crc32_u64(crc1, v1);			\
+			crc2 = _mm_crc32_u64(crc2, v2);			\
+			next += 8;					\
+		} while (next < end);					\
+		crc0 = crc32c_shift(zeros, crc0) ^ crc1;		\
+		crc0 = crc32c_shift(zeros, crc0) ^ crc2;		\
+		next += 2 * (stream);					\
+		len -= 3 * (stream);					\
+	}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *next = buf;
+	uint64_t crc0 = ~crc;
+
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc0 = _mm_crc32_u8(crc0, *next++);
+		len--;
+	}
+	CRC32C_STREAMS(STREAM_LONG, zeros_long);
+	CRC32C_STREAMS(STREAM_SHORT, zeros_short);
+	for (; len >= 8; len -= 8, next += 8) {
+		uint64_t v;
+		memcpy(&v, next, 8);
+		crc0 = _mm_crc32_u64(crc0, v);
+	}
+	while (len--)
+		crc0 = _mm_crc32_u8(crc0, *next++);
+	return ~(uint32_t)crc0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&init_once, crc32c_init);
+#if defined(__x86_64__)
+	if (hw_enabled)
+		return crc32c_hw(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_enabled(void)
+{
+	pthread_once(&init_once, crc32c_init);
+	return hw_enabled;
+}
@@ -0,0 +1,38 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * crc32c - Compute the CRC-32C (Castagnoli) of a buffer
+ * @crc: CRC of the data before @buf, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Run with the SSE4.2 crc32 instruction when the processor has it, three
+ * streams at a time, and with lookup tables otherwise. Both give the same
+ * result.
+ *
+ * Return: the CRC of the data before @buf followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_sw - Compute the CRC-32C of a buffer with lookup tables only
+ * @crc: CRC of the data before @buf, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Return: the same as crc32c(), whatever the processor.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_hw_enabled - Tell whether crc32c() runs with the crc32 instruction
+ *
+ * Return: 1 if it does, 0 if it uses lookup tables.
+ */
+int crc32c_hw_enabled(void);
+
+#endif /* _CRC32C_H */
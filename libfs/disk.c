@@ -1,8 +1,16 @@
+#define _GNU_SOURCE /* for copy_file_range() and fallocate() */
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -13,32 +21,714 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Most images a striped volume is made of */
+#define STRIPE_MEMBERS_MAX 16
+
+/* Most blocks handed to the members of a striped volume at once */
+#define STRIPE_READ_MAX 64
+
+/* Most blocks written at once, as a single range write */
+#define WRITE_RUN_MAX 64
+
+/* Share of the write-back cache, in percent, dirty enough to start a pass */
+#define WRITEBACK_BACKGROUND 50
+
+/* State of a write-back buffer */
+enum {
+	WB_FREE,
+	WB_DIRTY,
+	WB_FLUSHING,	/* being written back, writers wait for it */
+};
+
+/* Image of a striped volume, with the thread reading its share of the blocks */
+struct member {
+	/* File descriptor */
+	int fd;
+	/* Thread serving the reads of block_read_many() */
+	pthread_t thread;
+	/* Blocks of the image to read and where to, while busy */
+	size_t blocks[STRIPE_READ_MAX];
+	uint8_t *bufs[STRIPE_READ_MAX];
+	size_t count;
+	int busy;
+	/* Result of the last reads */
+	int error;
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Content of a RAM disk, NULL for a disk backed by its file */
+	uint8_t *mem;
+	/* Image a RAM disk was loaded from, NULL if created empty */
+	char *path;
+	/* Blocks of a RAM disk written since it was loaded or saved, one bit each */
+	uint8_t *dirty;
+	/* Images of a striped volume, NULL for a single image */
+	struct member *members;
+	size_t members_num;
+	/* Consecutive blocks of a striped volume on the same image */
+	size_t unit;
+	/* Protects the members' work, and the fields below */
+	pthread_mutex_t lock;
+	/* A member got blocks to read, or the members should exit */
+	pthread_cond_t work;
+	/* The last busy member is done */
+	pthread_cond_t done;
+	size_t busy_num;
+	int stopping;
+	/* Serializes the calls to block_read_many() on a striped volume */
+	pthread_mutex_t read_lock;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = {
+	.fd = INVALID_FD,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.read_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Write-back cache of the open disk, see block_writeback() */
+struct writeback {
+	/* Most blocks held dirty, 0 when writes go straight to the image */
+	size_t max;
+	/* Age at which a dirty block is written back, in ms, 0 for no limit */
+	unsigned int expire_ms;
+	/* max buffers of a block each */
+	uint8_t *mem;
+	/* Block held by each buffer, its state and when it got dirty */
+	size_t *blocks;
+	uint8_t *state;
+	uint64_t *dirtied;
+	/* Buffer holding each block of the disk, -1 if none */
+	int *slot;
+	/* Stack of the buffers not in use */
+	int *free;
+	size_t free_num;
+	/* Blocks of the pass in progress, in order */
+	size_t *pass;
+	size_t dirty_num;
+	size_t flushing_num;
+	/* A caller waits for every dirty block to be written back */
+	int flush_all;
+	/* A pass failed, passes only run on request until it is reported */
+	int error;
+	int stopping;
+	/* Thread writing the dirty blocks back */
+	pthread_t thread;
+	/* Protects everything above but max, set while no I/O runs */
+	pthread_mutex_t lock;
+	/* Blocks got dirty, a flush is requested or the thread should exit */
+	pthread_cond_t kick;
+	/* A pass completed */
+	pthread_cond_t cleaned;
+};
+
+static struct writeback wb = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cleaned = PTHREAD_COND_INITIALIZER,
+};
+
+static int disk_is_open(void)
+{
+	return disk.fd != INVALID_FD || disk.mem != NULL || disk.members != NULL;
+}
+
+/*
+ * Locate logical block @block of a striped volume: stripes of disk.unit blocks
+ * go to the images in turn. Return the image and set @mblock to the block in
+ * it.
+ */
+static struct member *stripe_map(size_t block, size_t *mblock)
+{
+	size_t stripe = block / disk.unit;
+
+	*mblock = stripe / disk.members_num * disk.unit + block % disk.unit;
+
+	return &disk.members[stripe % disk.members_num];
+}
+
+/* Read @count blocks of @fd from @block into @buf, all of them or fail */
+static int fd_read_run(int fd, size_t block, size_t count, uint8_t *buf)
+{
+	size_t len = count * BLOCK_SIZE, done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, block * BLOCK_SIZE + done);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pread");
+			else
+				block_error("unexpected end of image");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Read the blocks handed to @m, runs of adjacent blocks at once */
+static int member_read(struct member *m)
+{
+	size_t i, end;
+
+	for (i = 0; i < m->count; i = end) {
+		for (end = i + 1; end < m->count; end++) {
+			if (m->blocks[end] != m->blocks[end - 1] + 1 ||
+			    m->bufs[end] != m->bufs[end - 1] + BLOCK_SIZE)
+				break;
+		}
+		if (fd_read_run(m->fd, m->blocks[i], end - i, m->bufs[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *member_thread(void *arg)
+{
+	struct member *m = arg;
+
+	pthread_mutex_lock(&disk.lock);
+	for (;;) {
+		while (!m->busy && !disk.stopping)
+			pthread_cond_wait(&disk.work, &disk.lock);
+		if (!m->busy)
+			break;
+		pthread_mutex_unlock(&disk.lock);
+
+		m->error = member_read(m);
+
+		pthread_mutex_lock(&disk.lock);
+		m->busy = 0;
+		if (--disk.busy_num == 0)
+			pthread_cond_signal(&disk.done);
+	}
+	pthread_mutex_unlock(&disk.lock);
+
+	return NULL;
+}
+
+/* Stop the threads of the first @count members, and close their images */
+static void stripe_close(size_t count)
+{
+	size_t i;
+
+	pthread_mutex_lock(&disk.lock);
+	disk.stopping = 1;
+	pthread_cond_broadcast(&disk.work);
+	pthread_mutex_unlock(&disk.lock);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(disk.members[i].thread, NULL);
+		close(disk.members[i].fd);
+	}
+
+	free(disk.members);
+	disk.members = NULL;
+	disk.members_num = 0;
+	disk.stopping = 0;
+}
+
+/*
+ * Open striped volume @spec, "<unit>:<image>,<image>,...". Every image holds
+ * the same number of whole stripes, the smallest one sets it.
+ */
+static int stripe_open(const char *spec)
+{
+	char *list, *name, *save, *end;
+	size_t unit, bcount = 0;
+	struct stat st;
+	int fd;
+
+	unit = strtoul(spec, &end, 10);
+	if (end == spec || *end != ':' || !unit) {
+		block_error("invalid stripe unit");
+		return -1;
+	}
+
+	list = strdup(end + 1);
+	disk.members = calloc(STRIPE_MEMBERS_MAX, sizeof(struct member));
+	if (!list || !disk.members) {
+		perror("malloc");
+		free(list);
+		free(disk.members);
+		disk.members = NULL;
+		return -1;
+	}
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (disk.members_num == STRIPE_MEMBERS_MAX) {
+			block_error("more than %d images", STRIPE_MEMBERS_MAX);
+			goto fail;
+		}
+		if ((fd = open(name, O_RDWR, 0644)) < 0) {
+			perror("open");
+			goto fail;
+		}
+		if (fstat(fd, &st)) {
+			perror("fstat");
+			close(fd);
+			goto fail;
+		}
+		if (st.st_size % BLOCK_SIZE != 0) {
+			block_error("size '%zu' of '%s' is not multiple of '%d'",
+				    st.st_size, name, BLOCK_SIZE);
+			close(fd);
+			goto fail;
+		}
+		if (!disk.members_num || st.st_size / BLOCK_SIZE < bcount)
+			bcount = st.st_size / BLOCK_SIZE;
+
+		disk.members[disk.members_num].fd = fd;
+		if (pthread_create(&disk.members[disk.members_num].thread, NULL,
+				   member_thread, &disk.members[disk.members_num])) {
+			block_error("cannot start thread for '%s'", name);
+			close(fd);
+			goto fail;
+		}
+		disk.members_num++;
+	}
+
+	if (!disk.members_num || bcount < unit) {
+		block_error("no image holds a whole stripe");
+		goto fail;
+	}
+
+	free(list);
+	disk.unit = unit;
+	disk.bcount = bcount / unit * unit * disk.members_num;
+
+	return 0;
+
+fail:
+	free(list);
+	stripe_close(disk.members_num);
+	return -1;
+}
+
+/*
+ * Set up a RAM disk of @bcount blocks, zero-filled if @fd is invalid or holding
+ * image @fd otherwise. The image is mapped privately: its blocks are only
+ * read when first accessed and writes never reach it.
+ */
+static int ram_map(int fd, size_t bcount)
+{
+	void *mem;
+
+	disk.dirty = calloc((bcount + 7) / 8, 1);
+	if (!disk.dirty) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (fd == INVALID_FD)
+		mem = mmap(NULL, bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+		mem = mmap(NULL, bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		free(disk.dirty);
+		disk.dirty = NULL;
+		return -1;
+	}
+
+	disk.mem = mem;
+	disk.bcount = bcount;
+
+	return 0;
+}
+
+static int ram_is_dirty(size_t block)
+{
+	return disk.dirty[block / 8] & (1 << (block % 8));
+}
+
+static int ram_is_zero(size_t block)
+{
+	const uint8_t *data = disk.mem + block * BLOCK_SIZE;
+
+	return data[0] == 0 && !memcmp(data, data + 1, BLOCK_SIZE - 1);
+}
+
+/* Give the space of @count blocks of @fd from @block back to its file system */
+static int fd_punch(int fd, size_t block, size_t count)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block * BLOCK_SIZE, count * BLOCK_SIZE) < 0) {
+		perror("fallocate");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the blocks of the RAM disk into @fd, only the dirty ones if @dirty.
+ * Zero blocks are left as holes in an image written whole, which must be
+ * empty, and punched out of it otherwise where its file system allows.
+ */
+static int ram_write(int fd, int dirty)
+{
+	size_t block, end;
+	ssize_t ret;
+	int zero;
+
+	for (block = 0; block < disk.bcount; block = end) {
+		if (dirty && !ram_is_dirty(block)) {
+			end = block + 1;
+			continue;
+		}
+		/* Write runs of blocks at once, and skip runs of zero blocks */
+		zero = ram_is_zero(block);
+		for (end = block + 1; end < disk.bcount; end++) {
+			if ((dirty && !ram_is_dirty(end)) || ram_is_zero(end) != zero)
+				break;
+		}
+		if (zero && (!dirty || !fd_punch(fd, block, end - block))) {
+			block = end;
+			continue;
+		}
+		while (block < end) {
+			ret = pwrite(fd, disk.mem + block * BLOCK_SIZE,
+				     (end - block) * BLOCK_SIZE, block * BLOCK_SIZE);
+			if (ret < 0) {
+				perror("pwrite");
+				return -1;
+			}
+			/* Short writes end on a block boundary, or are redone */
+			block += ret / BLOCK_SIZE;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Write the @count blocks of @iov to @fd from @block, all of them or fail */
+static int fd_write_run(int fd, size_t block, struct iovec *iov, size_t count)
+{
+	ssize_t ret;
+
+	while (count) {
+		ret = pwritev(fd, iov, count, block * BLOCK_SIZE);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pwritev");
+			else
+				block_error("nothing written");
+			return -1;
+		}
+		/* Short writes end on a block boundary, or are redone */
+		block += ret / BLOCK_SIZE;
+		iov += ret / BLOCK_SIZE;
+		count -= ret / BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+/* Return the image holding block @block, and set @fblock to the block in it */
+static int block_fd(size_t block, size_t *fblock)
+{
+	if (disk.members)
+		return stripe_map(block, fblock)->fd;
+
+	*fblock = block;
+
+	return disk.fd;
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Write blocks @blocks[0] to @blocks[@count - 1] to the images, runs of
+ * adjacent ones at once, from @buf one after the other, or from their buffer
+ * of the write-back cache if @buf is NULL
+ */
+static int disk_write_many(const size_t *blocks, size_t count,
+			   const uint8_t *buf)
+{
+	struct iovec iov[WRITE_RUN_MAX];
+	size_t i, n, first, fblock;
+	int fd, run_fd;
+
+	for (i = 0; i < count; i += n) {
+		run_fd = block_fd(blocks[i], &first);
+		for (n = 0; i + n < count && n < WRITE_RUN_MAX; n++) {
+			fd = block_fd(blocks[i + n], &fblock);
+			if (fd != run_fd || fblock != first + n)
+				break;
+			/* Buffers being written back are left alone by the others */
+			if (buf)
+				iov[n].iov_base = (uint8_t *)buf + (i + n) * BLOCK_SIZE;
+			else
+				iov[n].iov_base = wb.mem + (size_t)wb.slot[blocks[i + n]] * BLOCK_SIZE;
+			iov[n].iov_len = BLOCK_SIZE;
+		}
+		if (fd_write_run(run_fd, first, iov, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Write back the @count blocks of the pass, in order */
+static int writeback_pass(size_t count)
+{
+	qsort(wb.pass, count, sizeof(*wb.pass), block_cmp);
+
+	return disk_write_many(wb.pass, count, NULL);
+}
+
+/*
+ * Write back the dirty blocks once the oldest one expires, or as soon as
+ * WRITEBACK_BACKGROUND percent of the cache is dirty, in which case every
+ * dirty block goes.
+ */
+static void *writeback_thread(void *arg)
+{
+	uint64_t now, oldest, cutoff;
+	struct timespec ts;
+	size_t i, count;
+	int s, ret;
+
+	(void)arg;
+
+	pthread_mutex_lock(&wb.lock);
+	for (;;) {
+		oldest = UINT64_MAX;
+		for (i = 0; i < wb.max; i++) {
+			if (wb.state[i] == WB_DIRTY && wb.dirtied[i] < oldest)
+				oldest = wb.dirtied[i];
+		}
+		now = now_ms();
+
+		if (wb.flush_all || (!wb.error &&
+		    wb.dirty_num * 100 >= wb.max * WRITEBACK_BACKGROUND)) {
+			cutoff = UINT64_MAX;
+		} else if (!wb.error && wb.expire_ms && oldest != UINT64_MAX &&
+			   oldest + wb.expire_ms <= now) {
+			cutoff = now - wb.expire_ms;
+		} else if (wb.stopping) {
+			break;
+		} else {
+			/* Sleep until the oldest dirty block expires */
+			if (wb.error || !wb.expire_ms || oldest == UINT64_MAX) {
+				pthread_cond_wait(&wb.kick, &wb.lock);
+				continue;
+			}
+			ts.tv_sec = (oldest + wb.expire_ms) / 1000;
+			ts.tv_nsec = (oldest + wb.expire_ms) % 1000 * 1000000;
+			pthread_cond_timedwait(&wb.kick, &wb.lock, &ts);
+			continue;
+		}
+
+		count = 0;
+		for (i = 0; i < wb.max; i++) {
+			if (wb.state[i] == WB_DIRTY && wb.dirtied[i] <= cutoff) {
+				wb.state[i] = WB_FLUSHING;
+				wb.pass[count++] = wb.blocks[i];
+			}
+		}
+		wb.dirty_num -= count;
+		wb.flushing_num = count;
+		wb.flush_all = 0;
+		pthread_mutex_unlock(&wb.lock);
+
+		ret = writeback_pass(count);
+
+		pthread_mutex_lock(&wb.lock);
+		for (i = 0; i < count; i++) {
+			s = wb.slot[wb.pass[i]];
+			if (ret) {
+				wb.state[s] = WB_DIRTY;
+				continue;
+			}
+			wb.state[s] = WB_FREE;
+			wb.slot[wb.pass[i]] = -1;
+			wb.free[wb.free_num++] = s;
+		}
+		wb.flushing_num = 0;
+		if (ret) {
+			wb.dirty_num += count;
+			wb.error = 1;
+		}
+		pthread_cond_broadcast(&wb.cleaned);
+	}
+	pthread_mutex_unlock(&wb.lock);
+
+	return NULL;
+}
+
+/* Cache block @block, waiting for a pass while the cache is full */
+static int writeback_write(size_t block, const void *buf)
+{
+	int s;
+
+	pthread_mutex_lock(&wb.lock);
+	for (;;) {
+		s = wb.slot[block];
+		if (s >= 0 && wb.state[s] == WB_DIRTY)
+			break;
+		if (s < 0 && wb.free_num) {
+			s = wb.free[--wb.free_num];
+			wb.slot[block] = s;
+			wb.blocks[s] = block;
+			wb.state[s] = WB_DIRTY;
+			wb.dirtied[s] = now_ms();
+			/* A first block to expire, or enough for a pass */
+			if (wb.dirty_num++ == 0 ||
+			    wb.dirty_num * 100 >= wb.max * WRITEBACK_BACKGROUND)
+				pthread_cond_signal(&wb.kick);
+			break;
+		}
+		if (s < 0 && wb.error) {
+			pthread_mutex_unlock(&wb.lock);
+			block_error("cache full and write-back failing");
+			return -1;
+		}
+		/* Being written back, or no buffer left: wait for the pass */
+		pthread_cond_wait(&wb.cleaned, &wb.lock);
+	}
+	memcpy(wb.mem + (size_t)s * BLOCK_SIZE, buf, BLOCK_SIZE);
+	pthread_mutex_unlock(&wb.lock);
+
+	return 0;
+}
+
+/* Copy the cached blocks among @blocks into @buf, and flag them in @cached */
+static void writeback_read(const size_t *blocks, size_t count, uint8_t *buf,
+			   uint8_t *cached)
+{
+	size_t i;
+	int s;
+
+	pthread_mutex_lock(&wb.lock);
+	for (i = 0; i < count; i++) {
+		s = wb.slot[blocks[i]];
+		cached[i] = s >= 0;
+		if (s >= 0)
+			memcpy(buf + i * BLOCK_SIZE,
+			       wb.mem + (size_t)s * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&wb.lock);
+}
+
+/* Wait until every dirty block is written back */
+static int writeback_flush(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&wb.lock);
+	while ((wb.dirty_num || wb.flushing_num) && !wb.error) {
+		wb.flush_all = 1;
+		pthread_cond_signal(&wb.kick);
+		pthread_cond_wait(&wb.cleaned, &wb.lock);
+	}
+	if (wb.error) {
+		block_error("cannot write back dirty blocks");
+		wb.error = 0;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&wb.lock);
+
+	return ret;
+}
+
+static void writeback_free(void)
+{
+	free(wb.mem);
+	free(wb.blocks);
+	free(wb.state);
+	free(wb.dirtied);
+	free(wb.slot);
+	free(wb.free);
+	free(wb.pass);
+	wb.mem = NULL;
+	wb.blocks = NULL;
+	wb.state = NULL;
+	wb.dirtied = NULL;
+	wb.slot = NULL;
+	wb.free = NULL;
+	wb.pass = NULL;
+	wb.max = 0;
+}
+
+/*
+ * Write back the cache and stop its thread, even if the dirty blocks cannot be
+ * written back when @force
+ */
+static int writeback_stop(int force)
+{
+	int ret = writeback_flush();
+
+	if (ret && !force)
+		return -1;
+
+	pthread_mutex_lock(&wb.lock);
+	wb.stopping = 1;
+	pthread_cond_signal(&wb.kick);
+	pthread_mutex_unlock(&wb.lock);
+
+	pthread_join(wb.thread, NULL);
+	pthread_cond_destroy(&wb.kick);
+
+	writeback_free();
+	wb.dirty_num = 0;
+	wb.error = 0;
+	wb.stopping = 0;
+
+	return ret;
+}
 
 int block_disk_open(const char *diskname)
 {
 	int fd;
 	struct stat st;
+	int ram = 0;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk_is_open()) {
 		block_error("disk already open");
 		return -1;
 	}
 
+	if (!strncmp(diskname, BLOCK_STRIPE_PREFIX, strlen(BLOCK_STRIPE_PREFIX)))
+		return stripe_open(diskname + strlen(BLOCK_STRIPE_PREFIX));
+
+	if (!strncmp(diskname, BLOCK_RAM_PREFIX, strlen(BLOCK_RAM_PREFIX))) {
+		diskname += strlen(BLOCK_RAM_PREFIX);
+		ram = 1;
+	}
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -56,29 +746,187 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if (ram) {
+		/* The image is only written again when the disk is saved */
+		disk.path = strdup(diskname);
+		if (!disk.path || !st.st_size ||
+		    ram_map(fd, st.st_size / BLOCK_SIZE)) {
+			free(disk.path);
+			disk.path = NULL;
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		return 0;
+	}
+
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
 
 	return 0;
 }
 
+int block_disk_create(size_t bcount)
+{
+	if (disk_is_open()) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if (!bcount) {
+		block_error("invalid block count");
+		return -1;
+	}
+
+	return ram_map(INVALID_FD, bcount);
+}
+
+/* Write the RAM disk into @filename, then flush it to storage if @sync */
+static int ram_save(const char *filename, int sync)
+{
+	struct stat st;
+	int fd, same;
+
+	/*
+	 * The image the disk was loaded from only misses the dirty blocks,
+	 * others are written whole, sparse
+	 */
+	same = disk.path && !strcmp(filename, disk.path);
+	if ((fd = open(filename, O_WRONLY | O_CREAT | (same ? 0 : O_TRUNC),
+		       0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (ram_write(fd, same)) {
+		close(fd);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size != disk.bcount * BLOCK_SIZE &&
+	    ftruncate(fd, disk.bcount * BLOCK_SIZE) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	if (sync && fdatasync(fd) < 0) {
+		perror("fdatasync");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (same)
+		memset(disk.dirty, 0, (disk.bcount + 7) / 8);
+
+	return 0;
+}
+
+int block_disk_save(const char *filename)
+{
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!disk.mem)
+		return 0; /* every write already went to the image */
+
+	if (!filename)
+		filename = disk.path;
+	if (!filename) {
+		block_error("no image to save the disk to");
+		return -1;
+	}
+
+	return ram_save(filename, 0);
+}
+
+int block_disk_sync(void)
+{
+	size_t i;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.mem) {
+		/* Nothing outlives a RAM disk created empty */
+		if (!disk.path)
+			return 0;
+		return ram_save(disk.path, 1);
+	}
+
+	if (wb.max && writeback_flush())
+		return -1;
+
+	if (disk.members) {
+		for (i = 0; i < disk.members_num; i++) {
+			if (fdatasync(disk.members[i].fd) < 0) {
+				perror("fdatasync");
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (fdatasync(disk.fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret = 0;
+
+	if (!disk_is_open()) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
+	if (disk.mem) {
+		/* A RAM disk loaded from an image is written back to it */
+		if (disk.path)
+			ret = block_disk_save(NULL);
+		munmap(disk.mem, disk.bcount * BLOCK_SIZE);
+		free(disk.path);
+		free(disk.dirty);
+		disk.mem = NULL;
+		disk.path = NULL;
+		disk.dirty = NULL;
+		return ret;
+	}
+
+	if (wb.max)
+		ret = writeback_stop(1);
+
+	if (disk.members) {
+		stripe_close(disk.members_num);
+		return ret;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
 
-	return 0;
+	return ret;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk_is_open()) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -88,7 +936,7 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk_is_open()) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -99,6 +947,25 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
+	if (disk.mem) {
+		memcpy(disk.mem + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		disk.dirty[block / 8] |= 1 << (block % 8);
+		return 0;
+	}
+
+	if (wb.max)
+		return writeback_write(block, buf);
+
+	if (disk.members) {
+		struct member *m = stripe_map(block, &block);
+
+		if (pwrite(m->fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		return 0;
+	}
+
 	/* Move to the specified block number */
 	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
 		perror("lseek");
@@ -116,7 +983,9 @@ int block_write(size_t block, const void *buf)
 
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	uint8_t cached;
+
+	if (!disk_is_open()) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -127,6 +996,23 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
+	if (disk.mem) {
+		memcpy(buf, disk.mem + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (wb.max) {
+		writeback_read(&block, 1, buf, &cached);
+		if (cached)
+			return 0;
+	}
+
+	if (disk.members) {
+		struct member *m = stripe_map(block, &block);
+
+		return fd_read_run(m->fd, block, 1, buf);
+	}
+
 	/* Move to the specified block number */
 	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
 		perror("lseek");
@@ -142,3 +1028,449 @@ int block_read(size_t block, void *buf)
 	return 0;
 }
 
+
+int block_map(void *addr, size_t block, size_t count, int writable)
+{
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+	struct member *m;
+	size_t mblock, run;
+	uint8_t *dst = addr;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count, disk.bcount);
+		return -1;
+	}
+
+	/* The content of a RAM disk lives in a private mapping of its own */
+	if (disk.mem || sysconf(_SC_PAGESIZE) != BLOCK_SIZE)
+		return -1;
+
+	/* The mapping shows the image, which must not miss cached writes */
+	if (wb.max && writeback_flush())
+		return -1;
+
+	if (!disk.members) {
+		if (mmap(dst, count * BLOCK_SIZE, prot, MAP_SHARED | MAP_FIXED,
+			 disk.fd, block * BLOCK_SIZE) == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Map a striped volume a stripe unit at most at a time */
+	while (count) {
+		run = disk.unit - block % disk.unit;
+		if (run > count)
+			run = count;
+		m = stripe_map(block, &mblock);
+		if (mmap(dst, run * BLOCK_SIZE, prot, MAP_SHARED | MAP_FIXED,
+			 m->fd, mblock * BLOCK_SIZE) == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		dst += run * BLOCK_SIZE;
+		block += run;
+		count -= run;
+	}
+
+	return 0;
+}
+
+/* Read up to STRIPE_READ_MAX blocks of a striped volume, every image at once */
+static int stripe_read_many(const size_t *blocks, size_t count, uint8_t *buf)
+{
+	struct member *m, *own = NULL;
+	size_t mblock, i;
+	int ret;
+
+	for (i = 0; i < disk.members_num; i++)
+		disk.members[i].count = 0;
+	for (i = 0; i < count; i++) {
+		m = stripe_map(blocks[i], &mblock);
+		m->blocks[m->count] = mblock;
+		m->bufs[m->count++] = buf + i * BLOCK_SIZE;
+	}
+
+	/* The caller reads the share of the first image itself */
+	pthread_mutex_lock(&disk.lock);
+	for (i = 0; i < disk.members_num; i++) {
+		m = &disk.members[i];
+		if (!m->count)
+			continue;
+		if (!own) {
+			own = m;
+			continue;
+		}
+		m->busy = 1;
+		disk.busy_num++;
+	}
+	if (disk.busy_num)
+		pthread_cond_broadcast(&disk.work);
+	pthread_mutex_unlock(&disk.lock);
+
+	ret = member_read(own);
+
+	pthread_mutex_lock(&disk.lock);
+	while (disk.busy_num)
+		pthread_cond_wait(&disk.done, &disk.lock);
+	pthread_mutex_unlock(&disk.lock);
+
+	for (i = 0; i < disk.members_num; i++) {
+		m = &disk.members[i];
+		if (m != own && m->count && m->error)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Read @count blocks from the image, bypassing the write-back cache */
+static int disk_read_many(const size_t *blocks, size_t count, uint8_t *buf)
+{
+	size_t i, end, n;
+	int ret = 0;
+
+	if (disk.mem) {
+		for (i = 0; i < count; i++)
+			memcpy(buf + i * BLOCK_SIZE,
+			       disk.mem + blocks[i] * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (disk.members) {
+		pthread_mutex_lock(&disk.read_lock);
+		for (i = 0; i < count && !ret; i += n) {
+			n = count - i < STRIPE_READ_MAX ? count - i : STRIPE_READ_MAX;
+			ret = stripe_read_many(blocks + i, n, buf + i * BLOCK_SIZE);
+		}
+		pthread_mutex_unlock(&disk.read_lock);
+		return ret;
+	}
+
+	/* Read runs of adjacent blocks at once */
+	for (i = 0; i < count; i = end) {
+		for (end = i + 1; end < count; end++) {
+			if (blocks[end] != blocks[end - 1] + 1)
+				break;
+		}
+		if (fd_read_run(disk.fd, blocks[i], end - i, buf + i * BLOCK_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+int block_read_many(const size_t *blocks, size_t count, void *buf)
+{
+	uint8_t cached[STRIPE_READ_MAX];
+	uint8_t *dst = buf;
+	size_t i, j, end, n;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i] >= disk.bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    blocks[i], disk.bcount);
+			return -1;
+		}
+	}
+
+	if (!wb.max)
+		return disk_read_many(blocks, count, dst);
+
+	/*
+	 * Cached blocks are copied before the others are read: a block missing
+	 * from the cache is already written back
+	 */
+	for (i = 0; i < count; i += n) {
+		n = count - i < STRIPE_READ_MAX ? count - i : STRIPE_READ_MAX;
+		writeback_read(blocks + i, n, dst + i * BLOCK_SIZE, cached);
+		for (j = 0; j < n; j = end) {
+			if (cached[j]) {
+				end = j + 1;
+				continue;
+			}
+			/* Read runs of blocks missing from the cache at once */
+			for (end = j + 1; end < n; end++) {
+				if (cached[end])
+					break;
+			}
+			if (disk_read_many(blocks + i + j, end - j,
+					   dst + (i + j) * BLOCK_SIZE))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+int block_write_many(const size_t *blocks, size_t count, const void *buf)
+{
+	const uint8_t *src = buf;
+	size_t i;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i] >= disk.bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    blocks[i], disk.bcount);
+			return -1;
+		}
+	}
+
+	if (disk.mem) {
+		for (i = 0; i < count; i++) {
+			memcpy(disk.mem + blocks[i] * BLOCK_SIZE,
+			       src + i * BLOCK_SIZE, BLOCK_SIZE);
+			disk.dirty[blocks[i] / 8] |= 1 << (blocks[i] % 8);
+		}
+		return 0;
+	}
+
+	/* The cache merges adjacent blocks when it writes them back */
+	if (wb.max) {
+		for (i = 0; i < count; i++) {
+			if (writeback_write(blocks[i], src + i * BLOCK_SIZE))
+				return -1;
+		}
+		return 0;
+	}
+
+	return disk_write_many(blocks, count, src);
+}
+
+/*
+ * Copy @count bytes of @in_fd from @in_off to @out_fd at @out_off within the
+ * kernel, or through a bounce buffer where copy_file_range() is not supported
+ */
+static int fd_copy_run(int in_fd, off_t in_off, int out_fd, off_t out_off,
+		       size_t count)
+{
+	uint8_t buf[BLOCK_SIZE];
+	ssize_t ret;
+	size_t n;
+
+	while (count) {
+		ret = copy_file_range(in_fd, &in_off, out_fd, &out_off, count, 0);
+		if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP))
+			break;
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("copy_file_range");
+			else
+				block_error("nothing copied");
+			return -1;
+		}
+		count -= ret;
+	}
+
+	while (count) {
+		n = count < BLOCK_SIZE ? count : BLOCK_SIZE;
+		ret = pread(in_fd, buf, n, in_off);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pread");
+			else
+				block_error("nothing read");
+			return -1;
+		}
+		if (pwrite(out_fd, buf, ret, out_off) != ret) {
+			perror("pwrite");
+			return -1;
+		}
+		in_off += ret;
+		out_off += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+int block_copy(size_t src, size_t dst, size_t count)
+{
+	uint8_t buf[BLOCK_SIZE];
+	size_t i, n, sfirst, dfirst, sblock, dblock;
+	int sfd, dfd;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (src + count > disk.bcount || dst + count > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    (src > dst ? src : dst) + count, disk.bcount);
+		return -1;
+	}
+
+	if (src < dst + count && dst < src + count) {
+		block_error("overlapping blocks");
+		return -1;
+	}
+
+	if (disk.mem) {
+		memcpy(disk.mem + dst * BLOCK_SIZE, disk.mem + src * BLOCK_SIZE,
+		       count * BLOCK_SIZE);
+		for (i = 0; i < count; i++)
+			disk.dirty[(dst + i) / 8] |= 1 << ((dst + i) % 8);
+		return 0;
+	}
+
+	/* Cached blocks may be newer than the images: copy through the cache */
+	if (wb.max) {
+		for (i = 0; i < count; i++) {
+			if (block_read(src + i, buf) || block_write(dst + i, buf))
+				return -1;
+		}
+		return 0;
+	}
+
+	/* Runs of blocks adjacent in the images on both sides at once */
+	for (i = 0; i < count; i += n) {
+		sfd = block_fd(src + i, &sfirst);
+		dfd = block_fd(dst + i, &dfirst);
+		for (n = 1; i + n < count; n++) {
+			if (block_fd(src + i + n, &sblock) != sfd ||
+			    block_fd(dst + i + n, &dblock) != dfd ||
+			    sblock != sfirst + n || dblock != dfirst + n)
+				break;
+		}
+		if (fd_copy_run(sfd, sfirst * BLOCK_SIZE, dfd,
+				dfirst * BLOCK_SIZE, n * BLOCK_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	size_t i, n, first, fblock;
+	int fd;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count, disk.bcount);
+		return -1;
+	}
+
+	if (disk.mem) {
+		/* Zero blocks are punched out when the disk is saved */
+		memset(disk.mem + block * BLOCK_SIZE, 0, count * BLOCK_SIZE);
+		for (i = block; i < block + count; i++)
+			disk.dirty[i / 8] |= 1 << (i % 8);
+		return 0;
+	}
+
+	/* Cached blocks must not be written back over the holes */
+	if (wb.max && writeback_flush())
+		return -1;
+
+	/* Runs of blocks adjacent in the images at once */
+	for (i = 0; i < count; i += n) {
+		fd = block_fd(block + i, &first);
+		for (n = 1; i + n < count; n++) {
+			if (block_fd(block + i + n, &fblock) != fd ||
+			    fblock != first + n)
+				break;
+		}
+		if (fd_punch(fd, first, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+int block_writeback(size_t dirty_max, unsigned int expire_ms)
+{
+	pthread_condattr_t attr;
+	size_t i;
+
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* A RAM disk is written at memory speed already */
+	if (disk.mem)
+		return -1;
+
+	if (wb.max && writeback_stop(0))
+		return -1;
+
+	if (!dirty_max)
+		return 0;
+	if (dirty_max > disk.bcount)
+		dirty_max = disk.bcount;
+
+	if (posix_memalign((void **)&wb.mem, BLOCK_SIZE, dirty_max * BLOCK_SIZE))
+		wb.mem = NULL;
+	wb.blocks = malloc(dirty_max * sizeof(*wb.blocks));
+	wb.state = calloc(dirty_max, sizeof(*wb.state));
+	wb.dirtied = malloc(dirty_max * sizeof(*wb.dirtied));
+	wb.slot = malloc(disk.bcount * sizeof(*wb.slot));
+	wb.free = malloc(dirty_max * sizeof(*wb.free));
+	wb.pass = malloc(dirty_max * sizeof(*wb.pass));
+	if (!wb.mem || !wb.blocks || !wb.state || !wb.dirtied || !wb.slot ||
+	    !wb.free || !wb.pass) {
+		perror("malloc");
+		writeback_free();
+		return -1;
+	}
+	for (i = 0; i < disk.bcount; i++)
+		wb.slot[i] = -1;
+	for (i = 0; i < dirty_max; i++)
+		wb.free[i] = dirty_max - 1 - i;
+	wb.free_num = dirty_max;
+	wb.max = dirty_max;
+	wb.expire_ms = expire_ms;
+
+	/* Expiry times are taken from the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb.kick, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&wb.thread, NULL, writeback_thread, NULL)) {
+		block_error("cannot start write-back thread");
+		pthread_cond_destroy(&wb.kick);
+		writeback_free();
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_flush(void)
+{
+	if (!disk_is_open()) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!wb.max)
+		return 0;
+
+	return writeback_flush();
+}
@@ -6,6 +6,12 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Prefix of the disk names that load the virtual disk file in memory */
+#define BLOCK_RAM_PREFIX "ram:"
+
+/** Prefix of the disk names that open a volume striped across several files */
+#define BLOCK_STRIPE_PREFIX "stripe:"
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,15 +20,71 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * If @diskname starts with %BLOCK_RAM_PREFIX, the rest of it names a virtual
+ * disk file that is loaded in memory as a RAM disk: reads and writes never
+ * reach the file, which is only written back by block_disk_save() or when
+ * the disk is closed after being modified.
+ *
+ * If @diskname starts with %BLOCK_STRIPE_PREFIX, the rest of it reads
+ * "<unit>:<file>,<file>,..." and names up to 16 virtual disk files that make
+ * one volume: its blocks are striped across the files, @unit consecutive
+ * blocks to each in turn. Every file holds as many whole stripes as the
+ * smallest one, so a volume of N files of S blocks has N * S blocks when S is a
+ * multiple of @unit.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_create - Create an empty RAM disk
+ * @bcount: Number of blocks of the disk
+ *
+ * Open a RAM disk of @bcount zero-filled blocks, backed by no file. Its content
+ * is lost when it is closed, unless it is first saved with block_disk_save().
+ *
+ * Return: -1 if @bcount is 0, if a virtual disk is already open or if memory
+ * cannot be allocated. 0 otherwise.
+ */
+int block_disk_create(size_t bcount);
+
+/**
+ * block_disk_save - Save a RAM disk to a file
+ * @filename: Name of the file to write, NULL for the file the disk was loaded from
+ *
+ * Write the whole content of the currently open RAM disk into @filename,
+ * created if needed, which can then be opened as a virtual disk file. Zero
+ * blocks are left as holes, so that the file is sparse. Disks that are not in
+ * memory have nothing to save.
+ *
+ * Return: -1 if there is no disk currently open, if @filename is NULL for a
+ * disk created empty, or if the file cannot be written. 0 otherwise.
+ */
+int block_disk_save(const char *filename);
+
+/**
+ * block_disk_sync - Flush virtual disk file to storage
+ *
+ * Make every block written so far durable: the virtual disk file's data is
+ * flushed to storage with fdatasync(), every file of a striped volume, after
+ * the blocks held by the write-back cache are written back. A RAM disk loaded
+ * from a virtual disk file is first written back to it; one created empty has
+ * nothing to flush.
+ *
+ * Return: -1 if there is no disk currently open or if flushing fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * A RAM disk loaded from a virtual disk file is written back to it if it was
+ * modified, and so are the blocks held by the write-back cache.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a RAM disk or
+ * cached blocks could not be written back. 0 otherwise.
  */
 int block_disk_close(void);
 
@@ -60,5 +122,122 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_read_many - Read several blocks from disk
+ * @blocks: Indexes of the blocks to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @blocks[0] to @blocks[@count - 1]
+ * into buffer @buf, one after the other (@count * %BLOCK_SIZE bytes). Runs of
+ * adjacent blocks are read at once, and the files of a striped volume are all
+ * read in parallel.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if a reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_many(const size_t *blocks, size_t count, void *buf);
+
+/**
+ * block_write_many - Write several blocks to disk
+ * @blocks: Indexes of the blocks to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write buffer @buf (@count * %BLOCK_SIZE bytes) in virtual disk's blocks
+ * @blocks[0] to @blocks[@count - 1], one after the other. Runs of adjacent
+ * blocks are written at once.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if a writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_many(const size_t *blocks, size_t count, const void *buf);
+
+/**
+ * block_copy - Copy blocks within the disk
+ * @src: Index of the first block to copy
+ * @dst: Index of the first block to copy to
+ * @count: Number of consecutive blocks to copy
+ *
+ * Copy virtual disk's blocks @src to @src + @count - 1 into blocks @dst to
+ * @dst + @count - 1, without the data going through a user buffer: the virtual
+ * disk files copy it with copy_file_range(), which a file system supporting it
+ * can turn into a reflink or a server-side copy. Blocks held by the write-back
+ * cache, and systems without copy_file_range(), go through a bounce buffer.
+ *
+ * Return: -1 if the blocks are out of bounds or overlap, or if the copy fails.
+ * 0 otherwise.
+ */
+int block_copy(size_t src, size_t dst, size_t count);
+
+/**
+ * block_discard - Discard blocks of disk
+ * @block: Index of the first block to discard
+ * @count: Number of consecutive blocks to discard
+ *
+ * Tell that virtual disk's blocks @block to @block + @count - 1 hold nothing
+ * worth keeping: their space is given back to the file system of the virtual
+ * disk files by punching holes in them with fallocate(), and they read as
+ * zeros afterwards. The blocks of a RAM disk are zeroed, and left as holes
+ * when it is saved.
+ *
+ * Return: -1 if the blocks are out of bounds, or if the file system of the
+ * virtual disk files cannot punch holes. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_map - Map blocks of disk in memory
+ * @addr: Address to map the blocks at, aligned on %BLOCK_SIZE
+ * @block: Index of the first block to map
+ * @count: Number of consecutive blocks to map
+ * @writable: Non-zero to map the blocks for writing as well
+ *
+ * Map virtual disk's blocks @block to @block + @count - 1 at address @addr,
+ * replacing whatever was mapped there: reading the memory reads the blocks,
+ * and with @writable, writing it writes them. The blocks are read when first
+ * accessed, and the mapping shares the virtual disk files' page cache, so that
+ * it stays coherent with block_read() and block_write(). With the write-back
+ * cache, blocks written after the mapping is made only show in it once written
+ * back. It remains valid until it is unmapped with munmap(), even after the
+ * disk is closed.
+ *
+ * Only disks backed by files can be mapped, on systems whose page size is
+ * %BLOCK_SIZE.
+ *
+ * Return: -1 if the blocks are out of bounds, if the disk is a RAM disk or
+ * cannot be mapped. 0 otherwise.
+ */
+int block_map(void *addr, size_t block, size_t count, int writable);
+
+/**
+ * block_writeback - Cache written blocks and write them back in the background
+ * @dirty_max: Most blocks held in the cache, 0 to write blocks through again
+ * @expire_ms: Age at which a cached block is written back, 0 for no limit
+ *
+ * Have block_write() copy the blocks into a cache of @dirty_max blocks,
+ * allocated here, and return. A thread writes them back to the virtual disk
+ * files once the oldest one is @expire_ms old, or as soon as half the cache is
+ * in use, runs of adjacent blocks in a single write. When the cache is full,
+ * block_write() waits for blocks to be written back. Reads are served from
+ * the cache. The cache is written back and released when it is resized, and
+ * when the disk is closed. It must not be set up while other calls are in
+ * progress.
+ *
+ * Return: -1 if there is no disk currently open, if the disk is a RAM disk,
+ * or if the cache cannot be set up or written back. 0 otherwise.
+ */
+int block_writeback(size_t dirty_max, unsigned int expire_ms);
+
+/**
+ * block_flush - Write back the blocks held by the write-back cache
+ *
+ * Unlike block_disk_sync(), the blocks are not flushed to storage.
+ *
+ * Return: -1 if there is no disk currently open or if writing back fails. 0
+ * otherwise.
+ */
+int block_flush(void);
+
 #endif /* _DISK_H */
 
@@ -3,10 +3,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_trace.h"
+#include "lz4.h"
 
 
 struct SuperBlock {
@@ -16,470 +23,4628 @@ struct SuperBlock {
 	uint16_t data_start;
 	uint16_t data_blocks_num;
 	uint8_t  fat_blocks_num;
-	uint8_t  paddings[4079];
+	uint16_t journal_start; // first block of the metadata journal, 0 if none
+	uint16_t journal_blocks_num; // size of the journal, 0 if none
+	uint8_t  paddings[4075];
 } __attribute__((packed));
 
 struct FAT {
 	uint16_t *arr;
+	uint8_t *dirty; // one flag per FAT block, set when the block must be written back
 } __attribute__((packed));
 
+// Number of FAT entries held by each FAT block
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+
 
 struct Entry {
 	uint8_t filename[FS_FILENAME_LEN];
 	uint32_t size_file;
 	uint16_t first_data_index;
-	uint8_t  paddings[10];
+	uint8_t  flags; // ENTRY_* flags, 0 for plain files
+	uint32_t stream_len; // compressed files: length of the compressed chunks
+	uint16_t tail_index; // packed tail: fragment block holding it
+	uint16_t tail_offset; // packed tail: byte offset in that block
+	uint8_t  paddings[1];
 }__attribute__((packed));
 
+// File data is stored compressed, see zfile_write()
+#define ENTRY_COMPRESSED 0x01
+// The partial last block of the file is packed in a fragment block, see tail_pack()
+#define ENTRY_TAIL 0x02
+
+// Compressed files are split in chunks of this many bytes, each compressed
+// on its own. The chain holds the compressed chunks back to back, followed by
+// the chunk map: the uint32 stream offset of each chunk.
+#define ZCHUNK_SIZE BLOCK_SIZE
+
 struct RootDirectory {
 	struct Entry entry[FS_FILE_MAX_COUNT];
 } __attribute__((packed));
 
 
+struct OpenFile {
+	int entry_index; // index of the file's entry in rootdir
+	int ref_count; // number of descriptors sharing this object, 0 if unused
+	size_t cursor_blk; // file-relative block number of the cached chain position
+	uint16_t cursor_index; // data block index at cursor_blk, 0xFFFF if not cached
+	uint32_t *zmap; // compressed files: stream offset of each chunk
+	size_t zmap_cap; // number of offsets zmap can hold
+	uint8_t *zchunk; // compressed files: last decompressed chunk
+	long zchunk_no; // number of the chunk in zchunk, -1 if none
+	int written; // data was written since the first descriptor was opened
+	int maps; // fs_mmap() mappings, which need the blocks to stay in place
+	int maps_writable; // among them, writable ones, which need them private
+	int group; // allocation group the chain grows in, -1 until it grows
+	uint8_t *delay; // delayed allocation: data appended past the last block, NULL if none
+	size_t delay_len; // bytes in delay, which goes right after the entry's size
+};
+
 struct File {
-	uint8_t filename[FS_FILENAME_LEN];
+	struct OpenFile *of; // shared per-file object, NULL if the slot is free
 	size_t offset;
+	int next_free; // next free descriptor when on the free list
 };
 
 struct FilesTable {
 	int num_open; //initialized to 0
-	struct File file[FS_OPEN_MAX_COUNT];
+	int capacity; // number of descriptor slots currently allocated
+	int free_head; // first free descriptor, -1 if the table is full
+	struct File *file; // growable descriptor table
+	struct OpenFile open_file[FS_FILE_MAX_COUNT]; // one object per root entry
+};
+
+struct FilesTable files_table = { .free_head = -1 };
+
+// Mapping made by fs_mmap(), which holds a reference on its file like a
+// descriptor does
+struct Mapping {
+	uint8_t *base; // whole blocks, from the block holding @offset
+	size_t size;
+	struct OpenFile *of;
+	size_t offset; // range of the file asked for
+	size_t len;
+	int writable;
+	int copied; // holds a copy of the file rather than its blocks
+	struct Mapping *next;
 };
 
-struct FilesTable files_table;
+struct Mapping *mappings;
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER; // serializes the descriptor calls
 struct RootDirectory rootdir;
 struct SuperBlock super;
 struct FAT fat;
+int rootdir_dirty; // root directory must be written back
+int batch_depth; // nesting level of fs_begin(), metadata is only persisted at 0
 
-int fs_mount(const char *diskname)
+// Durability policy of the mounted image, see fs_durability()
+struct Durability {
+	int mode; // one of FS_DURABLE_*
+	unsigned int interval_ms; // group commit once the oldest change is that old, 0 for no limit
+	size_t interval_bytes; // group commit once that many bytes were written, 0 for no limit
+	int pending; // something changed since the last commit
+	size_t pending_bytes; // bytes written since the last commit
+	struct timespec first_change; // when the oldest uncommitted change was made
+	pthread_t thread; // commits changes as they get old, see commit_thread()
+	int thread_running;
+	int stopping; // the thread should exit
+	pthread_cond_t kick; // a first change was made, or the thread should exit
+};
+
+struct Durability durability = { .mode = FS_DURABLE_SYNC };
+
+// Per data block reference counts, stored in the hidden "$refcnt" file
+struct RefCount {
+	int entry_index; // root entry of the table, -1 when the image has none
+	uint16_t *arr; // number of files and snapshots holding each data block
+	uint16_t *live; // number of live files holding each data block, rebuilt at mount
+	uint8_t *dirty; // one flag per table block
+	int blocks_num; // number of blocks used by the table
+};
+
+// Name of the hidden file holding the reference count table
+#define REFCNT_FILENAME "$refcnt"
+
+// Number of reference counts held by each table block
+#define REFCNT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+
+struct RefCount refcnt = { .entry_index = -1 };
+
+// Snapshots are hidden files holding a copy of the root directory followed by
+// a copy of the FAT
+#define SNAPSHOT_PREFIX "$snap."
+
+// Header of the incremental diff exported by fs_snapshot_diff()
+struct DiffHeader {
+	char signature[8];
+	uint64_t from_fingerprint; // root directory the diff applies on top of
+	uint16_t data_blocks_num; // geometry of the image
+	uint16_t links_num; // number of (index, next) FAT pairs
+	uint16_t blocks_num; // number of data blocks carried
+	uint8_t  paddings[10];
+} __attribute__((packed));
+
+#define DIFF_SIGNATURE "ECS150DF"
+
+// Tails of small files are packed together in the blocks of the hidden
+// "$frag" file, allocated in units of FRAG_UNIT bytes
+#define FRAG_FILENAME "$frag"
+#define FRAG_UNIT 16
+#define FRAG_UNITS_PER_BLOCK (BLOCK_SIZE / FRAG_UNIT)
+
+struct FragStore {
+	int entry_index; // root entry of the store, -1 when the image has none
+	int blocks_num; // number of fragment blocks
+	uint16_t *index; // data block index of each fragment block
+	uint8_t (*used)[FRAG_UNITS_PER_BLOCK / 8]; // allocated units of each block, rebuilt at mount
+	uint16_t cache_index; // fragment block held in cache, 0xFFFF if none
+	uint8_t cache[BLOCK_SIZE];
+	int enabled; // tails are packed when files are closed, see fs_tailpack()
+};
+
+struct FragStore frag = { .entry_index = -1, .cache_index = 0xFFFF };
+
+// In dedup mode, full blocks written to plain files are hashed into an
+// in-memory index, and a block whose content is already on disk is shared
+// instead of written. Since a block carries its FAT link, sharing a block
+// means sharing everything after it in its chain, as clones do.
+struct Dedup {
+	int enabled;
+	uint64_t *hash; // content hash of each data block, 0 when unknown
+	uint16_t *slot; // a data block for each slot of hashes, 0 when empty
+	size_t slots_mask;
+	size_t written; // full blocks written since enabled
+	size_t avoided; // of which were already on disk
+	size_t copied; // shared blocks copied before being modified
+};
+
+struct Dedup dedup;
+
+// The data blocks are split into allocation groups. A file growing through
+// a descriptor takes a group nobody else grows in, while there is one, and
+// extends its chain right after its tail: files appended to at the same time
+// get contiguous chains instead of interleaved ones. The FAT is the free map,
+// each group keeps its count of free blocks and where the first one may be.
+// Groups get as small as ALLOC_GROUP_MIN blocks, so that small disks have
+// several of them.
+#define ALLOC_GROUPS_MAX 16
+#define ALLOC_GROUP_MIN 64
+
+struct AllocGroup {
+	// updated by fat_set() only, one thread at a time
+	int free_num; // free blocks in the group
+	int hint; // no block of the group below this one is free
+	int growers; // open files whose chain grows in the group
+};
+
+struct AllocGroups {
+	struct AllocGroup group[ALLOC_GROUPS_MAX];
+	int groups_num;
+	int group_blocks; // blocks per group, the last one may have less
+};
+
+struct AllocGroups alloc;
+
+// With delayed allocation, see fs_delalloc(), data appended to a file past
+// its last block waits in a buffer of a pool allocated when it is enabled,
+// its blocks only counted as reserved. They are picked when the buffer fills
+// up or the file is flushed, as one run of contiguous blocks written at once.
+#define DELALLOC_BUFFERS 32
+#define DELALLOC_BLOCKS 32
+
+struct DelAlloc {
+	int enabled;
+	uint8_t *mem; // DELALLOC_BUFFERS buffers of DELALLOC_BLOCKS blocks, NULL if disabled
+	uint8_t *free[DELALLOC_BUFFERS]; // stack of the buffers no file holds
+	int free_num;
+	int reserved; // free blocks promised to buffered data
+};
+
+struct DelAlloc delalloc;
+
+static int delalloc_flush_all(void); // with the file write path, below
+
+// With discard, see fs_discard(), the data blocks freed are given back to the
+// host once the metadata freeing them is written
+struct Discard {
+	uint8_t *pending; // one bit per data block freed since, NULL if disabled
+	int pending_num;
+};
+
+struct Discard discard;
+
+// Block buffers of the read and write paths come from a pool allocated at
+// mount, aligned on BLOCK_SIZE and reused across calls: once mounted, reads
+// and writes never touch the heap. A data path call holds fs_lock and never
+// needs more than a few buffers at once, the pool only runs dry when other
+// calls run concurrently, in which case buffers are allocated on demand.
+#define BLOCK_POOL_SIZE 8
+
+// Reads spanning several blocks of a chain fetch them in batches, so that
+// the disk can read adjacent blocks at once and striped volumes every image
+// in parallel
+#define CHAIN_BATCH 32
+
+struct BlockPool {
+	uint8_t *mem; // BLOCK_POOL_SIZE contiguous buffers, NULL when not mounted
+	uint8_t *free[BLOCK_POOL_SIZE]; // stack of the buffers not in use
+	int free_num;
+	uint8_t *batch; // CHAIN_BATCH contiguous blocks, after the buffers
+	int batch_busy;
+	pthread_mutex_t lock; // protects the stack and batch_busy
+};
+
+struct BlockPool block_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Images with a journal log their metadata changes to the hidden "$journal"
+// file, a run of contiguous blocks located by the superblock, before they
+// are written in place at the next checkpoint. The first journal block
+// holds a JournalSuper. Transactions follow it back to back: a JournalHeader
+// telling where each logged block goes, then the logged blocks.
+#define JOURNAL_FILENAME "$journal"
+#define JOURNAL_SIGNATURE "ECS150JN"
+#define JOURNAL_TXN_SIGNATURE "ECS150JT"
+
+struct JournalSuper {
+	char signature[8];
+	uint64_t sequence; // first transaction not checkpointed yet
+	uint8_t paddings[4080];
+} __attribute__((packed));
+
+#define JOURNAL_TARGETS_MAX 2035
+
+// Default journal size, in largest transactions, see fs_journal()
+#define JOURNAL_DEFAULT_TXNS 4
+
+struct JournalHeader {
+	char signature[8];
+	uint64_t sequence; // transactions are numbered in the order they were logged
+	uint64_t checksum; // FNV-1a of the logged blocks, then of this block with checksum 0
+	uint16_t blocks_num; // number of blocks logged
+	uint16_t targets[JOURNAL_TARGETS_MAX]; // where each logged block belongs
+} __attribute__((packed));
+
+struct Journal {
+	uint16_t start; // first block of the journal, as in the superblock
+	uint16_t blocks_num; // 0 when the image has no journal
+	uint16_t head; // journal block where the next transaction goes
+	uint64_t sequence; // number of the next transaction
+};
+
+struct Journal journal;
+
+// With checksums, see fs_checksum(), the hidden "$csum" file holds a CRC32C
+// of every block of the disk: a CsumHeader, then the table, indexed by disk
+// block number. The table is written with the other metadata, so the checksums
+// of the blocks written reach the disk along with the FAT pointing to them.
+#define CSUM_FILENAME "$csum"
+#define CSUM_SIGNATURE "ECS150CK"
+
+struct CsumHeader {
+	char signature[8];
+	uint8_t clean; // the table matches the disk, set by fs_umount()
+	uint8_t verify; // reads are checked, see FS_CSUM_VERIFY
+	uint8_t paddings[4086];
+} __attribute__((packed));
+
+// Number of checksums held by each table block
+#define CSUM_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+struct Checksums {
+	int entry_index; // root entry of the table, -1 when the image has none
+	uint32_t *arr; // checksum of each disk block, 0 for the blocks not checked
+	uint8_t *dirty; // one flag per table block
+	int blocks_num; // number of table blocks, the header excluded
+	int verify; // reads are checked against the table, see FS_CSUM_VERIFY
+};
+
+struct Checksums csum = { .entry_index = -1 };
+
+static int entry_find(const char *filename)
 {
-	// try to open the disk 
-	if (block_disk_open(diskname) == -1){
-		return -1; // -1 if virtual disk file @diskname cannot be opened
+	//return the root directory index of @filename, -1 if there is no such file
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] != '\0' &&
+		    strncmp((char*)rootdir.entry[i].filename, filename, FS_FILENAME_LEN) == 0)
+			return i;
 	}
-	// Read the first block of the disk : super block 
-	block_read(0, &super);
-	
-	// error checking: verify that the file system has the expected format
-	if (1 + super.fat_blocks_num + 1 + super.data_blocks_num != super.total_blocks_num)
-		return -1; // super(1) + FAT + root(1) + data == TOTAL
-	// error checking : verify that the total_blocks_num equal to what block_dick_count() return
-	if(super.total_blocks_num != block_disk_count())
+	return -1;
+}
+
+static int block_pool_init(void)
+{
+	size_t size = (BLOCK_POOL_SIZE + CHAIN_BATCH) * BLOCK_SIZE;
+	if (posix_memalign((void**)&block_pool.mem, BLOCK_SIZE, size) != 0) {
+		block_pool.mem = NULL;
 		return -1;
-	// error checking : verify signature of super block 
-    if (memcmp("ECS150FS", super.signature, 8) != 0)
-        {return -1;}
-	
-	// The size/byte length of the FAT
-	int total_bytes = super.data_blocks_num * 2;
-	// Total spanning block for FAT : ceiling make sure enough space for all indexe
-	uint8_t ceilVal = (uint8_t )(total_bytes / BLOCK_SIZE) + ((total_bytes % BLOCK_SIZE) != 0);
-	// error checking : verify that block indexing is following specification
-	if (super.fat_blocks_num != ceilVal)
-		return -1; // ceil of total_bytes / BLOCK_SIZE != fat num
-	if (super.fat_blocks_num + 1 != super.root_index)
-		return -1; // super #0, FAT #1,2,3,4 --> root: 5
-	if (super.root_index + 1 != super.data_start)
+	}
+	for (int i = 0; i < BLOCK_POOL_SIZE; i++)
+		block_pool.free[i] = block_pool.mem + i * BLOCK_SIZE;
+	block_pool.free_num = BLOCK_POOL_SIZE;
+	block_pool.batch = block_pool.mem + BLOCK_POOL_SIZE * BLOCK_SIZE;
+	block_pool.batch_busy = 0;
+	return 0;
+}
+
+static uint8_t *block_get(void)
+{
+	// return an aligned block buffer, NULL if none can be had
+	uint8_t *buf = NULL;
+	pthread_mutex_lock(&block_pool.lock);
+	if (block_pool.free_num > 0)
+		buf = block_pool.free[--block_pool.free_num];
+	pthread_mutex_unlock(&block_pool.lock);
+	if (buf == NULL && posix_memalign((void**)&buf, BLOCK_SIZE, BLOCK_SIZE) != 0)
+		return NULL; // pool exhausted, and so is the heap
+	return buf;
+}
+
+static void block_put(uint8_t *buf)
+{
+	// give back a buffer returned by block_get()
+	if (buf < block_pool.mem || buf >= block_pool.mem + BLOCK_POOL_SIZE * BLOCK_SIZE) {
+		free(buf); // allocated on demand
+		return;
+	}
+	pthread_mutex_lock(&block_pool.lock);
+	block_pool.free[block_pool.free_num++] = buf;
+	pthread_mutex_unlock(&block_pool.lock);
+}
+
+static uint8_t *block_batch_get(void)
+{
+	// return the CHAIN_BATCH blocks buffer, NULL if another call uses it
+	uint8_t *buf = NULL;
+	pthread_mutex_lock(&block_pool.lock);
+	if (!block_pool.batch_busy) {
+		block_pool.batch_busy = 1;
+		buf = block_pool.batch;
+	}
+	pthread_mutex_unlock(&block_pool.lock);
+	return buf;
+}
+
+static void block_batch_put(void)
+{
+	pthread_mutex_lock(&block_pool.lock);
+	block_pool.batch_busy = 0;
+	pthread_mutex_unlock(&block_pool.lock);
+}
+
+static uint32_t csum_value(const void *data)
+{
+	// checksum of a block, never 0 which stands for a block not checked
+	uint32_t sum = crc32c(0, data, BLOCK_SIZE);
+	return sum != 0 ? sum : 1;
+}
+
+static void csum_set(size_t block, uint32_t sum)
+{
+	if (csum.arr[block] == sum)
+		return;
+	csum.arr[block] = sum;
+	csum.dirty[block / CSUM_ENTRIES_PER_BLOCK] = 1;
+}
+
+static int csum_check(size_t block, const void *data)
+{
+	// -1 if the table holds another checksum for the block read
+	if (csum.arr == NULL || !csum.verify || csum.arr[block] == 0)
+		return 0;
+	return csum_value(data) == csum.arr[block] ? 0 : -1;
+}
+
+static int csum_read(size_t block, void *buf)
+{
+	// block_read(), of a block checked against its checksum
+	if (block_read(block, buf) == -1)
+		return -1;
+	return csum_check(block, buf);
+}
+
+static int csum_read_many(const size_t *blocks, size_t count, void *buf)
+{
+	if (block_read_many(blocks, count, buf) == -1)
+		return -1;
+	for (size_t i = 0; i < count; i++) {
+		if (csum_check(blocks[i], (const uint8_t*)buf + i * BLOCK_SIZE) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int csum_write(size_t block, const void *buf)
+{
+	// block_write(), the checksum of the block going with the next metadata
+	// write. A block that failed to be written is no longer checked.
+	int ret = block_write(block, buf);
+	if (csum.arr != NULL)
+		csum_set(block, ret == 0 ? csum_value(buf) : 0);
+	return ret;
+}
+
+static int csum_write_many(const size_t *blocks, size_t count, const void *buf)
+{
+	int ret = block_write_many(blocks, count, buf);
+	for (size_t i = 0; csum.arr != NULL && i < count; i++)
+		csum_set(blocks[i], ret == 0 ? csum_value((const uint8_t*)buf + i * BLOCK_SIZE) : 0);
+	return ret;
+}
+
+static int csum_copy(size_t src, size_t dst, size_t count)
+{
+	// block_copy(), the copies taking the checksums of the originals
+	int ret = block_copy(src, dst, count);
+	for (size_t i = 0; csum.arr != NULL && i < count; i++)
+		csum_set(dst + i, ret == 0 ? csum.arr[src + i] : 0);
+	return ret;
+}
+
+static void alloc_init(void)
+{
+	// count the free blocks of each allocation group, from the FAT
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.group_blocks = (super.data_blocks_num + ALLOC_GROUPS_MAX - 1) / ALLOC_GROUPS_MAX;
+	if (alloc.group_blocks < ALLOC_GROUP_MIN)
+		alloc.group_blocks = ALLOC_GROUP_MIN;
+	alloc.groups_num = (super.data_blocks_num + alloc.group_blocks - 1) / alloc.group_blocks;
+	for (int g = 0; g < alloc.groups_num; g++)
+		alloc.group[g].hint = g * alloc.group_blocks;
+	for (int i = 1; i < super.data_blocks_num; i++) {
+		if (fat.arr[i] == 0)
+			alloc.group[i / alloc.group_blocks].free_num++;
+	}
+}
+
+static uint16_t meta_file_block(int entry_index, int blk)
+{
+	//return the data block index holding block @blk of a metadata file
+	uint16_t data_index = rootdir.entry[entry_index].first_data_index;
+	for (; blk > 0 && data_index != 0xFFFF; blk--)
+		data_index = fat.arr[data_index];
+	return data_index;
+}
+
+static int refcnt_load(void)
+{
+	refcnt.entry_index = entry_find(REFCNT_FILENAME);
+	if (refcnt.entry_index == -1)
+		return 0; // no clones on this image, every used block has one owner
+	refcnt.blocks_num = rootdir.entry[refcnt.entry_index].size_file / BLOCK_SIZE;
+	if (refcnt.blocks_num * REFCNT_ENTRIES_PER_BLOCK < super.data_blocks_num)
+		return -1; // table too small for this disk
+	refcnt.arr = (uint16_t*)malloc(refcnt.blocks_num * BLOCK_SIZE);
+	refcnt.dirty = (uint8_t*)calloc(refcnt.blocks_num, 1);
+	if (refcnt.arr == NULL || refcnt.dirty == NULL)
+		return -1;
+	for (int i = 0; i < refcnt.blocks_num; i++) {
+		uint16_t data_index = meta_file_block(refcnt.entry_index, i);
+		if (data_index == 0xFFFF)
+			return -1;
+		if (block_read(data_index + super.data_start, refcnt.arr + i * REFCNT_ENTRIES_PER_BLOCK) == -1)
+			return -1;
+	}
+	// count how many live files hold each block, metadata files included
+	refcnt.live = (uint16_t*)calloc(super.data_blocks_num, sizeof(uint16_t));
+	if (refcnt.live == NULL)
+		return -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] == '\0')
+			continue;
+		uint16_t data_index = rootdir.entry[i].first_data_index;
+		for (int steps = 0; data_index != 0xFFFF; steps++) {
+			if (data_index >= super.data_blocks_num || steps >= super.data_blocks_num)
+				return -1; // broken chain
+			refcnt.live[data_index]++;
+			data_index = fat.arr[data_index];
+		}
+	}
+	return 0;
+}
+
+static int frag_reserve(int blocks_num)
+{
+	// make room for @blocks_num fragment blocks, the new ones empty
+	uint16_t *index = realloc(frag.index, blocks_num * sizeof(*frag.index));
+	if (index == NULL)
+		return -1;
+	frag.index = index;
+	void *used = realloc(frag.used, blocks_num * sizeof(*frag.used));
+	if (used == NULL)
+		return -1;
+	frag.used = used;
+	memset(frag.used + frag.blocks_num, 0, (blocks_num - frag.blocks_num) * sizeof(*frag.used));
+	return 0;
+}
+
+static int frag_mark(uint16_t index, uint16_t offset, size_t len, int used)
+{
+	// set the units covering @len bytes at @offset of fragment block @index
+	// as allocated or free
+	int blk = 0;
+	while (blk < frag.blocks_num && frag.index[blk] != index)
+		blk++;
+	if (blk == frag.blocks_num || offset % FRAG_UNIT != 0 || offset + len > BLOCK_SIZE)
+		return -1; // not a fragment block
+	for (size_t unit = offset / FRAG_UNIT; unit * FRAG_UNIT < offset + len; unit++) {
+		if (used)
+			frag.used[blk][unit / 8] |= 1 << (unit % 8);
+		else
+			frag.used[blk][unit / 8] &= ~(1 << (unit % 8));
+	}
+	return 0;
+}
+
+static int frag_load(void)
+{
+	frag.entry_index = entry_find(FRAG_FILENAME);
+	frag.cache_index = 0xFFFF;
+	frag.enabled = 0;
+	if (frag.entry_index == -1)
+		return 0; // no tail was ever packed on this image
+	int blocks_num = rootdir.entry[frag.entry_index].size_file / BLOCK_SIZE;
+	if (frag_reserve(blocks_num) == -1)
+		return -1;
+	frag.blocks_num = blocks_num;
+	for (int i = 0; i < blocks_num; i++) {
+		frag.index[i] = meta_file_block(frag.entry_index, i);
+		if (frag.index[i] == 0xFFFF)
+			return -1;
+	}
+	// the allocation map is not stored, the entries tell which units are used
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct Entry *entry = &rootdir.entry[i];
+		if (entry->filename[0] == '\0' || !(entry->flags & ENTRY_TAIL))
+			continue;
+		if (frag_mark(entry->tail_index, entry->tail_offset, entry->size_file % BLOCK_SIZE, 1) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// A metadata block kept in memory, and where it goes on disk
+struct MetaBlock {
+	size_t target; // disk block number
+	const void *data;
+	int dirty; // changed since last written
+};
+
+static int meta_blocks_num(void)
+{
+	return refcnt.blocks_num + csum.blocks_num + super.fat_blocks_num + 1;
+}
+
+static struct MetaBlock meta_block(int i)
+{
+	// metadata block @i: the reference counts, checksums and FAT blocks
+	// first, then the root directory, the order in which they are written
+	if (i < refcnt.blocks_num)
+		return (struct MetaBlock){ meta_file_block(refcnt.entry_index, i) + super.data_start,
+					   refcnt.arr + i * REFCNT_ENTRIES_PER_BLOCK, refcnt.dirty[i] };
+	i -= refcnt.blocks_num;
+	if (i < csum.blocks_num)
+		return (struct MetaBlock){ meta_file_block(csum.entry_index, i + 1) + super.data_start,
+					   csum.arr + i * CSUM_ENTRIES_PER_BLOCK, csum.dirty[i] };
+	i -= csum.blocks_num;
+	if (i < super.fat_blocks_num)
+		return (struct MetaBlock){ i + 1, fat.arr + i * FAT_ENTRIES_PER_BLOCK, fat.dirty[i] };
+	return (struct MetaBlock){ super.root_index, &rootdir, rootdir_dirty };
+}
+
+static int meta_block_is_csum(int i)
+{
+	return i >= refcnt.blocks_num && i < refcnt.blocks_num + csum.blocks_num;
+}
+
+static void meta_block_clean(int i)
+{
+	if (i < refcnt.blocks_num)
+		refcnt.dirty[i] = 0;
+	else if (meta_block_is_csum(i))
+		csum.dirty[i - refcnt.blocks_num] = 0;
+	else if (i - refcnt.blocks_num - csum.blocks_num < super.fat_blocks_num)
+		fat.dirty[i - refcnt.blocks_num - csum.blocks_num] = 0;
+	else
+		rootdir_dirty = 0;
+}
+
+static void csum_meta(void)
+{
+	// checksum the dirty metadata blocks about to be written, before the
+	// table blocks holding their checksums are. The table does not checksum
+	// its own blocks.
+	if (csum.arr == NULL)
+		return;
+	for (int i = 0; i < meta_blocks_num(); i++) {
+		struct MetaBlock mb = meta_block(i);
+		if (mb.dirty && !meta_block_is_csum(i))
+			csum_set(mb.target, csum_value(mb.data));
+	}
+}
+
+static int meta_write(int all)
+{
+	// write the dirty metadata blocks in place, every one of them if @all
+	csum_meta();
+	for (int i = 0; i < meta_blocks_num(); i++) {
+		struct MetaBlock mb = meta_block(i);
+		if (!all && !mb.dirty)
+			continue;
+		if (block_write(mb.target, mb.data) == -1)
+			return -1;
+		meta_block_clean(i);
+	}
+	return 0;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int discard_pending(int index)
+{
+	return discard.pending[index / 8] & (1 << (index % 8));
+}
+
+static void discard_flush(void)
+{
+	// discard the blocks freed since the last time, runs of adjacent ones at
+	// once, once the metadata freeing them is flushed to storage: a crash
+	// must not leave metadata pointing to blocks already given back. Best
+	// effort: blocks the image cannot give back stay in it.
+	if (discard.pending == NULL)
+		return;
+	for (int i = 0; discard.pending_num > 0 && i < super.data_blocks_num; i++) {
+		if (!discard_pending(i))
+			continue;
+		int n = 1;
+		while (i + n < super.data_blocks_num && discard_pending(i + n))
+			n++;
+		block_discard(i + super.data_start, n);
+		for (int j = i; j < i + n; j++)
+			discard.pending[j / 8] &= ~(1 << (j % 8));
+		discard.pending_num -= n;
+		i += n - 1;
+	}
+}
+
+static int journal_txn_max(void)
+{
+	// blocks taken by the largest transaction: every metadata block, with
+	// room for a reference count table created later
+	int refcnt_blocks = refcnt.blocks_num > super.fat_blocks_num ? refcnt.blocks_num : super.fat_blocks_num;
+	return 1 + refcnt_blocks + csum.blocks_num + super.fat_blocks_num + 1;
+}
+
+static int journal_reset(void)
+{
+	// forget the transactions logged so far, once their blocks are in place
+	struct JournalSuper *js = (struct JournalSuper*)block_get();
+	if (js == NULL)
+		return -1;
+	memset(js, 0, sizeof(*js));
+	memcpy(js->signature, JOURNAL_SIGNATURE, 8);
+	js->sequence = journal.sequence;
+	int ret = block_write(journal.start, js);
+	block_put((uint8_t*)js);
+	if (ret == -1 || block_disk_sync() == -1)
+		return -1;
+	journal.head = 1;
+	return 0;
+}
+
+static int journal_checkpoint(void)
+{
+	// write the metadata in place, as of the last transaction since nothing
+	// is left dirty, then start the journal over. The flushes keep the
+	// steps in order: logged transactions, blocks in place, journal reset.
+	if (journal.head == 1)
+		return 0; // nothing logged
+	if (block_disk_sync() == -1 || meta_write(1) == -1 || block_disk_sync() == -1)
+		return -1;
+	discard_flush();
+	return journal_reset();
+}
+
+static int journal_commit(void)
+{
+	// log the dirty metadata blocks as the next transaction, in one
+	// sequential pass after the previous one: the header, then the blocks.
+	// They are written in place at the next checkpoint.
+	struct JournalHeader *header = (struct JournalHeader*)block_get();
+	if (header == NULL)
+		return -1;
+	memset(header, 0, sizeof(*header));
+	csum_meta();
+	uint64_t hash = FNV_OFFSET;
+	int n = 0;
+	for (int i = 0; i < meta_blocks_num(); i++) {
+		struct MetaBlock mb = meta_block(i);
+		if (!mb.dirty)
+			continue;
+		hash = fnv1a(hash, mb.data, BLOCK_SIZE);
+		header->targets[n++] = mb.target;
+	}
+	int ret = 0;
+	if (n == 0)
+		goto out;
+	ret = -1;
+	if (journal.head + 1 + n > journal.blocks_num)
+		goto out; // cannot happen, a checkpoint always leaves room
+	memcpy(header->signature, JOURNAL_TXN_SIGNATURE, 8);
+	header->sequence = journal.sequence;
+	header->blocks_num = n;
+	header->checksum = fnv1a(hash, header, sizeof(*header));
+	if (block_write(journal.start + journal.head, header) == -1)
+		goto out;
+	for (int i = 0, k = 0; i < meta_blocks_num(); i++) {
+		struct MetaBlock mb = meta_block(i);
+		if (!mb.dirty)
+			continue;
+		if (block_write(journal.start + journal.head + 1 + k++, mb.data) == -1)
+			goto out;
+	}
+	for (int i = 0; i < meta_blocks_num(); i++)
+		meta_block_clean(i);
+	journal.head += 1 + n;
+	journal.sequence++;
+	ret = 0;
+	// keep room for the largest transaction
+	if (journal.head + journal_txn_max() > journal.blocks_num)
+		ret = journal_checkpoint();
+out:
+	block_put((uint8_t*)header);
+	return ret;
+}
+
+static int journal_replay(void)
+{
+	// load the journal of the image, and write in place the transactions
+	// logged since the last checkpoint, in order. The first one missing or
+	// torn ends the log: it was never committed.
+	journal = (struct Journal){ super.journal_start, super.journal_blocks_num, 1, 1 };
+	if (journal.blocks_num == 0)
+		return 0; // the image has no journal
+	if (journal.start < super.data_start || journal.blocks_num < 2 ||
+	    journal.start + journal.blocks_num > super.total_blocks_num)
+		return -1;
+	uint8_t *block = block_get();
+	struct JournalHeader *header = (struct JournalHeader*)block_get();
+	int ret = -1, replayed = 0;
+	if (block == NULL || header == NULL || block_read(journal.start, block) == -1)
+		goto out;
+	struct JournalSuper *js = (struct JournalSuper*)block;
+	if (memcmp(js->signature, JOURNAL_SIGNATURE, 8) != 0)
+		goto out;
+	journal.sequence = js->sequence;
+	for (int pos = 1; pos < journal.blocks_num; pos += 1 + header->blocks_num) {
+		if (block_read(journal.start + pos, header) == -1)
+			goto out;
+		if (memcmp(header->signature, JOURNAL_TXN_SIGNATURE, 8) != 0 ||
+		    header->sequence != journal.sequence || header->blocks_num == 0 ||
+		    header->blocks_num > JOURNAL_TARGETS_MAX || pos + 1 + header->blocks_num > journal.blocks_num)
+			break;
+		// check the whole transaction before writing any of it
+		uint64_t checksum = header->checksum, hash = FNV_OFFSET;
+		header->checksum = 0;
+		for (int k = 0; k < header->blocks_num; k++) {
+			if (block_read(journal.start + pos + 1 + k, block) == -1)
+				goto out;
+			hash = fnv1a(hash, block, BLOCK_SIZE);
+		}
+		if (fnv1a(hash, header, sizeof(*header)) != checksum)
+			break;
+		for (int k = 0; k < header->blocks_num; k++) {
+			uint16_t target = header->targets[k];
+			if (target == 0 || target >= super.total_blocks_num ||
+			    (target >= journal.start && target < journal.start + journal.blocks_num))
+				goto out; // a valid transaction never logs these
+			if (block_read(journal.start + pos + 1 + k, block) == -1 || block_write(target, block) == -1)
+				goto out;
+		}
+		journal.sequence++;
+		replayed++;
+	}
+	ret = 0;
+	// the transactions replayed must be in place before new ones overwrite them
+	if (replayed > 0 && (block_disk_sync() == -1 || journal_reset() == -1))
+		ret = -1;
+out:
+	if (block != NULL)
+		block_put(block);
+	if (header != NULL)
+		block_put((uint8_t*)header);
+	return ret;
+}
+
+static int csum_header_write(int clean)
+{
+	struct CsumHeader *header = (struct CsumHeader*)block_get();
+	if (header == NULL)
+		return -1;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->signature, CSUM_SIGNATURE, 8);
+	header->clean = clean;
+	header->verify = csum.verify;
+	int ret = block_write(meta_file_block(csum.entry_index, 0) + super.data_start, header);
+	block_put((uint8_t*)header);
+	return ret;
+}
+
+static int csum_fill(void)
+{
+	// checksum every block in use: the metadata from memory, the data read
+	// back. The journal and the table, written behind its back, are not
+	// checked.
+	memset(csum.arr, 0, csum.blocks_num * BLOCK_SIZE);
+	memset(csum.dirty, 1, csum.blocks_num);
+	csum.arr[0] = csum_value(&super);
+	uint8_t *block = block_get();
+	if (block == NULL)
 		return -1;
+	for (int i = 1; i < super.data_blocks_num; i++) {
+		if (fat.arr[i] == 0)
+			continue;
+		if (block_read(i + super.data_start, block) == -1) {
+			block_put(block);
+			return -1;
+		}
+		csum.arr[i + super.data_start] = csum_value(block);
+	}
+	block_put(block);
+	for (int i = 0; i < meta_blocks_num(); i++) {
+		struct MetaBlock mb = meta_block(i);
+		if (!meta_block_is_csum(i))
+			csum.arr[mb.target] = csum_value(mb.data);
+	}
+	const char *unchecked[] = { JOURNAL_FILENAME, CSUM_FILENAME };
+	for (int k = 0; k < 2; k++) {
+		int entry_index = entry_find(unchecked[k]);
+		if (entry_index == -1)
+			continue;
+		uint16_t data_index = rootdir.entry[entry_index].first_data_index;
+		for (; data_index != 0xFFFF; data_index = fat.arr[data_index])
+			csum.arr[data_index + super.data_start] = 0;
+	}
+	return 0;
+}
+
+static int csum_load(void)
+{
+	csum.entry_index = entry_find(CSUM_FILENAME);
+	csum.verify = 0;
+	if (csum.entry_index == -1)
+		return 0; // blocks are not checksummed on this image
+	csum.blocks_num = rootdir.entry[csum.entry_index].size_file / BLOCK_SIZE - 1;
+	if (csum.blocks_num < 0 || csum.blocks_num * CSUM_ENTRIES_PER_BLOCK < super.total_blocks_num)
+		return -1; // table too small for this disk
+	csum.arr = (uint32_t*)malloc(csum.blocks_num * BLOCK_SIZE);
+	csum.dirty = (uint8_t*)calloc(csum.blocks_num, 1);
+	struct CsumHeader *header = (struct CsumHeader*)block_get();
+	if (csum.arr == NULL || csum.dirty == NULL || header == NULL)
+		return -1;
+	int ret = block_read(meta_file_block(csum.entry_index, 0) + super.data_start, header);
+	for (int i = 0; ret == 0 && i < csum.blocks_num; i++) {
+		uint16_t data_index = meta_file_block(csum.entry_index, i + 1);
+		if (data_index == 0xFFFF)
+			ret = -1;
+		else
+			ret = block_read(data_index + super.data_start, csum.arr + i * CSUM_ENTRIES_PER_BLOCK);
+	}
+	if (ret == 0 && memcmp(header->signature, CSUM_SIGNATURE, 8) != 0)
+		ret = -1;
+	int clean = header->clean, verify = header->verify;
+	block_put((uint8_t*)header);
+	if (ret == -1)
+		return -1;
+	csum.verify = 1;
+	if (!clean) {
+		// not unmounted, blocks may have been written and not their checksums
+		if (csum_fill() == -1)
+			return -1;
+	} else {
+		// check the metadata loaded
+		if (csum_check(0, &super) == -1)
+			return -1;
+		for (int i = 0; i < meta_blocks_num(); i++) {
+			struct MetaBlock mb = meta_block(i);
+			if (!meta_block_is_csum(i) && csum_check(mb.target, mb.data) == -1)
+				return -1;
+		}
+	}
+	// from now on, blocks may be written before their checksums
+	csum.verify = verify;
+	if (csum_header_write(0) == -1 || block_disk_sync() == -1)
+		return -1;
+	return 0;
+}
+
+static void mount_free(void); // with disk_umount(), below
+
+static int disk_mount(const char *diskname)
+{
+	// try to open the disk 
+	if (block_disk_open(diskname) == -1){
+		return -1; // -1 if virtual disk file @diskname cannot be opened
+	}
+	// Read the first block of the disk : super block 
+	if (block_read(0, &super) == -1)
+		goto fail;
+	
+	// error checking: verify that the file system has the expected format
+	if (1 + super.fat_blocks_num + 1 + super.data_blocks_num != super.total_blocks_num)
+		goto fail; // super(1) + FAT + root(1) + data == TOTAL
+	// error checking : verify that the total_blocks_num equal to what block_dick_count() return
+	if(super.total_blocks_num != block_disk_count())
+		goto fail;
+	// error checking : verify signature of super block 
+    if (memcmp("ECS150FS", super.signature, 8) != 0)
+        {goto fail;}
+	
+	// The size/byte length of the FAT
+	int total_bytes = super.data_blocks_num * 2;
+	// Total spanning block for FAT : ceiling make sure enough space for all indexe
+	uint8_t ceilVal = (uint8_t )(total_bytes / BLOCK_SIZE) + ((total_bytes % BLOCK_SIZE) != 0);
+	// error checking : verify that block indexing is following specification
+	if (super.fat_blocks_num != ceilVal)
+		goto fail; // ceil of total_bytes / BLOCK_SIZE != fat num
+	if (super.fat_blocks_num + 1 != super.root_index)
+		goto fail; // super #0, FAT #1,2,3,4 --> root: 5
+	if (super.root_index + 1 != super.data_start)
+		goto fail;
+
+	// The FAT has array attribute which consists of num_data_blocks two bytes long data block indexes
+	// Allocate whole blocks so that each FAT block maps straight onto the array
+	fat.arr = (uint16_t*)malloc(super.fat_blocks_num * BLOCK_SIZE);
+	fat.dirty = (uint8_t*)calloc(super.fat_blocks_num, 1);
+	if (fat.arr == NULL || fat.dirty == NULL)
+		goto fail;
+	// and the block buffers of the read and write paths
+	if (block_pool_init() == -1)
+		goto fail;
+	// bring the metadata in place up to date with the journal, if any
+	if (journal_replay() == -1)
+		goto fail;
+	// FAT start at block index # 1
+	size_t i = 1;
+	for (; i < super.root_index; i++) {
+		// for each (i-1)th fat block, loads
+		// fat block offset starts at 1 instead of 0, so mapping is i-1
+		if (block_read(i, fat.arr + (i-1) * FAT_ENTRIES_PER_BLOCK) == -1)
+			goto fail;
+	}
+	// The first entry of the FAT (entry #0) is always invalid is 0xFFFF
+	if (fat.arr[0] != 0xFFFF)
+		goto fail; 
+	alloc_init();
+
+	// load the root dir infos
+	if (block_read(super.root_index, &rootdir) == -1)
+		goto fail;
+	rootdir_dirty = 0;
+	batch_depth = 0;
+	durability = (struct Durability){ .mode = FS_DURABLE_SYNC };
+
+	// load the reference counts if clones were ever made on this image
+	if (refcnt_load() == -1)
+		goto fail;
+	// and rebuild the allocation map of the packed tails
+	if (frag_load() == -1)
+		goto fail;
+	// and the block checksums, if they are kept
+	if (csum_load() == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	// leave no half mounted image behind, so that the mount can be retried
+	mount_free();
+	block_disk_close();
+	return -1;
+}
+
+int fs_mount(const char *diskname)
+{
+	uint64_t start = trace_begin();
+	int ret = disk_mount(diskname);
+	trace_end(start, FS_TRACE_MOUNT, -1, 0, 0, ret, diskname, NULL);
+	return ret;
+}
+
+static void discard_mark(int index, int freed)
+{
+	// a block claimed again before being discarded keeps its data
+	if (freed == !!discard_pending(index))
+		return;
+	discard.pending[index / 8] ^= 1 << (index % 8);
+	discard.pending_num += freed ? 1 : -1;
+}
+
+static void fat_set(uint16_t index, uint16_t value)
+{
+	// every FAT update goes through here so the containing block gets flushed.
+	// The group counters, the discard and checksum maps are not shared safely:
+	// call it from one thread at a time, never from the fs_check() workers.
+	if ((fat.arr[index] == 0) != (value == 0)) {
+		if (dedup.hash != NULL)
+			dedup.hash[index] = 0; // claimed or freed, the content is not the indexed one
+		if (csum.arr != NULL)
+			csum_set(index + super.data_start, 0); // nor the checksummed one
+		struct AllocGroup *group = &alloc.group[index / alloc.group_blocks];
+		if (value != 0) {
+			group->free_num--;
+		} else {
+			group->free_num++;
+			if (index < group->hint)
+				group->hint = index;
+		}
+		if (discard.pending != NULL)
+			discard_mark(index, value == 0);
+	}
+	fat.arr[index] = value;
+	fat.dirty[index / FAT_ENTRIES_PER_BLOCK] = 1;
+}
+
+static int meta_flush(void)
+{
+	// write back the dirty reference counts and FAT blocks first, then the
+	// root directory, through the journal if the image has one
+	return journal.blocks_num > 0 ? journal_commit() : meta_write(0);
+}
+
+static int disk_commit(void)
+{
+	// make every change durable, the data before the metadata pointing to
+	// it: after a crash, the metadata on disk never refers to blocks whose
+	// new content did not make it
+	if (block_disk_sync() == -1 || meta_flush() == -1 || block_disk_sync() == -1)
+		return -1;
+	discard_flush();
+	durability.pending = 0;
+	durability.pending_bytes = 0;
+	return 0;
+}
+
+static int commit_tick(size_t bytes)
+{
+	// record a change under group commit, @bytes of data written, and commit
+	// every change made so far once the oldest one is old enough or enough
+	// data piled up
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!durability.pending) {
+		durability.pending = 1;
+		durability.first_change = now;
+		if (durability.thread_running)
+			pthread_cond_signal(&durability.kick); // the change has a deadline now
+	}
+	durability.pending_bytes += bytes;
+	if (batch_depth > 0)
+		return 0; // never commit half a batch
+	long age_ms = (now.tv_sec - durability.first_change.tv_sec) * 1000 +
+		      (now.tv_nsec - durability.first_change.tv_nsec) / 1000000;
+	if ((durability.interval_bytes != 0 && durability.pending_bytes >= durability.interval_bytes) ||
+	    (durability.interval_ms != 0 && age_ms >= durability.interval_ms))
+		return disk_commit();
+	return 0;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *commit_thread(void *arg)
+{
+	// under group commit with an age limit, commit once the oldest change
+	// is that old, even if no call comes to notice it. A batch in progress
+	// or a failed commit is retried an interval later.
+	(void)arg;
+	pthread_mutex_lock(&fs_lock);
+	while (!durability.stopping) {
+		if (!durability.pending) {
+			pthread_cond_wait(&durability.kick, &fs_lock);
+			continue;
+		}
+		struct timespec now, due = durability.first_change;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespec_add_ms(&due, durability.interval_ms);
+		if (now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec)) {
+			pthread_cond_timedwait(&durability.kick, &fs_lock, &due);
+			continue;
+		}
+		if (batch_depth == 0 && disk_commit() == 0)
+			continue;
+		due = now;
+		timespec_add_ms(&due, durability.interval_ms);
+		pthread_cond_timedwait(&durability.kick, &fs_lock, &due);
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return NULL;
+}
+
+static int commit_thread_start(void)
+{
+	// with fs_lock held
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // first_change is monotonic
+	pthread_cond_init(&durability.kick, &attr);
+	pthread_condattr_destroy(&attr);
+	durability.stopping = 0;
+	if (pthread_create(&durability.thread, NULL, commit_thread, NULL) != 0) {
+		pthread_cond_destroy(&durability.kick);
+		return -1;
+	}
+	durability.thread_running = 1;
+	return 0;
+}
+
+static void commit_thread_stop(void)
+{
+	// with fs_lock held: tell the thread to exit, commit_thread_join() waits
+	// for it once the lock is released
+	if (!durability.thread_running)
+		return;
+	durability.stopping = 1;
+	pthread_cond_signal(&durability.kick);
+}
+
+static void commit_thread_join(void)
+{
+	if (!durability.thread_running || !durability.stopping)
+		return;
+	pthread_join(durability.thread, NULL);
+	pthread_cond_destroy(&durability.kick);
+	durability.thread_running = 0;
+	durability.stopping = 0;
+}
+
+static int meta_update(void)
+{
+	// persist metadata right away unless we are inside an fs_begin() batch.
+	// Under group commit, it waits for the next commit instead, so that it
+	// never reaches the disk before the data it points to.
+	if (batch_depth > 0)
+		return 0;
+	if (durability.mode == FS_DURABLE_GROUP)
+		return commit_tick(0);
+	return meta_flush();
+}
+
+static void refcnt_add(uint16_t index, int delta, int live_delta)
+{
+	if (refcnt.arr == NULL)
+		return; // no table, ownership is implied by the FAT
+	refcnt.arr[index] += delta;
+	refcnt.live[index] += live_delta;
+	refcnt.dirty[index / REFCNT_ENTRIES_PER_BLOCK] = 1;
+}
+
+static uint16_t refcnt_get(uint16_t index)
+{
+	if (refcnt.arr == NULL)
+		return fat.arr[index] != 0;
+	return refcnt.arr[index];
+}
+
+static uint16_t refcnt_live(uint16_t index)
+{
+	if (refcnt.arr == NULL)
+		return fat.arr[index] != 0;
+	return refcnt.live[index];
+}
+
+static int alloc_free_num(void)
+{
+	int free_num = 0;
+	for (int g = 0; g < alloc.groups_num; g++)
+		free_num += alloc.group[g].free_num;
+	return free_num;
+}
+
+static uint16_t block_claim(uint16_t index)
+{
+	// claim free block @index, unless the free blocks left are all promised
+	// to delayed allocations
+	if (delalloc.reserved > 0 && alloc_free_num() <= delalloc.reserved)
+		return 0xFFFF;
+	fat_set(index, 0xFFFF); //set the entry value to FAT_EOC
+	refcnt_add(index, 1, 1);
+	return index;
+}
+
+static uint16_t group_alloc(int g)
+{
+	// claim the first free block of group @g, 0xFFFF if it is full
+	struct AllocGroup *group = &alloc.group[g];
+	int end = (g + 1) * alloc.group_blocks;
+	if (end > super.data_blocks_num)
+		end = super.data_blocks_num;
+	if (group->hint == 0)
+		group->hint = 1; //i should definitely start from 1 here!
+	if (delalloc.reserved > 0 && alloc_free_num() <= delalloc.reserved)
+		return 0xFFFF; // the free blocks left are promised to delayed allocations
+	for (; group->free_num > 0 && group->hint < end; group->hint++) {
+		if (fat.arr[group->hint] == 0) {
+			// the hint only moves past blocks actually claimed
+			uint16_t index = block_claim(group->hint);
+			if (index != 0xFFFF)
+				group->hint++;
+			return index;
+		}
+	}
+	return 0xFFFF;
+}
+
+uint16_t fat_1stEmpty_ind() {
+	//claim the first empty availble fat entry, and change the value of it to 0XFFFF
+	for (int g = 0; g < alloc.groups_num; g++) {
+		if (alloc.group[g].free_num > 0)
+			return group_alloc(g);
+	}
+	return (uint16_t)0xFFFF;
+}
+
+static void group_pick(struct OpenFile *of, uint16_t tail)
+{
+	// choose the group @of grows in, from the one holding @tail on: the
+	// first one with free blocks nobody else grows in, the least shared one
+	// otherwise. A file starting from nothing looks from the first group, so
+	// alone it gets the first free block, as fat_1stEmpty_ind() would.
+	if (of->group != -1)
+		alloc.group[of->group].growers--;
+	int start = tail == 0xFFFF ? 0 : tail / alloc.group_blocks;
+	int best = -1;
+	for (int k = 0; k < alloc.groups_num; k++) {
+		int g = (start + k) % alloc.groups_num;
+		if (alloc.group[g].free_num == 0)
+			continue;
+		if (best == -1 || alloc.group[g].growers < alloc.group[best].growers)
+			best = g;
+		if (alloc.group[g].growers == 0)
+			break;
+	}
+	of->group = best;
+	if (best != -1)
+		alloc.group[best].growers++;
+}
+
+static int next_block_ok(struct OpenFile *of, uint16_t tail)
+{
+	// the block after @tail is free, and not at the start of a group
+	// another file grows in
+	if (tail == 0xFFFF || tail + 1 >= super.data_blocks_num || fat.arr[tail + 1] != 0)
+		return 0;
+	int g = (tail + 1) / alloc.group_blocks;
+	return g == tail / alloc.group_blocks || g == of->group || alloc.group[g].growers == 0;
+}
+
+static uint16_t chain_alloc(struct OpenFile *of, uint16_t tail)
+{
+	// claim a block to follow @tail in the chain of @of, 0xFFFF for its
+	// first block: the next one on disk if free, unless it starts a group
+	// another file grows in, else one of its group
+	if (next_block_ok(of, tail))
+		return block_claim(tail + 1);
+	if (of->group == -1 || alloc.group[of->group].free_num == 0)
+		group_pick(of, tail);
+	if (of->group == -1)
+		return 0xFFFF; // disk full
+	return group_alloc(of->group);
+}
+
+static void chain_release(uint16_t data_index, const uint16_t *links, int live)
+{
+	// drop one reference on every block of a chain walked through @links (the
+	// FAT, or the copy frozen in a snapshot), freeing the blocks nothing else
+	// holds. Blocks still held keep their FAT links untouched.
+	// @live tells whether the reference belonged to a live file.
+	while (data_index != 0xFFFF) {
+		// while the data_index doesn't reach to the end of the file
+		uint16_t next_index = links[data_index];
+		refcnt_add(data_index, -1, -live);
+		if (refcnt.arr == NULL || refcnt.arr[data_index] == 0)
+			fat_set(data_index, 0);
+		data_index = next_index;
+	}
+}
+
+static int meta_entry_find_free(void)
+{
+	// return a free root directory entry, -1 if the root directory is full
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] == '\0')
+			return i;
+	}
+	return -1;
+}
+
+static void meta_entry_set(int entry_index, const char *filename, uint16_t first_index, int blocks_num)
+{
+	strncpy((char*)rootdir.entry[entry_index].filename, filename, FS_FILENAME_LEN);
+	rootdir.entry[entry_index].size_file = blocks_num * BLOCK_SIZE;
+	rootdir.entry[entry_index].first_data_index = first_index;
+	rootdir_dirty = 1;
+}
+
+static int meta_file_create(const char *filename, int blocks_num)
+{
+	// create a hidden metadata file of @blocks_num blocks, return its entry index
+	int entry_index = meta_entry_find_free();
+	if (entry_index == -1)
+		return -1; // root directory is full
+	uint16_t first_index = 0xFFFF, prev_index = 0xFFFF;
+	for (int i = 0; i < blocks_num; i++) {
+		uint16_t data_index = fat_1stEmpty_ind();
+		if (data_index == 0xFFFF) {
+			chain_release(first_index, fat.arr, 1); // out of space, give the blocks back
+			return -1;
+		}
+		if (prev_index == 0xFFFF)
+			first_index = data_index;
+		else
+			fat_set(prev_index, data_index);
+		prev_index = data_index;
+	}
+	meta_entry_set(entry_index, filename, first_index, blocks_num);
+	return entry_index;
+}
+
+static void meta_file_delete(int entry_index)
+{
+	chain_release(rootdir.entry[entry_index].first_data_index, fat.arr, 1);
+	memset(&rootdir.entry[entry_index], 0, sizeof(struct Entry));
+	rootdir.entry[entry_index].first_data_index = 0xFFFF;
+	rootdir_dirty = 1;
+}
+
+static int refcnt_enable(void)
+{
+	// create the hidden reference count table the first time a block is shared
+	if (refcnt.arr != NULL)
+		return 0;
+	int blocks_num = (super.data_blocks_num + REFCNT_ENTRIES_PER_BLOCK - 1) / REFCNT_ENTRIES_PER_BLOCK;
+	uint16_t *arr = (uint16_t*)calloc(blocks_num, BLOCK_SIZE);
+	uint16_t *live = (uint16_t*)calloc(super.data_blocks_num, sizeof(uint16_t));
+	uint8_t *dirty = (uint8_t*)malloc(blocks_num);
+	int entry_index = -1;
+	if (arr == NULL || live == NULL || dirty == NULL ||
+	    (entry_index = meta_file_create(REFCNT_FILENAME, blocks_num)) == -1) {
+		free(arr);
+		free(live);
+		free(dirty);
+		return -1;
+	}
+	// every block in use so far, the table's own included, has a single owner
+	for (int i = 0; i < super.data_blocks_num; i++) {
+		arr[i] = fat.arr[i] != 0;
+		live[i] = arr[i];
+	}
+	memset(dirty, 1, blocks_num);
+	refcnt.entry_index = entry_index;
+	refcnt.arr = arr;
+	refcnt.live = live;
+	refcnt.dirty = dirty;
+	refcnt.blocks_num = blocks_num;
+	return 0;
+}
+
+static int chain_unshare(struct OpenFile *of, size_t start_blk, size_t end_blk)
+{
+	// make the chain of the file safe to modify up to block @end_blk, before
+	// writing blocks @start_blk..@end_blk. A block shared with another live
+	// file also shares its FAT link, so it is copied before anything after it
+	// gets relinked; sharing only ever covers the tail of a chain, so its
+	// predecessor is already private. A block only held by snapshots (which
+	// keep their own copy of the FAT) just needs a copy when it is written.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	uint8_t *block = NULL;
+	int ret = 0;
+	uint16_t prev_index = 0xFFFF;
+	uint16_t data_index = entry->first_data_index;
+	for (size_t blk = 0; blk <= end_blk && data_index != 0xFFFF; blk++) {
+		if (refcnt_live(data_index) > 1 || (blk >= start_blk && refcnt_get(data_index) > 1)) {
+			if (block == NULL && (block = block_get()) == NULL) {
+				ret = -1;
+				break;
+			}
+			uint16_t copy_index = chain_alloc(of, prev_index);
+			if (copy_index == 0xFFFF) {
+				ret = -1; // no space left for the private copy
+				break;
+			}
+			if (csum_read(data_index + super.data_start, block) == -1 ||
+			    csum_write(copy_index + super.data_start, block) == -1) {
+				ret = -1;
+				break;
+			}
+			fat_set(copy_index, fat.arr[data_index]);
+			refcnt_add(data_index, -1, -1);
+			if (dedup.enabled)
+				dedup.copied++;
+			if (prev_index == 0xFFFF) {
+				entry->first_data_index = copy_index;
+				rootdir_dirty = 1;
+			} else {
+				fat_set(prev_index, copy_index);
+			}
+			data_index = copy_index;
+			of->cursor_index = 0xFFFF; // chain changed, drop the cached cursor
+		}
+		prev_index = data_index;
+		data_index = fat.arr[data_index];
+	}
+	if (block != NULL)
+		block_put(block);
+	return ret;
+}
+
+static uint64_t block_hash(const uint8_t *data)
+{
+	// hash a whole block, 8 bytes at a time over 4 independent lanes. Never
+	// 0, which marks blocks of unknown content.
+	uint64_t lane[4] = { FNV_OFFSET, FNV_OFFSET ^ 1, FNV_OFFSET ^ 2, FNV_OFFSET ^ 3 };
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(lane)) {
+		for (int j = 0; j < 4; j++) {
+			uint64_t word;
+			memcpy(&word, data + i + j * sizeof(word), sizeof(word));
+			lane[j] = (lane[j] ^ word) * 0x9E3779B97F4A7C15ULL;
+			lane[j] ^= lane[j] >> 32;
+		}
+	}
+	uint64_t hash = lane[0] ^ (lane[1] << 16 | lane[1] >> 48) ^
+			(lane[2] << 32 | lane[2] >> 32) ^ (lane[3] << 48 | lane[3] >> 16);
+	return hash ? hash : 1;
+}
+
+static void dedup_insert(uint16_t data_index, uint64_t hash)
+{
+	// the latest block indexed for a slot replaces the previous one
+	dedup.hash[data_index] = hash;
+	dedup.slot[hash & dedup.slots_mask] = data_index;
+}
+
+static int dedup_link(struct OpenFile *of, uint16_t last_index, uint64_t hash, const uint8_t *data, uint8_t *other)
+{
+	// append to the chain of a file, which ends at @last_index (0xFFFF if it
+	// is empty) and is private, an indexed block holding @data: the file
+	// then shares the rest of that block's chain. Return 1 if it did.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	uint16_t data_index = dedup.slot[hash & dedup.slots_mask];
+	if (data_index == 0 || dedup.hash[data_index] != hash)
+		return 0;
+	// every shared block gains a reference: none may overflow, they must
+	// all belong to live files (whose FAT links are current), and the chain
+	// must not lead back to the file's own end
+	for (uint16_t i = data_index; i != 0xFFFF; i = fat.arr[i]) {
+		if (i == last_index || refcnt_live(i) == 0 || refcnt_get(i) == 0xFFFF)
+			return 0;
+	}
+	if (csum_read(data_index + super.data_start, other) == -1 || memcmp(data, other, BLOCK_SIZE) != 0)
+		return 0; // hash collision, or a stale entry
+	for (uint16_t i = data_index; i != 0xFFFF; i = fat.arr[i])
+		refcnt_add(i, 1, 1);
+	if (last_index == 0xFFFF) {
+		entry->first_data_index = data_index;
+		rootdir_dirty = 1;
+		of->cursor_blk = 0;
+	} else {
+		fat_set(last_index, data_index);
+		of->cursor_blk++;
+	}
+	of->cursor_index = data_index;
+	return 1;
+}
+
+static void delalloc_free(void)
+{
+	// drop the buffers of the delayed allocations, flushed or not
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		files_table.open_file[i].delay = NULL;
+		files_table.open_file[i].delay_len = 0;
+	}
+	free(delalloc.mem);
+	delalloc = (struct DelAlloc){ 0 };
+}
+
+static void dedup_free(void)
+{
+	free(dedup.hash);
+	free(dedup.slot);
+	dedup = (struct Dedup){ 0 };
+}
+
+static int frag_alloc(size_t len, uint16_t *index, uint16_t *offset)
+{
+	// find room for @len bytes in the fragment blocks, first fit, adding a
+	// block to the store when none has a large enough gap
+	int units = (len + FRAG_UNIT - 1) / FRAG_UNIT;
+	for (int blk = 0; blk < frag.blocks_num; blk++) {
+		int run = 0;
+		for (int unit = 0; unit < FRAG_UNITS_PER_BLOCK; unit++) {
+			if (frag.used[blk][unit / 8] & (1 << (unit % 8))) {
+				run = 0;
+				continue;
+			}
+			if (++run == units) {
+				*index = frag.index[blk];
+				*offset = (unit + 1 - units) * FRAG_UNIT;
+				return frag_mark(*index, *offset, len, 1);
+			}
+		}
+	}
+	if (frag_reserve(frag.blocks_num + 1) == -1)
+		return -1;
+	uint16_t data_index;
+	if (frag.entry_index == -1) {
+		frag.entry_index = meta_file_create(FRAG_FILENAME, 1);
+		if (frag.entry_index == -1)
+			return -1;
+		data_index = rootdir.entry[frag.entry_index].first_data_index;
+	} else {
+		data_index = fat_1stEmpty_ind();
+		if (data_index == 0xFFFF)
+			return -1;
+		fat_set(frag.index[frag.blocks_num - 1], data_index);
+		rootdir.entry[frag.entry_index].size_file += BLOCK_SIZE;
+		rootdir_dirty = 1;
+	}
+	frag.index[frag.blocks_num++] = data_index;
+	*index = data_index;
+	*offset = 0;
+	return frag_mark(*index, *offset, len, 1);
+}
+
+static uint8_t *frag_block(uint16_t index)
+{
+	// return the content of fragment block @index, NULL on error. The last
+	// block used stays cached: small files packed together share its read.
+	if (frag.cache_index == index)
+		return frag.cache;
+	if (csum_read(index + super.data_start, frag.cache) == -1) {
+		frag.cache_index = 0xFFFF;
+		return NULL;
+	}
+	frag.cache_index = index;
+	return frag.cache;
+}
+
+static void tail_pack(struct OpenFile *of)
+{
+	// move the partial last block of a file into a fragment block and give
+	// the block back. Best effort: the file is left as is on any failure.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t tail_len = entry->size_file % BLOCK_SIZE;
+	int last_blk = entry->size_file / BLOCK_SIZE;
+	if (!frag.enabled || tail_len == 0 || (entry->flags & (ENTRY_COMPRESSED | ENTRY_TAIL)))
+		return;
+	uint16_t last_index = meta_file_block(of->entry_index, last_blk);
+	if (last_index == 0xFFFF || refcnt_live(last_index) > 1)
+		return; // a clone shares the chain, cutting it would change the clone too
+	uint8_t *block = block_get();
+	uint16_t index, offset;
+	if (block == NULL)
+		return;
+	if (csum_read(last_index + super.data_start, block) == -1 ||
+	    frag_alloc(tail_len, &index, &offset) == -1) {
+		block_put(block);
+		return;
+	}
+	uint8_t *frag_data = frag_block(index);
+	if (frag_data != NULL)
+		memcpy(frag_data + offset, block, tail_len);
+	block_put(block);
+	if (frag_data == NULL || csum_write(index + super.data_start, frag_data) == -1) {
+		frag.cache_index = 0xFFFF;
+		frag_mark(index, offset, tail_len, 0);
+		return;
+	}
+	// cut the last block off the chain
+	if (last_blk == 0)
+		entry->first_data_index = 0xFFFF;
+	else
+		fat_set(meta_file_block(of->entry_index, last_blk - 1), 0xFFFF);
+	chain_release(last_index, fat.arr, 1);
+	entry->flags |= ENTRY_TAIL;
+	entry->tail_index = index;
+	entry->tail_offset = offset;
+	rootdir_dirty = 1;
+	of->cursor_index = 0xFFFF;
+}
+
+static int tail_unpack(int entry_index)
+{
+	// move a packed tail back into a block of its own at the end of the chain
+	struct Entry *entry = &rootdir.entry[entry_index];
+	size_t tail_len = entry->size_file % BLOCK_SIZE;
+	int last_blk = entry->size_file / BLOCK_SIZE;
+	if (!(entry->flags & ENTRY_TAIL))
+		return 0;
+	uint8_t *frag_data = frag_block(entry->tail_index);
+	if (frag_data == NULL)
+		return -1;
+	// packed files are never cloned, but dedup may have shared the end of
+	// their chain since: the last block gets a new link, it must be private
+	struct OpenFile *of = &files_table.open_file[entry_index];
+	of->entry_index = entry_index;
+	if (last_blk > 0 && refcnt.arr != NULL && chain_unshare(of, last_blk, last_blk - 1) == -1)
+		return -1;
+	uint16_t data_index = fat_1stEmpty_ind();
+	if (data_index == 0xFFFF)
+		return -1; // no space left to unpack
+	uint8_t *block = block_get();
+	if (block == NULL) {
+		chain_release(data_index, fat.arr, 1);
+		return -1;
+	}
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, frag_data + entry->tail_offset, tail_len);
+	int ret = csum_write(data_index + super.data_start, block);
+	block_put(block);
+	if (ret == -1) {
+		chain_release(data_index, fat.arr, 1);
+		return -1;
+	}
+	if (last_blk == 0)
+		entry->first_data_index = data_index;
+	else
+		fat_set(meta_file_block(entry_index, last_blk - 1), data_index);
+	frag_mark(entry->tail_index, entry->tail_offset, tail_len, 0);
+	entry->flags &= ~ENTRY_TAIL;
+	entry->tail_index = 0;
+	entry->tail_offset = 0;
+	rootdir_dirty = 1;
+	of->cursor_index = 0xFFFF;
+	return 0;
+}
+
+static int tails_unpack_all(void)
+{
+	// fragment blocks are updated in place, so they are never shared:
+	// snapshots and exports only ever see files with their tail unpacked
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] != '\0' && tail_unpack(i) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void mount_free(void)
+{
+	// drop the in-memory state of the mounted image, left as after fs_umount()
+	journal = (struct Journal){ 0 };
+	free(fat.arr);
+	free(fat.dirty);
+	fat.arr = NULL;
+	fat.dirty = NULL;
+	free(refcnt.arr);
+	free(refcnt.live);
+	free(refcnt.dirty);
+	refcnt = (struct RefCount){ .entry_index = -1 };
+	free(frag.index);
+	free(frag.used);
+	frag.index = NULL;
+	frag.used = NULL;
+	frag.blocks_num = 0;
+	free(csum.arr);
+	free(csum.dirty);
+	csum = (struct Checksums){ .entry_index = -1 };
+	dedup_free();
+	delalloc_free();
+	free(discard.pending);
+	discard = (struct Discard){ 0 };
+	// no descriptor survives into the next mount
+	free(files_table.file);
+	files_table = (struct FilesTable){ .free_head = -1 };
+	free(block_pool.mem);
+	block_pool.mem = NULL;
+	block_pool.batch = NULL;
+	block_pool.free_num = 0;
+}
+
+static int disk_umount(void)
+{
+	if (files_table.num_open > 0 || mappings != NULL)
+		return -1; // descriptors and mappings hold their file until closed
+	if (delalloc_flush_all() == -1)
+		return -1;
+	if (csum_write(0,&super)==-1){
+		return -1;
+	}
+	batch_depth = 0;
+	if (durability.mode >= FS_DURABLE_UMOUNT) {
+		if (disk_commit() == -1)
+			return -1;
+	} else if (meta_flush() == -1) {
+		return -1;
+	} else {
+		discard_flush(); // nothing is flushed under this policy
+	}
+	// leave a clean image, readable without replaying the journal
+	if (journal.blocks_num > 0 && journal_checkpoint() == -1)
+		return -1;
+	// with every checksum written, the table matches the disk again
+	if (csum.arr != NULL) {
+		if (csum_header_write(1) == -1)
+			return -1;
+		if (durability.mode >= FS_DURABLE_UMOUNT && block_disk_sync() == -1)
+			return -1;
+	}
+	commit_thread_stop();
+	mount_free();
+	return block_disk_close();
+}
+
+int fs_umount(void)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = disk_umount();
+	pthread_mutex_unlock(&fs_lock);
+	commit_thread_join();
+	trace_end(start, FS_TRACE_UMOUNT, -1, 0, 0, ret, NULL, NULL);
+	return ret;
+}
+
+int fs_tailpack(int enable)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	frag.enabled = enable != 0;
+	return 0;
+}
+
+int fs_dedup(int enable)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	pthread_mutex_lock(&fs_lock);
+	int ret = 0;
+	if (!enable) {
+		dedup_free();
+	} else if (!dedup.enabled && delalloc_flush_all() == -1) {
+		ret = -1; // buffered data is not indexed, it must be on disk first
+	} else if (!dedup.enabled) {
+		// sharing blocks needs reference counts
+		size_t slots = 1;
+		while (slots < super.data_blocks_num)
+			slots <<= 1;
+		dedup.hash = (uint64_t*)calloc(super.data_blocks_num, sizeof(uint64_t));
+		dedup.slot = (uint16_t*)calloc(slots, sizeof(uint16_t));
+		dedup.slots_mask = slots - 1;
+		uint8_t *block = block_get();
+		ret = dedup.hash == NULL || dedup.slot == NULL || block == NULL ||
+		      refcnt_enable() == -1 || meta_update() == -1 ? -1 : 0;
+		// index the blocks of the plain files already on disk
+		for (int i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++) {
+			struct Entry *entry = &rootdir.entry[i];
+			if (entry->filename[0] == '\0' || entry->filename[0] == FS_META_PREFIX ||
+			    (entry->flags & ENTRY_COMPRESSED) || files_table.open_file[i].maps_writable > 0)
+				continue;
+			uint16_t data_index = entry->first_data_index;
+			for (; ret == 0 && data_index != 0xFFFF; data_index = fat.arr[data_index]) {
+				if (dedup.hash[data_index] != 0)
+					continue; // shared, already indexed
+				ret = csum_read(data_index + super.data_start, block);
+				if (ret == 0)
+					dedup_insert(data_index, block_hash(block));
+			}
+		}
+		if (block != NULL)
+			block_put(block);
+		if (ret == -1)
+			dedup_free();
+		else
+			dedup.enabled = 1;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_dedup_stats(struct fs_dedup_stats *stats)
+{
+	if (fat.arr == NULL || stats == NULL)
+		return -1; // not mounted, or nowhere to put the statistics
+	uint8_t *seen = (uint8_t*)calloc((super.data_blocks_num + 7) / 8, 1);
+	if (seen == NULL)
+		return -1;
+	pthread_mutex_lock(&fs_lock);
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct Entry *entry = &rootdir.entry[i];
+		if (entry->filename[0] == '\0' || entry->filename[0] == FS_META_PREFIX)
+			continue;
+		uint16_t data_index = entry->first_data_index;
+		for (; data_index != 0xFFFF; data_index = fat.arr[data_index]) {
+			stats->logical_blocks++;
+			if (!(seen[data_index / 8] & (1 << (data_index % 8)))) {
+				seen[data_index / 8] |= 1 << (data_index % 8);
+				stats->physical_blocks++;
+			}
+		}
+	}
+	stats->blocks_written = dedup.written;
+	stats->writes_avoided = dedup.avoided;
+	stats->blocks_copied = dedup.copied;
+	pthread_mutex_unlock(&fs_lock);
+	free(seen);
+	return 0;
+}
+
+int fs_free_count(void)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	int num_free_fat = 0;
+	for(int i = 0; i < super.data_blocks_num; i++){
+		if(fat.arr[i] == 0)
+			num_free_fat ++;
+	}
+	return num_free_fat - delalloc.reserved; // promised to buffered data
+}
+
+int fs_info(void)
+{
+	printf("FS Info:\n");
+	printf("total_blk_count=%i\n",super.total_blocks_num);
+	printf("fat_blk_count=%i\n",super.fat_blocks_num);
+	printf("rdir_blk=%i\n",super.root_index);
+	printf("data_blk=%i\n",super.data_start);
+	printf("data_blk_count=%i\n",super.data_blocks_num);
+
+	int num_free_fat = fs_free_count();
+	printf("fat_free_ratio=%d/%d\n", num_free_fat,super.data_blocks_num);
+
+	int num_free_root = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if (rootdir.entry[i].filename[0] == '\0')
+			num_free_root++;
+	}
+	printf("rdir_free_ratio=%d/%d\n", num_free_root, FS_FILE_MAX_COUNT);
+	return 0;
+}
+
+static int entry_create(const char *filename)
+{
+	// Verify that filename to create is valid 
+	if (filename == NULL || strlen(filename) > FS_FILENAME_LEN || filename[0] == FS_META_PREFIX)
+		return -1;
+	// NEXT we check first before we create file
+	int file_count = 0;
+	// Searching  through root directory
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] != '\0') {
+			file_count += 1; // if the entry isn't for empty file, file count incremented
+		}
+		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
+			return -1; // file already exists
+		}
+	}
+	// The root directory already contains FS_FILE_MAX_COUNT files.
+	if (file_count >= FS_FILE_MAX_COUNT)
+		return -1; 
+	//After checking, move forward for creation
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
+		if (rootdir.entry[i].filename[0] == '\0') {
+			strncpy((char*)rootdir.entry[i].filename, filename, FS_FILENAME_LEN); // copy the file name
+			rootdir.entry[i].size_file = 0; // the root dir has size of 0
+			rootdir.entry[i].first_data_index = 0xFFFF;  // the first data starts from 0xFFFF
+			rootdir_dirty = 1;
+			break;
+		}
+	}
+
+	return meta_update();
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = entry_create(filename);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_CREATE, -1, 0, 0, ret, filename, NULL);
+	return ret;
+}
+
+static int entry_delete(const char *filename)
+{
+	if (filename == NULL || filename[0] == FS_META_PREFIX)
+		return -1;
+	uint16_t data_index = 0xFFFF;
+	int file_found = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
+			if (files_table.open_file[i].ref_count > 0)
+				return -1; // file is currently open
+			file_found = 1; // find the file!
+			data_index = rootdir.entry[i].first_data_index; // find the first data index
+			if (rootdir.entry[i].flags & ENTRY_TAIL) // give the packed tail back
+				frag_mark(rootdir.entry[i].tail_index, rootdir.entry[i].tail_offset,
+					  rootdir.entry[i].size_file % BLOCK_SIZE, 0);
+			//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
+			memset(&rootdir.entry[i], 0, sizeof(struct Entry)); // cleans, flags included
+			rootdir.entry[i].first_data_index = 0xFFFF; // cleans
+			rootdir_dirty = 1;
+			break;
+		}
+	}
+	if (file_found == -1) // file not found
+		return -1;
+
+	//now we have the starting data index in FAT, clean!
+	chain_release(data_index, fat.arr, 1);
+
+	return meta_update();
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = entry_delete(filename);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_DELETE, -1, 0, 0, ret, filename, NULL);
+	return ret;
+}
+
+static int entry_rename(const char *oldname, const char *newname)
+{
+	// Verify that both names are valid
+	if (oldname == NULL || newname == NULL || strlen(newname) > FS_FILENAME_LEN)
+		return -1;
+	if (oldname[0] == FS_META_PREFIX || newname[0] == FS_META_PREFIX)
+		return -1; // metadata files cannot be renamed
+	if (newname[0] == '\0' || entry_find(newname) != -1)
+		return -1; // empty name or a file named @newname already exists
+	int entry_index = entry_find(oldname);
+	if (entry_index == -1)
+		return -1; // there is no file named @oldname
+	// open descriptors refer to the entry index, so they stay valid
+	strncpy((char*)rootdir.entry[entry_index].filename, newname, FS_FILENAME_LEN);
+	rootdir_dirty = 1;
+	return meta_update();
+}
+
+int fs_rename(const char *oldname, const char *newname)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = entry_rename(oldname, newname);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_RENAME, -1, 0, 0, ret, oldname, newname);
+	return ret;
+}
+
+int fs_durability(int mode, unsigned int interval_ms, size_t interval_bytes)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	if (mode < FS_DURABLE_NONE || mode > FS_DURABLE_GROUP)
+		return -1;
+	if (mode == FS_DURABLE_GROUP && interval_ms == 0 && interval_bytes == 0)
+		return -1; // the commits would never happen
+	pthread_mutex_lock(&fs_lock);
+	int ret = 0;
+	// leaving group commit: what waited for the next commit goes now
+	if (durability.mode == FS_DURABLE_GROUP && mode != FS_DURABLE_GROUP &&
+	    durability.pending && batch_depth == 0)
+		ret = disk_commit();
+	// age limits are enforced by a thread, which picks up the new one
+	int timed = mode == FS_DURABLE_GROUP && interval_ms != 0;
+	if (ret == 0 && timed && !durability.thread_running)
+		ret = commit_thread_start();
+	if (ret == 0) {
+		durability.mode = mode;
+		durability.interval_ms = interval_ms;
+		durability.interval_bytes = interval_bytes;
+		if (!timed)
+			commit_thread_stop();
+		else
+			pthread_cond_signal(&durability.kick);
+	}
+	pthread_mutex_unlock(&fs_lock);
+	commit_thread_join();
+	return ret;
+}
+
+static int disk_sync(void)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	pthread_mutex_lock(&fs_lock);
+	// buffered data gets its blocks first
+	int ret = delalloc_flush_all();
+	// the metadata of a batch in progress stays in memory
+	if (ret == 0 && durability.mode >= FS_DURABLE_SYNC)
+		ret = batch_depth > 0 ? block_disk_sync() : disk_commit();
+	else if (ret == 0 && batch_depth == 0)
+		ret = meta_flush();
+	// what the write-back cache holds reaches the image, unflushed
+	if (ret == 0 && durability.mode < FS_DURABLE_SYNC)
+		ret = block_flush();
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_sync(void)
+{
+	uint64_t start = trace_begin();
+	int ret = disk_sync();
+	trace_end(start, FS_TRACE_SYNC, -1, 0, 0, ret, NULL, NULL);
+	return ret;
+}
+
+int fs_writeback(size_t dirty_max, unsigned int expire_ms)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	pthread_mutex_lock(&fs_lock);
+	int ret = block_writeback(dirty_max, expire_ms);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_delalloc(int enable)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	pthread_mutex_lock(&fs_lock);
+	int ret = 0;
+	if (!enable) {
+		ret = delalloc_flush_all();
+		if (ret == 0)
+			delalloc_free();
+	} else if (!delalloc.enabled) {
+		if (posix_memalign((void**)&delalloc.mem, BLOCK_SIZE,
+				   DELALLOC_BUFFERS * DELALLOC_BLOCKS * BLOCK_SIZE) != 0) {
+			delalloc.mem = NULL;
+			ret = -1;
+		} else {
+			for (int i = 0; i < DELALLOC_BUFFERS; i++)
+				delalloc.free[i] = delalloc.mem + (size_t)i * DELALLOC_BLOCKS * BLOCK_SIZE;
+			delalloc.free_num = DELALLOC_BUFFERS;
+			delalloc.enabled = 1;
+		}
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_discard(int enable)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	pthread_mutex_lock(&fs_lock);
+	int ret = 0;
+	if (!enable) {
+		// what is freed but not written yet is left for fs_trim()
+		free(discard.pending);
+		discard = (struct Discard){ 0 };
+	} else if (discard.pending == NULL) {
+		discard.pending = (uint8_t*)calloc((super.data_blocks_num + 7) / 8, 1);
+		ret = discard.pending == NULL ? -1 : 0;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_trim(void)
+{
+	if (fat.arr == NULL || batch_depth > 0)
+		return -1; // not mounted, or the metadata of a batch is not written
+	pthread_mutex_lock(&fs_lock);
+	// only blocks the metadata on disk knows as free can go
+	int ret = durability.mode >= FS_DURABLE_SYNC ? disk_commit() : meta_flush();
+	int trimmed = 0;
+	for (int i = 1; ret == 0 && i < super.data_blocks_num; i++) {
+		if (fat.arr[i] != 0)
+			continue;
+		int n = 1;
+		while (i + n < super.data_blocks_num && fat.arr[i + n] == 0)
+			n++;
+		ret = block_discard(i + super.data_start, n);
+		trimmed += n;
+		i += n - 1;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return ret == -1 ? -1 : trimmed;
+}
+
+static int journal_create(int blocks_num)
+{
+	if (fat.arr == NULL || blocks_num < 0)
+		return -1; // not mounted
+	if (journal.blocks_num > 0 || batch_depth > 0)
+		return -1; // already journaled, or in the middle of a batch
+	if (delalloc_flush_all() == -1)
+		return -1;
+	int min_blocks = 1 + journal_txn_max();
+	if (blocks_num == 0)
+		blocks_num = JOURNAL_DEFAULT_TXNS * min_blocks;
+	if (blocks_num < min_blocks)
+		return -1;
+	int entry_index = entry_find(JOURNAL_FILENAME);
+	if (entry_index != -1)
+		meta_file_delete(entry_index); // left by an interrupted fs_journal()
+	entry_index = meta_entry_find_free();
+	if (entry_index == -1)
+		return -1;
+	// the journal is written sequentially: find a run of free blocks
+	int first_index = 0, run = 0;
+	for (int i = 1; i < super.data_blocks_num && run < blocks_num; i++) {
+		if (fat.arr[i] != 0)
+			run = 0;
+		else if (run++ == 0)
+			first_index = i;
+	}
+	if (run < blocks_num)
+		return -1; // no space left, or too fragmented
+	for (int i = 0; i < blocks_num; i++) {
+		fat_set(first_index + i, i + 1 < blocks_num ? first_index + i + 1 : 0xFFFF);
+		refcnt_add(first_index + i, 1, 1);
+	}
+	meta_entry_set(entry_index, JOURNAL_FILENAME, first_index, blocks_num);
+	// the journal must be ready and its blocks reserved before the
+	// superblock points to it
+	journal = (struct Journal){ first_index + super.data_start, blocks_num, 1, 1 };
+	int ret = -1;
+	if (journal_reset() == 0 && meta_write(0) == 0 && block_disk_sync() == 0) {
+		super.journal_start = journal.start;
+		super.journal_blocks_num = journal.blocks_num;
+		if (csum_write(0, &super) == 0 && block_disk_sync() == 0)
+			return 0;
+		super.journal_start = 0;
+		super.journal_blocks_num = 0;
+	}
+	journal = (struct Journal){ 0 };
+	return ret;
+}
+
+int fs_journal(int blocks_num)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = journal_create(blocks_num);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+static void csum_disable(void)
+{
+	if (csum.arr == NULL)
+		return;
+	int entry_index = csum.entry_index;
+	free(csum.arr);
+	free(csum.dirty);
+	csum = (struct Checksums){ .entry_index = -1 };
+	meta_file_delete(entry_index);
+}
+
+static int csum_enable(void)
+{
+	// create the checksum table, and checksum every block in use
+	if (csum.arr != NULL)
+		return 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (files_table.open_file[i].maps_writable > 0)
+			return -1; // written through a mapping, its blocks cannot be checked
+	}
+	if (delalloc_flush_all() == -1)
+		return -1; // buffered data has no block to checksum yet
+	int blocks_num = (super.total_blocks_num + CSUM_ENTRIES_PER_BLOCK - 1) / CSUM_ENTRIES_PER_BLOCK;
+	if (journal.blocks_num > 0) {
+		// the table is logged with the other metadata: the largest
+		// transaction must still fit, and the next one, logging the whole
+		// table, goes at the start of the journal
+		if (1 + journal_txn_max() + blocks_num > journal.blocks_num)
+			return -1;
+		int ret = durability.mode == FS_DURABLE_GROUP ? disk_commit() : meta_flush();
+		if (ret == -1 || journal_checkpoint() == -1)
+			return -1;
+	}
+	uint32_t *arr = (uint32_t*)calloc(blocks_num, BLOCK_SIZE);
+	uint8_t *dirty = (uint8_t*)malloc(blocks_num);
+	int entry_index = -1;
+	if (arr == NULL || dirty == NULL ||
+	    (entry_index = meta_file_create(CSUM_FILENAME, 1 + blocks_num)) == -1) {
+		free(arr);
+		free(dirty);
+		return -1;
+	}
+	csum = (struct Checksums){ entry_index, arr, dirty, blocks_num, 0 };
+	if (csum_header_write(0) == -1 || csum_fill() == -1) {
+		csum_disable();
+		return -1;
+	}
+	return 0;
+}
+
+int fs_checksum(int mode)
+{
+	if (fat.arr == NULL || mode < FS_CSUM_NONE || mode > FS_CSUM_VERIFY)
+		return -1; // not mounted, or no such mode
+	if (batch_depth > 0)
+		return -1; // in the middle of a batch
+	pthread_mutex_lock(&fs_lock);
+	int ret = 0;
+	if (mode == FS_CSUM_NONE) {
+		if (csum.arr != NULL) {
+			csum_disable();
+			ret = meta_update();
+		}
+	} else if (csum.arr == NULL) {
+		ret = csum_enable() == -1 || meta_update() == -1 ? -1 : 0;
+	}
+	if (ret == 0 && csum.arr != NULL)
+		csum.verify = mode == FS_CSUM_VERIFY;
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_scrub(void)
+{
+	if (fat.arr == NULL || csum.arr == NULL || batch_depth > 0)
+		return -1; // not mounted, no checksums, or in the middle of a batch
+	pthread_mutex_lock(&fs_lock);
+	// the table in memory tells what each block written holds: buffered data
+	// must have its blocks, and metadata only logged must be in place
+	int ret = delalloc_flush_all();
+	if (ret == 0 && journal.blocks_num > 0) {
+		ret = durability.mode == FS_DURABLE_GROUP ? disk_commit() : meta_flush();
+		if (ret == 0)
+			ret = journal_checkpoint();
+	}
+	uint8_t *block = block_get();
+	int errors = 0;
+	if (block == NULL)
+		ret = -1;
+	for (int i = 0; ret == 0 && i < super.total_blocks_num; i++) {
+		if (csum.arr[i] == 0)
+			continue;
+		ret = block_read(i, block);
+		if (ret == 0 && csum_value(block) != csum.arr[i])
+			errors++;
+	}
+	if (block != NULL)
+		block_put(block);
+	pthread_mutex_unlock(&fs_lock);
+	return ret == -1 ? -1 : errors;
+}
+
+static void batch_begin(void)
+{
+	// metadata changes are kept in memory until the matching batch_commit()
+	batch_depth++;
+}
+
+static int batch_commit(void)
+{
+	if (batch_depth == 0)
+		return -1; // no batch in progress
+	batch_depth--;
+	return meta_update();
+}
+
+int fs_begin(void)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	batch_begin();
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_BEGIN, -1, 0, 0, 0, NULL, NULL);
+	return 0;
+}
+
+int fs_commit(void)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = batch_commit();
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_COMMIT, -1, 0, 0, ret, NULL, NULL);
+	return ret;
+}
+
+int fs_create_many(const char **filenames, int count)
+{
+	if (filenames == NULL || count < 0)
+		return -1;
+	int created = 0;
+	fs_begin();
+	for (int i = 0; i < count; i++) {
+		if (fs_create(filenames[i]) == 0)
+			created++;
+	}
+	if (fs_commit() == -1)
+		return -1;
+	return created;
+}
+
+int fs_delete_many(const char **filenames, int count)
+{
+	if (filenames == NULL || count < 0)
+		return -1;
+	int deleted = 0;
+	fs_begin();
+	for (int i = 0; i < count; i++) {
+		if (fs_delete(filenames[i]) == 0)
+			deleted++;
+	}
+	if (fs_commit() == -1)
+		return -1;
+	return deleted;
+}
+
+static int clone_file(const char *src, const char *dst)
+{
+	if (src == NULL || dst == NULL || src[0] == FS_META_PREFIX)
+		return -1;
+	int src_index = entry_find(src);
+	if (src_index == -1)
+		return -1; // there is no file named @src
+	if (files_table.open_file[src_index].maps_writable > 0)
+		return -1; // written through a mapping, its blocks cannot be shared
+	if (delalloc_flush_all() == -1)
+		return -1;
+	// every block of the source gains a reference, make sure none overflows
+	uint16_t data_index = rootdir.entry[src_index].first_data_index;
+	for (; data_index != 0xFFFF; data_index = fat.arr[data_index]) {
+		if (refcnt_get(data_index) == 0xFFFF)
+			return -1;
+	}
+
+	batch_begin();
+	if (tail_unpack(src_index) == -1 || refcnt_enable() == -1 || entry_create(dst) == -1) {
+		batch_commit();
+		return -1;
+	}
+	int dst_index = entry_find(dst);
+	// the new entry shares the whole chain of the source
+	data_index = rootdir.entry[src_index].first_data_index;
+	for (; data_index != 0xFFFF; data_index = fat.arr[data_index])
+		refcnt_add(data_index, 1, 1);
+	// same content and storage mode, only the name differs
+	memcpy((uint8_t*)&rootdir.entry[dst_index] + FS_FILENAME_LEN,
+	       (uint8_t*)&rootdir.entry[src_index] + FS_FILENAME_LEN, sizeof(struct Entry) - FS_FILENAME_LEN);
+	rootdir_dirty = 1;
+	return batch_commit();
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = clone_file(src, dst);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_CLONE, -1, 0, 0, ret, src, dst);
+	return ret;
+}
+
+static void snapshot_filename(char *filename, const char *name)
+{
+	snprintf(filename, FS_FILENAME_LEN, "%s%s", SNAPSHOT_PREFIX, name);
+}
+
+static void rootdir_user_copy(struct RootDirectory *copy)
+{
+	// copy of the root directory without the hidden metadata entries
+	memcpy(copy, &rootdir, sizeof(struct RootDirectory));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (copy->entry[i].filename[0] == FS_META_PREFIX) {
+			memset(&copy->entry[i], 0, sizeof(struct Entry));
+			copy->entry[i].first_data_index = 0xFFFF;
+		}
+	}
+}
+
+static int snapshot_load(const char *name, struct RootDirectory *copy, uint16_t *links)
+{
+	// load the root directory and FAT frozen by snapshot @name, or the live
+	// ones if NULL. @links holds %fat_blocks_num blocks.
+	if (name == NULL) {
+		rootdir_user_copy(copy);
+		memcpy(links, fat.arr, super.fat_blocks_num * BLOCK_SIZE);
+		return 0;
+	}
+	char filename[FS_FILENAME_LEN];
+	snapshot_filename(filename, name);
+	int entry_index = entry_find(filename);
+	if (entry_index == -1)
+		return -1;
+	if (csum_read(meta_file_block(entry_index, 0) + super.data_start, copy) == -1)
+		return -1;
+	for (int i = 0; i < super.fat_blocks_num; i++) {
+		if (csum_read(meta_file_block(entry_index, i + 1) + super.data_start,
+			       links + i * FAT_ENTRIES_PER_BLOCK) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int snapshot_blocks(const struct RootDirectory *copy, const uint16_t *links, uint8_t *used)
+{
+	// mark every data block reachable from the entries of @copy through @links
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (copy->entry[i].filename[0] == '\0')
+			continue;
+		uint16_t data_index = copy->entry[i].first_data_index;
+		for (int steps = 0; data_index != 0xFFFF; steps++) {
+			if (data_index >= super.data_blocks_num || steps >= super.data_blocks_num)
+				return -1; // broken chain
+			used[data_index] = 1;
+			data_index = links[data_index];
+		}
+	}
+	return 0;
+}
+
+static uint64_t rootdir_fingerprint(const struct RootDirectory *copy)
+{
+	// FNV-1a over the used entries, identifies the state a diff applies to
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (copy->entry[i].filename[0] == '\0')
+			continue;
+		const uint8_t *bytes = (const uint8_t*)&copy->entry[i];
+		for (size_t j = 0; j < sizeof(struct Entry); j++) {
+			hash ^= bytes[j];
+			hash *= 0x100000001b3ULL;
+		}
+		hash ^= i;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int snapshot_create(const char *name)
+{
+	if (name == NULL || name[0] == '\0' || strlen(name) + strlen(SNAPSHOT_PREFIX) >= FS_FILENAME_LEN)
+		return -1;
+	char filename[FS_FILENAME_LEN];
+	snapshot_filename(filename, name);
+	if (entry_find(filename) != -1)
+		return -1; // snapshot already exists
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (files_table.open_file[i].maps_writable > 0)
+			return -1; // written through a mapping, its blocks cannot be shared
+	}
+	if (delalloc_flush_all() == -1)
+		return -1;
+	if (tails_unpack_all() == -1)
+		return -1;
+	struct RootDirectory copy;
+	rootdir_user_copy(&copy);
+	// the snapshot takes one more reference on each block of each file
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		uint16_t data_index = copy.entry[i].first_data_index;
+		for (; copy.entry[i].filename[0] != '\0' && data_index != 0xFFFF; data_index = fat.arr[data_index]) {
+			if (refcnt_get(data_index) == 0xFFFF)
+				return -1;
+		}
+	}
+
+	batch_begin();
+	int entry_index = -1;
+	if (refcnt_enable() == -1 ||
+	    (entry_index = meta_file_create(filename, 1 + super.fat_blocks_num)) == -1) {
+		batch_commit();
+		return -1;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		uint16_t data_index = copy.entry[i].first_data_index;
+		for (; copy.entry[i].filename[0] != '\0' && data_index != 0xFFFF; data_index = fat.arr[data_index])
+			refcnt_add(data_index, 1, 0);
+	}
+	// freeze the root directory and the FAT: the live FAT can then relink
+	// chains freely, and only the blocks actually written get copied
+	int ret = csum_write(meta_file_block(entry_index, 0) + super.data_start, &copy);
+	for (int i = 0; ret == 0 && i < super.fat_blocks_num; i++)
+		ret = csum_write(meta_file_block(entry_index, i + 1) + super.data_start,
+				  fat.arr + i * FAT_ENTRIES_PER_BLOCK);
+	if (ret == -1) {
+		// undo from memory, the frozen copy may not read back
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			uint16_t data_index = copy.entry[i].first_data_index;
+			for (; copy.entry[i].filename[0] != '\0' && data_index != 0xFFFF; data_index = fat.arr[data_index])
+				refcnt_add(data_index, -1, 0);
+		}
+		meta_file_delete(entry_index);
+		batch_commit();
+		return -1;
+	}
+	return batch_commit();
+}
+
+int fs_snapshot(const char *name)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = snapshot_create(name);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+static int snapshot_delete(const char *name)
+{
+	if (name == NULL)
+		return -1;
+	char filename[FS_FILENAME_LEN];
+	snapshot_filename(filename, name);
+	int entry_index = entry_find(filename);
+	if (entry_index == -1)
+		return -1;
+	struct RootDirectory copy;
+	uint16_t *links = (uint16_t*)malloc(super.fat_blocks_num * BLOCK_SIZE);
+	if (links == NULL || snapshot_load(name, &copy, links) == -1) {
+		free(links);
+		return -1;
+	}
+	batch_begin();
+	// give back the references taken on the frozen files
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (copy.entry[i].filename[0] != '\0')
+			chain_release(copy.entry[i].first_data_index, links, 0);
+	}
+	meta_file_delete(entry_index);
+	free(links);
+	return batch_commit();
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = snapshot_delete(name);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_snapshot_ls(void)
+{
+	printf("FS Snapshots:\n");
+	size_t prefix_len = strlen(SNAPSHOT_PREFIX);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strncmp((char*)rootdir.entry[i].filename, SNAPSHOT_PREFIX, prefix_len) == 0)
+			printf("snapshot: %s\n", (char*)rootdir.entry[i].filename + prefix_len);
+	}
+	return 0;
+}
+
+static int snapshot_diff(const char *from, const char *to, const char *diffname)
+{
+	if (diffname == NULL || delalloc_flush_all() == -1)
+		return -1;
+	struct RootDirectory from_copy, to_copy;
+	uint8_t *from_used = (uint8_t*)calloc(super.data_blocks_num, 1);
+	uint8_t *to_used = (uint8_t*)calloc(super.data_blocks_num, 1);
+	uint16_t *from_links = (uint16_t*)malloc(super.fat_blocks_num * BLOCK_SIZE);
+	uint16_t *to_links = (uint16_t*)malloc(super.fat_blocks_num * BLOCK_SIZE);
+	uint8_t block[BLOCK_SIZE];
+	int ret = -1;
+	FILE *out = NULL;
+	if (from_used == NULL || to_used == NULL || from_links == NULL || to_links == NULL)
+		goto out;
+	// no @from means a full export, diffed against an empty file system
+	memset(&from_copy, 0, sizeof(from_copy));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		from_copy.entry[i].first_data_index = 0xFFFF;
+	if (from != NULL && snapshot_load(from, &from_copy, from_links) == -1)
+		goto out;
+	if (to == NULL && tails_unpack_all() == -1)
+		goto out; // the export carries whole blocks only
+	if (snapshot_load(to, &to_copy, to_links) == -1)
+		goto out;
+	if (snapshot_blocks(&from_copy, from_links, from_used) == -1 ||
+	    snapshot_blocks(&to_copy, to_links, to_used) == -1)
+		goto out;
+
+	struct DiffHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, DIFF_SIGNATURE, 8);
+	header.from_fingerprint = rootdir_fingerprint(&from_copy);
+	header.data_blocks_num = super.data_blocks_num;
+	for (int i = 0; i < super.data_blocks_num; i++) {
+		header.links_num += to_used[i];
+		header.blocks_num += to_used[i] && !from_used[i];
+	}
+
+	out = fopen(diffname, "w");
+	if (out == NULL)
+		goto out;
+	if (fwrite(&header, sizeof(header), 1, out) != 1 || fwrite(&to_copy, sizeof(to_copy), 1, out) != 1)
+		goto out;
+	// the chain layout of @to, one (index, next) pair per used block
+	for (uint16_t i = 0; i < super.data_blocks_num; i++) {
+		uint16_t link[2] = { i, to_links[i] };
+		if (to_used[i] && fwrite(link, sizeof(link), 1, out) != 1)
+			goto out;
+	}
+	// and the content of the blocks @from does not have
+	for (uint16_t i = 0; i < super.data_blocks_num; i++) {
+		if (!to_used[i] || from_used[i])
+			continue;
+		if (csum_read(i + super.data_start, block) == -1 ||
+		    fwrite(&i, sizeof(i), 1, out) != 1 || fwrite(block, BLOCK_SIZE, 1, out) != 1)
+			goto out;
+	}
+	ret = header.blocks_num;
+out:
+	if (out != NULL && fclose(out) != 0)
+		ret = -1;
+	free(from_used);
+	free(to_used);
+	free(from_links);
+	free(to_links);
+	return ret;
+}
+
+int fs_snapshot_diff(const char *from, const char *to, const char *diffname)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = snapshot_diff(from, to, diffname);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+static int snapshot_apply(const char *diffname)
+{
+	if (diffname == NULL || files_table.num_open > 0)
+		return -1;
+	// the image must be a replica holding plain files only
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] == FS_META_PREFIX)
+			return -1;
+	}
+	FILE *in = fopen(diffname, "r");
+	if (in == NULL)
+		return -1;
+	struct DiffHeader header;
+	struct RootDirectory to_copy;
+	uint8_t block[BLOCK_SIZE];
+	uint16_t *links = NULL;
+	uint8_t *linked = NULL; // 1: block linked by the diff, 2: and its content carried
+	int ret = -1;
+	if (fread(&header, sizeof(header), 1, in) != 1 || fread(&to_copy, sizeof(to_copy), 1, in) != 1)
+		goto out;
+	if (memcmp(header.signature, DIFF_SIGNATURE, 8) != 0 || header.data_blocks_num != super.data_blocks_num)
+		goto out;
+	if (header.from_fingerprint != rootdir_fingerprint(&rootdir))
+		goto out; // the image is not in the state the diff starts from
+	if (header.links_num >= super.data_blocks_num || header.blocks_num > header.links_num)
+		goto out; // more blocks than the image has
+	links = (uint16_t*)malloc(header.links_num * 2 * sizeof(uint16_t));
+	linked = (uint8_t*)calloc(super.data_blocks_num, 1);
+	if (links == NULL || linked == NULL ||
+	    fread(links, 2 * sizeof(uint16_t), header.links_num, in) != header.links_num)
+		goto out;
+	// check the whole diff before changing anything: a bad one must leave the
+	// image as it was. Each block is linked once, to the end of its chain
+	// (0xFFFF) or to another linked block, ...
+	for (int i = 0; i < header.links_num; i++) {
+		uint16_t index = links[2 * i];
+		if (index == 0 || index >= super.data_blocks_num || linked[index])
+			goto out;
+		linked[index] = 1;
+	}
+	for (int i = 0; i < header.links_num; i++) {
+		uint16_t next = links[2 * i + 1];
+		if (next != 0xFFFF && (next >= super.data_blocks_num || !linked[next]))
+			goto out;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		uint16_t first = to_copy.entry[i].first_data_index;
+		if (to_copy.entry[i].filename[0] != '\0' && first != 0xFFFF &&
+		    (first >= super.data_blocks_num || !linked[first]))
+			goto out;
+	}
+	// ... and each block carried is linked, and free in the current state, so
+	// that writing it overwrites no live data
+	long data_start = ftell(in);
+	for (int i = 0; i < header.blocks_num; i++) {
+		uint16_t data_index;
+		if (fread(&data_index, sizeof(data_index), 1, in) != 1 || fread(block, BLOCK_SIZE, 1, in) != 1)
+			goto out; // read to catch a truncated diff too
+		if (data_index >= super.data_blocks_num || linked[data_index] != 1 || fat.arr[data_index] != 0)
+			goto out;
+		linked[data_index] = 2; // written once only
+	}
+	if (data_start == -1 || fseek(in, data_start, SEEK_SET) != 0)
+		goto out;
+	// data first, then the metadata that points to it
+	for (int i = 0; i < header.blocks_num; i++) {
+		uint16_t data_index;
+		if (fread(&data_index, sizeof(data_index), 1, in) != 1 || fread(block, BLOCK_SIZE, 1, in) != 1)
+			goto out;
+		if (csum_write(data_index + super.data_start, block) == -1)
+			goto out;
+	}
+	// then switch the FAT and the root directory over to the new state
+	for (uint16_t i = 1; i < super.data_blocks_num; i++) {
+		if (fat.arr[i] != 0)
+			fat_set(i, 0);
+	}
+	for (int i = 0; i < header.links_num; i++)
+		fat_set(links[2 * i], links[2 * i + 1]);
+	memcpy(&rootdir, &to_copy, sizeof(rootdir));
+	rootdir_dirty = 1;
+	ret = meta_update();
+out:
+	free(links);
+	free(linked);
+	fclose(in);
+	return ret;
+}
+
+int fs_snapshot_apply(const char *diffname)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = snapshot_apply(diffname);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+static int chain_runs(uint16_t data_index, int *blocks_num)
+{
+	// count the blocks of a chain and the runs of consecutive blocks they form
+	int runs = 0;
+	*blocks_num = 0;
+	for (uint16_t prev_index = 0xFFFF; data_index != 0xFFFF; data_index = fat.arr[data_index]) {
+		if (prev_index == 0xFFFF || data_index != prev_index + 1)
+			runs++;
+		(*blocks_num)++;
+		prev_index = data_index;
+	}
+	return runs;
+}
+
+double fs_frag_score(void)
+{
+	if (fat.arr == NULL)
+		return -1; // not mounted
+	int total_blocks = 0, total_runs = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] == '\0' || rootdir.entry[i].filename[0] == FS_META_PREFIX)
+			continue;
+		int blocks_num;
+		total_runs += chain_runs(rootdir.entry[i].first_data_index, &blocks_num);
+		total_blocks += blocks_num;
+	}
+	return total_runs ? (double)total_blocks / total_runs : 0;
+}
+
+static int defrag_fits(const uint16_t *chain, int blocks_num, int start)
+{
+	// return how many leading blocks of the chain fit in the range at @start:
+	// each range block must be free or already the chain's block for that position
+	int i = 0;
+	while (i < blocks_num && start + i < super.data_blocks_num &&
+	       (fat.arr[start + i] == 0 || chain[i] == start + i))
+		i++;
+	return i;
+}
+
+static int defrag_target(const uint16_t *chain, int blocks_num)
+{
+	// find where the chain can be laid out in one run, return the start of
+	// the range, -1 if there is none. Keeping the first block in place comes
+	// first, so a file moved over several budgeted calls keeps its target.
+	if (defrag_fits(chain, blocks_num, chain[0]) == blocks_num)
+		return chain[0];
+	for (int start = 1; start + blocks_num <= super.data_blocks_num; start++) {
+		int i = defrag_fits(chain, blocks_num, start);
+		if (i == blocks_num)
+			return start;
+		start += i; // the range cannot start before the conflicting block
+	}
+	return -1;
+}
+
+static int defrag_file(int entry_index, int budget)
+{
+	// move up to @budget blocks of a file towards a single run, return the
+	// number of blocks moved. Blocks are copied first, then the chain is
+	// relinked, then the old blocks are freed, with the metadata persisted
+	// in between: a crash leaks at most the blocks being moved.
+	struct Entry *entry = &rootdir.entry[entry_index];
+	int blocks_num;
+	if (chain_runs(entry->first_data_index, &blocks_num) <= 1)
+		return 0; // already contiguous
+	uint16_t *chain = (uint16_t*)malloc(2 * blocks_num * sizeof(uint16_t));
+	if (chain == NULL)
+		return -1;
+	uint16_t *moved = chain + blocks_num; // new block of each position, 0xFFFF if it stays
+	uint16_t data_index = entry->first_data_index;
+	for (int i = 0; i < blocks_num; i++, data_index = fat.arr[data_index]) {
+		chain[i] = data_index;
+		if (refcnt_get(data_index) != 1) {
+			free(chain);
+			return 0; // shared with a clone or a snapshot, whose links we cannot update
+		}
+	}
+	int start = defrag_target(chain, blocks_num);
+	if (start == -1) {
+		free(chain);
+		return 0; // no free range large enough
+	}
+
+	// copy: claim the target blocks, linked to the same successor as the
+	// block they replace, so both copies are valid
+	uint8_t block[BLOCK_SIZE];
+	int moves = 0;
+	for (int i = 0; i < blocks_num; i++) {
+		moved[i] = 0xFFFF;
+		if (chain[i] == start + i || moves == budget)
+			continue;
+		if (csum_read(chain[i] + super.data_start, block) == -1 ||
+		    csum_write(start + i + super.data_start, block) == -1)
+			break;
+		moved[i] = start + i;
+		fat_set(moved[i], fat.arr[chain[i]]);
+		refcnt_add(moved[i], 1, 1);
+		moves++;
+	}
+	if (moves == 0 || meta_update() == -1) {
+		free(chain);
+		return -1;
+	}
+	// relink: point the predecessor of each moved block to its copy
+	for (int i = 0; i < blocks_num; i++) {
+		if (moved[i] == 0xFFFF)
+			continue;
+		if (i == 0) {
+			entry->first_data_index = moved[i];
+			rootdir_dirty = 1;
+		} else {
+			fat_set(moved[i - 1] != 0xFFFF ? moved[i - 1] : chain[i - 1], moved[i]);
+		}
+	}
+	files_table.open_file[entry_index].cursor_index = 0xFFFF;
+	if (meta_update() == -1) {
+		free(chain);
+		return -1;
+	}
+	// free: nothing refers to the old blocks anymore
+	for (int i = 0; i < blocks_num; i++) {
+		if (moved[i] == 0xFFFF)
+			continue;
+		refcnt_add(chain[i], -1, -1);
+		fat_set(chain[i], 0);
+	}
+	free(chain);
+	if (meta_update() == -1)
+		return -1;
+	return moves;
+}
+
+static int defrag(int budget)
+{
+	if (fat.arr == NULL || budget <= 0 || delalloc_flush_all() == -1)
+		return -1;
+	int moved = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT && moved < budget; i++) {
+		// metadata files are looked up by block position, leave them be
+		if (rootdir.entry[i].filename[0] == '\0' || rootdir.entry[i].filename[0] == FS_META_PREFIX)
+			continue;
+		if (files_table.open_file[i].maps > 0)
+			continue; // mapped, its blocks must stay in place
+		int ret = defrag_file(i, budget - moved);
+		if (ret == -1)
+			return moved ? moved : -1;
+		moved += ret;
+	}
+	return moved;
+}
+
+int fs_defrag(int budget)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = defrag(budget);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+// Chains are checked by several threads from this many data blocks on
+#define CHECK_PARALLEL_MIN 16384
+#define CHECK_THREADS_MAX 8
+
+// What ended the walk of a chain
+#define CHAIN_OK 0
+#define CHAIN_BAD_INDEX 1 // link to block 0, to a free block or out of the FAT
+#define CHAIN_CYCLE 2 // link back to a block of the same chain
+
+// One chain to walk: a live file, or a file frozen in a snapshot
+struct CheckJob {
+	const struct Entry *entry;
+	const uint16_t *links; // the FAT, or the copy frozen in the snapshot
+	uint16_t *holders; // per block count the walk adds to
+	int blocks_num; // number of valid blocks found
+	uint16_t last_index; // last valid block, 0xFFFF if none
+	int error; // CHAIN_*
+};
+
+struct CheckState {
+	struct CheckJob *jobs;
+	int jobs_num;
+	int next_job; // next job to take, shared by the threads
+	int next_range; // next FAT block to scan, shared by the threads
+	uint16_t *live; // number of live files holding each block
+	uint16_t *held; // number of snapshots holding each block
+	int crossed; // a block is held twice without a reference count table
+	int leaked; // blocks in use that nothing holds
+	uint8_t *leaks; // which ones, freed once the threads are done
+	int bad_refcnt; // reference counts that disagree with the holders
+	int repair;
+};
+
+static void check_walk(struct CheckState *state, struct CheckJob *job, uint32_t *stamp, uint32_t job_stamp)
+{
+	// walk one chain in O(length): @stamp tells the blocks this job already saw
+	uint16_t data_index = job->entry->first_data_index;
+	job->blocks_num = 0;
+	job->last_index = 0xFFFF;
+	job->error = CHAIN_OK;
+	while (data_index != 0xFFFF) {
+		if (data_index == 0 || data_index >= super.data_blocks_num || fat.arr[data_index] == 0) {
+			job->error = CHAIN_BAD_INDEX;
+			return;
+		}
+		if (stamp[data_index] == job_stamp) {
+			job->error = CHAIN_CYCLE;
+			return;
+		}
+		stamp[data_index] = job_stamp;
+		// without a reference count table, no block may have two holders
+		if (__atomic_fetch_add(&job->holders[data_index], 1, __ATOMIC_RELAXED) > 0 &&
+		    job->holders == state->live && refcnt.arr == NULL)
+			__atomic_store_n(&state->crossed, 1, __ATOMIC_RELAXED);
+		job->blocks_num++;
+		job->last_index = data_index;
+		data_index = job->links[data_index];
+	}
+}
+
+static void check_range(struct CheckState *state, int fat_blk)
+{
+	// compare the holders of the blocks mapped by one FAT block with the FAT
+	// and the reference counts. Each FAT block (and reference count block,
+	// they map as many entries) is handled by one thread only.
+	int leaked = 0, bad_refcnt = 0;
+	size_t end = (fat_blk + 1) * FAT_ENTRIES_PER_BLOCK;
+	if (end > super.data_blocks_num)
+		end = super.data_blocks_num;
+	for (size_t i = fat_blk * FAT_ENTRIES_PER_BLOCK; i < end; i++) {
+		if (i == 0)
+			continue; // reserved
+		uint16_t holders = state->live[i] + state->held[i];
+		if (fat.arr[i] != 0 && holders == 0) {
+			leaked++;
+			state->leaks[i] = 1;
+		}
+		if (refcnt.arr == NULL)
+			continue;
+		if (refcnt.arr[i] != holders) {
+			bad_refcnt++;
+			if (state->repair) {
+				refcnt.arr[i] = holders;
+				refcnt.dirty[i / REFCNT_ENTRIES_PER_BLOCK] = 1;
+			}
+		}
+		if (state->repair)
+			refcnt.live[i] = state->live[i];
+	}
+	__atomic_fetch_add(&state->leaked, leaked, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&state->bad_refcnt, bad_refcnt, __ATOMIC_RELAXED);
+}
+
+static void *check_worker(void *arg)
+{
+	// take chains to walk until there are none left
+	struct CheckState *state = arg;
+	uint32_t *stamp = (uint32_t*)calloc(super.data_blocks_num, sizeof(uint32_t));
+	if (stamp == NULL)
+		return (void*)-1;
+	int job;
+	while ((job = __atomic_fetch_add(&state->next_job, 1, __ATOMIC_RELAXED)) < state->jobs_num)
+		check_walk(state, &state->jobs[job], stamp, job + 1);
+	free(stamp);
+	return NULL;
+}
+
+static void *check_scan_worker(void *arg)
+{
+	// take FAT blocks to scan until there are none left
+	struct CheckState *state = arg;
+	int fat_blk;
+	while ((fat_blk = __atomic_fetch_add(&state->next_range, 1, __ATOMIC_RELAXED)) < super.fat_blocks_num)
+		check_range(state, fat_blk);
+	return NULL;
+}
+
+static int check_run(struct CheckState *state, void *(*worker)(void *))
+{
+	// run @worker on the calling thread, helped by a few more on large FATs
+	pthread_t threads[CHECK_THREADS_MAX];
+	int threads_num = 0;
+	if (super.data_blocks_num >= CHECK_PARALLEL_MIN) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for (; threads_num < CHECK_THREADS_MAX - 1 && threads_num < cpus - 1; threads_num++) {
+			if (pthread_create(&threads[threads_num], NULL, worker, state) != 0)
+				break;
+		}
+	}
+	int ret = worker(state) == NULL ? 0 : -1;
+	for (int i = 0; i < threads_num; i++) {
+		void *thread_ret;
+		pthread_join(threads[i], &thread_ret);
+		if (thread_ret != NULL)
+			ret = -1;
+	}
+	return ret;
+}
+
+static int check_chains(struct CheckState *state)
+{
+	// (re)count the holders of every block
+	memset(state->live, 0, super.data_blocks_num * sizeof(uint16_t));
+	memset(state->held, 0, super.data_blocks_num * sizeof(uint16_t));
+	state->next_job = 0;
+	state->crossed = 0;
+	return check_run(state, check_worker);
+}
+
+static int entry_blocks_expected(const struct Entry *entry)
+{
+	// number of blocks the chain of @entry must have
+	size_t len = entry->size_file;
+	if (entry->flags & ENTRY_COMPRESSED)
+		len = entry->stream_len + (len + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE * sizeof(uint32_t);
+	else if (entry->flags & ENTRY_TAIL)
+		len -= len % BLOCK_SIZE;
+	return (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static void check_truncate(int entry_index, int blocks_num)
+{
+	// cut the chain of a live file after @blocks_num blocks, the blocks left
+	// behind are then freed as leaks
+	struct Entry *entry = &rootdir.entry[entry_index];
+	if (blocks_num == 0) {
+		entry->first_data_index = 0xFFFF;
+		rootdir_dirty = 1;
+	} else {
+		fat_set(meta_file_block(entry_index, blocks_num - 1), 0xFFFF);
+	}
+	files_table.open_file[entry_index].cursor_index = 0xFFFF;
+}
+
+static int check_entry(struct CheckState *state, int entry_index, struct CheckJob *job, uint8_t (*units)[FRAG_UNITS_PER_BLOCK / 8])
+{
+	// check one live file against its chain, return the number of problems
+	struct Entry *entry = &rootdir.entry[entry_index];
+	const char *name = (const char*)entry->filename;
+	int is_meta = name[0] == FS_META_PREFIX;
+	int problems = 0;
+	int blocks_num = job->blocks_num;
+
+	if (job->error != CHAIN_OK) {
+		printf("file '%.*s': %s after %d blocks\n", FS_FILENAME_LEN, name,
+		       job->error == CHAIN_CYCLE ? "cycle" : "bad block index", blocks_num);
+		problems++;
+		if (state->repair && !is_meta)
+			check_truncate(entry_index, blocks_num);
+	}
+	if (entry->flags & ENTRY_TAIL) {
+		// the tail must lie in a fragment block, over units of its own
+		size_t tail_len = entry->size_file % BLOCK_SIZE;
+		int blk = 0;
+		while (blk < frag.blocks_num && frag.index[blk] != entry->tail_index)
+			blk++;
+		int bad = blk == frag.blocks_num || tail_len == 0 ||
+			  entry->tail_offset % FRAG_UNIT != 0 || entry->tail_offset + tail_len > BLOCK_SIZE;
+		for (size_t unit = entry->tail_offset / FRAG_UNIT; !bad && unit * FRAG_UNIT < entry->tail_offset + tail_len; unit++) {
+			bad = units[blk][unit / 8] & (1 << (unit % 8));
+			units[blk][unit / 8] |= 1 << (unit % 8);
+		}
+		if (bad) {
+			printf("file '%.*s': bad packed tail\n", FS_FILENAME_LEN, name);
+			problems++;
+			if (state->repair) {
+				// drop it, what is left of the file is its chain
+				entry->size_file -= tail_len;
+				entry->flags &= ~ENTRY_TAIL;
+				entry->tail_index = 0;
+				entry->tail_offset = 0;
+				rootdir_dirty = 1;
+			}
+		}
+	}
+	int expected = entry_blocks_expected(entry);
+	if (blocks_num != expected) {
+		printf("file '%.*s': size %u needs %d blocks, chain has %d\n", FS_FILENAME_LEN, name,
+		       entry->size_file, expected, blocks_num);
+		problems++;
+		if (state->repair && !is_meta && !(entry->flags & ENTRY_COMPRESSED)) {
+			if (blocks_num > expected) {
+				check_truncate(entry_index, expected); // free the extra blocks
+			} else {
+				// the data is lost, only keep the size the chain covers
+				entry->size_file = blocks_num * BLOCK_SIZE;
+				entry->flags &= ~ENTRY_TAIL;
+				rootdir_dirty = 1;
+			}
+		}
+	}
+	return problems;
+}
+
+static int check_crossed(struct CheckState *state)
+{
+	// without reference counts, a block in two chains is a cross-link. The
+	// chain reaching it first keeps it: a chain joining another one through a
+	// bad link reaches the shared blocks late. The other chains are cut
+	// before it.
+	int problems = 0;
+	uint32_t *keeper = (uint32_t*)malloc(super.data_blocks_num * sizeof(uint32_t));
+	if (keeper == NULL)
+		return -1;
+	memset(keeper, 0xFF, super.data_blocks_num * sizeof(uint32_t));
+	// live jobs come first, so job numbers fit in 8 bits
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < state->jobs_num && state->jobs[i].links == fat.arr; i++) {
+			struct CheckJob *job = &state->jobs[i];
+			uint16_t data_index = job->entry->first_data_index;
+			// chains cut by earlier repairs end before job->blocks_num
+			for (int blk = 0; blk < job->blocks_num && data_index != 0xFFFF; blk++, data_index = fat.arr[data_index]) {
+				uint32_t key = (uint32_t)blk << 8 | i;
+				if (pass == 0) {
+					if (key < keeper[data_index])
+						keeper[data_index] = key;
+					continue;
+				}
+				if (keeper[data_index] == key)
+					continue;
+				const char *name = (const char*)job->entry->filename;
+				printf("file '%.*s': cross-linked after %d blocks\n", FS_FILENAME_LEN, name, blk);
+				problems++;
+				if (state->repair && name[0] != FS_META_PREFIX)
+					check_truncate(job->entry - rootdir.entry, blk);
+				break;
+			}
+		}
+	}
+	free(keeper);
+	return problems;
+}
+
+static int check(int repair)
+{
+	if (fat.arr == NULL || (repair && (files_table.num_open > 0 || mappings != NULL)))
+		return -1; // not mounted, or files would change under open descriptors or mappings
+	if (delalloc_flush_all() == -1)
+		return -1; // buffered data has no blocks yet, the counts would not add up
+	struct CheckState state = { .repair = repair };
+	struct RootDirectory *snap_copies = NULL;
+	uint16_t *snap_links = NULL;
+	uint8_t (*units)[FRAG_UNITS_PER_BLOCK / 8] = NULL;
+	int snapshots_num = 0, problems = 0, ret = -1;
+	int snapshots_broken = 0; // some blocks held by snapshots may not be counted
+
+	printf("FS Check:\n");
+	// load the snapshots up front, block I/O is not shared with the threads
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		snapshots_num += strncmp((char*)rootdir.entry[i].filename, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) == 0;
+	snap_copies = (struct RootDirectory*)malloc((snapshots_num + 1) * sizeof(struct RootDirectory));
+	snap_links = (uint16_t*)malloc((snapshots_num + 1) * super.fat_blocks_num * BLOCK_SIZE);
+	state.jobs = (struct CheckJob*)malloc((snapshots_num + 1) * FS_FILE_MAX_COUNT * sizeof(struct CheckJob));
+	state.live = (uint16_t*)malloc(super.data_blocks_num * sizeof(uint16_t));
+	state.held = (uint16_t*)malloc(super.data_blocks_num * sizeof(uint16_t));
+	state.leaks = (uint8_t*)calloc(super.data_blocks_num, 1);
+	units = calloc(frag.blocks_num + 1, sizeof(*units));
+	if (snap_copies == NULL || snap_links == NULL || state.jobs == NULL ||
+	    state.live == NULL || state.held == NULL || state.leaks == NULL || units == NULL)
+		goto out;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir.entry[i].filename[0] == '\0')
+			continue;
+		state.jobs[state.jobs_num++] = (struct CheckJob){ &rootdir.entry[i], fat.arr, state.live };
+	}
+	for (int i = 0, snap = 0; i < FS_FILE_MAX_COUNT; i++) {
+		const char *name = (const char*)rootdir.entry[i].filename;
+		if (strncmp(name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) != 0)
+			continue;
+		struct RootDirectory *copy = &snap_copies[snap];
+		uint16_t *links = snap_links + snap * super.fat_blocks_num * FAT_ENTRIES_PER_BLOCK;
+		if (snapshot_load(name + strlen(SNAPSHOT_PREFIX), copy, links) == -1) {
+			printf("snapshot '%s': cannot be read\n", name + strlen(SNAPSHOT_PREFIX));
+			problems++;
+			snapshots_broken = 1;
+			continue;
+		}
+		snap++;
+		for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
+			if (copy->entry[j].filename[0] != '\0')
+				state.jobs[state.jobs_num++] = (struct CheckJob){ &copy->entry[j], links, state.held };
+		}
+	}
+
+	// walk every chain, untangle cross-links, then check each live file
+	// against its own chain
+	if (check_chains(&state) == -1)
+		goto out;
+	if (state.crossed) {
+		int crossed = check_crossed(&state);
+		if (crossed == -1)
+			goto out;
+		problems += crossed;
+		if (repair && crossed > 0 && check_chains(&state) == -1)
+			goto out;
+	}
+	for (int i = 0; i < state.jobs_num; i++) {
+		struct CheckJob *job = &state.jobs[i];
+		if (job->links == fat.arr) {
+			problems += check_entry(&state, job->entry - rootdir.entry, job, units);
+		} else if (job->error != CHAIN_OK) {
+			printf("snapshot file '%.*s': broken chain\n", FS_FILENAME_LEN, (const char*)job->entry->filename);
+			problems++;
+			snapshots_broken = 1;
+		}
+	}
+	// repairs cut chains: count again before looking for leaks
+	if (repair && problems > 0 && check_chains(&state) == -1)
+		goto out;
+
+	// then every block of the FAT, against the holders found. Do not free
+	// anything if the holders of some blocks could not all be counted.
+	state.repair = repair && !snapshots_broken;
+	state.next_range = 0;
+	if (check_run(&state, check_scan_worker) == -1)
+		goto out;
+	// fat_set() is not thread safe, so the leaks are freed once they are done
+	for (int i = 1; state.repair && i < super.data_blocks_num; i++) {
+		if (state.leaks[i])
+			fat_set(i, 0);
+	}
+	if (state.leaked) {
+		printf("leaked_blocks=%d\n", state.leaked);
+		problems += state.leaked;
+	}
+	if (state.bad_refcnt) {
+		printf("bad_refcnt=%d\n", state.bad_refcnt);
+		problems += state.bad_refcnt;
+	}
+	ret = problems;
+	if (repair && problems > 0) {
+		// the tails dropped gave their units back
+		for (int i = 0; i < frag.blocks_num; i++)
+			memset(frag.used[i], 0, sizeof(*frag.used));
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			struct Entry *entry = &rootdir.entry[i];
+			if (entry->filename[0] != '\0' && (entry->flags & ENTRY_TAIL))
+				frag_mark(entry->tail_index, entry->tail_offset, entry->size_file % BLOCK_SIZE, 1);
+		}
+		if (meta_update() == -1)
+			ret = -1;
+	}
+out:
+	free(snap_copies);
+	free(snap_links);
+	free(state.jobs);
+	free(state.live);
+	free(state.held);
+	free(state.leaks);
+	free(units);
+	return ret;
+}
+
+int fs_check(int repair)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = check(repair);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_ls(void)
+{
+	delalloc_flush_all(); // sizes and first blocks as they will be on disk
+	printf("FS Ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
+		if (rootdir.entry[i].filename[0] != '\0' && rootdir.entry[i].filename[0] != FS_META_PREFIX) {
+			// if the file entry isn't null (or hidden metadata), we access the struct
+			struct Entry cur = rootdir.entry[i];
+			printf("file: %s, size: %i, data_blk: %i\n", (char*)cur.filename, cur.size_file, cur.first_data_index);
+		}
+	}
+	return 0;
+}
+
+// Snapshot of the root directory taken by fs_opendir()
+struct fs_dir {
+	struct fs_dirent entry[FS_FILE_MAX_COUNT];
+	int entries_num;
+	int next; // next entry fs_readdir() returns
+};
+
+static int dirent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct fs_dirent*)a)->name, ((const struct fs_dirent*)b)->name);
+}
+
+struct fs_dir *fs_opendir(const char *prefix, int flags)
+{
+	if (fat.arr == NULL || (flags & ~FS_DIR_SORTED))
+		return NULL; // not mounted, or unknown flags
+	struct fs_dir *dir = (struct fs_dir*)malloc(sizeof(struct fs_dir));
+	if (dir == NULL)
+		return NULL;
+	size_t prefix_len = prefix == NULL ? 0 : strlen(prefix);
+	dir->entries_num = 0;
+	dir->next = 0;
+	pthread_mutex_lock(&fs_lock);
+	delalloc_flush_all(); // sizes and first blocks as they will be on disk
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct Entry *entry = &rootdir.entry[i];
+		if (entry->filename[0] == '\0' || entry->filename[0] == FS_META_PREFIX ||
+		    strncmp((char*)entry->filename, prefix == NULL ? "" : prefix, prefix_len) != 0)
+			continue;
+		struct fs_dirent *dirent = &dir->entry[dir->entries_num++];
+		memcpy(dirent->name, entry->filename, FS_FILENAME_LEN);
+		dirent->name[FS_FILENAME_LEN - 1] = '\0';
+		dirent->size = entry->size_file;
+		dirent->data_blk = entry->first_data_index;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if (flags & FS_DIR_SORTED)
+		qsort(dir->entry, dir->entries_num, sizeof(struct fs_dirent), dirent_cmp);
+	return dir;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entries, int count)
+{
+	if (dir == NULL || entries == NULL || count < 0)
+		return -1;
+	if (count > dir->entries_num - dir->next)
+		count = dir->entries_num - dir->next;
+	memcpy(entries, &dir->entry[dir->next], count * sizeof(struct fs_dirent));
+	dir->next += count;
+	return count;
+}
+
+int fs_closedir(struct fs_dir *dir)
+{
+	if (dir == NULL)
+		return -1;
+	free(dir);
+	return 0;
+}
+
+uint16_t data_ind(size_t offset, uint16_t file_start) {
+	//return index of data block according to the offset
+	// file_start is the starting fat index
+	// offset is the file current offset
+	int count_offset = BLOCK_SIZE - 1; //initial boundary is the end of the file
+	uint16_t data_index = file_start;
+	while (data_index != 0xFFFF && count_offset < offset) {
+		// while the data_index doesn't reach to the end of the file
+		// AND meanwhile we haven't reached the offset position
+		if (fat.arr[data_index] == 0xFFFF)
+			return data_index; //return index cannot be 0xFFFF
+		data_index = fat.arr[data_index]; // update data_index through block chain
+		count_offset += BLOCK_SIZE; // increment counts
+	}
+	return data_index ; //return data index + offset
+}
+
+static uint16_t cursor_data_ind(struct OpenFile *of, size_t offset, uint16_t file_start)
+{
+	// same as data_ind(), but resumes the chain walk from the file's cached
+	// cursor so sequential access does not restart from the first block
+	size_t target_blk = offset / BLOCK_SIZE;
+	size_t blk = 0;
+	uint16_t data_index = file_start;
+	if (data_index == 0xFFFF)
+		return data_index;
+	if (of->cursor_index != 0xFFFF && of->cursor_blk <= target_blk) {
+		blk = of->cursor_blk;
+		data_index = of->cursor_index;
+	}
+	while (blk < target_blk && fat.arr[data_index] != 0xFFFF) {
+		data_index = fat.arr[data_index]; // update data_index through block chain
+		blk++;
+	}
+	of->cursor_blk = blk;
+	of->cursor_index = data_index;
+	return data_index;
+}
+
+// Position in an array of iovecs, consumed as data is copied in or out
+struct IovCursor {
+	const struct iovec *iov;
+	int iovcnt;
+	int index; // current iovec
+	size_t offset; // offset in the current iovec
+};
+
+static void iov_copy(struct IovCursor *cur, uint8_t *data, size_t len, int to_iov)
+{
+	// copy @len bytes between @data and the iovecs, from the cursor on
+	while (len > 0 && cur->index < cur->iovcnt) {
+		const struct iovec *iov = &cur->iov[cur->index];
+		size_t n = iov->iov_len - cur->offset;
+		if (n > len)
+			n = len;
+		if (to_iov)
+			memcpy((uint8_t*)iov->iov_base + cur->offset, data, n);
+		else
+			memcpy(data, (const uint8_t*)iov->iov_base + cur->offset, n);
+		data += n;
+		len -= n;
+		cur->offset += n;
+		if (cur->offset == iov->iov_len) {
+			cur->index++;
+			cur->offset = 0;
+		}
+	}
+}
+
+static size_t chain_readv(struct OpenFile *of, size_t offset, struct IovCursor *cur, size_t count)
+{
+	// read @count raw bytes of the file's chain from @offset into the iovecs,
+	// a batch of blocks at a time: each block is read once, whatever the
+	// number of iovecs it spans. Return the number of bytes read, short if
+	// the chain ends first.
+	uint16_t file_start = rootdir.entry[of->entry_index].first_data_index;
+	size_t blocks[CHAIN_BATCH];
+	size_t batch_max = 1;
+	uint8_t *buf = NULL;
+	size_t done = 0;
+	if (offset % BLOCK_SIZE + count > BLOCK_SIZE && (buf = block_batch_get()) != NULL)
+		batch_max = CHAIN_BATCH;
+	else if ((buf = block_get()) == NULL)
+		return 0;
+	while (done < count) {
+		uint16_t data_index = cursor_data_ind(of, offset, file_start);
+		if (data_index == 0xFFFF || of->cursor_blk != offset / BLOCK_SIZE)
+			break; // past the end of the chain
+		// follow the chain as far as the request goes, the cursor ends on
+		// the last block of the batch
+		size_t want = (offset % BLOCK_SIZE + count - done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t num = 0;
+		for (;;) {
+			blocks[num++] = data_index + super.data_start;
+			if (num == batch_max || num == want || fat.arr[data_index] == 0xFFFF)
+				break;
+			data_index = fat.arr[data_index];
+			of->cursor_blk++;
+			of->cursor_index = data_index;
+		}
+		if (csum_read_many(blocks, num, buf) == -1)
+			break;
+		for (size_t i = 0; i < num; i++) {
+			size_t block_offset = offset % BLOCK_SIZE;
+			size_t len = BLOCK_SIZE - block_offset;
+			if (len > count - done)
+				len = count - done;
+			iov_copy(cur, buf + i * BLOCK_SIZE + block_offset, len, 1);
+			done += len;
+			offset += len;
+		}
+	}
+	if (batch_max > 1)
+		block_batch_put();
+	else
+		block_put(buf);
+	return done;
+}
+
+static size_t chain_read(struct OpenFile *of, size_t offset, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	struct IovCursor cur = { &iov, 1 };
+	return chain_readv(of, offset, &cur, count);
+}
+
+static size_t chain_writev(struct OpenFile *of, size_t offset, struct IovCursor *cur, size_t count)
+{
+	// write @count raw bytes from the iovecs into the file's chain at
+	// @offset, extending the chain as needed (@offset cannot be past its end).
+	// Shared blocks are copied first. Return the number of bytes written,
+	// short if the disk is full.
+	// In dedup mode, blocks whose content does not change are left alone,
+	// shared ones included, and full blocks appended are looked up in the
+	// index: the chain then only gets unshared once a block changes.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	int dedup_on = dedup.enabled && !(entry->flags & ENTRY_COMPRESSED) &&
+		       entry->filename[0] != FS_META_PREFIX && of->maps_writable == 0;
+	int unshared = refcnt.arr == NULL;
+	size_t last_blk = (offset + count - 1) / BLOCK_SIZE;
+	size_t done = 0;
+	if (count == 0)
+		return 0;
+	if (!unshared && !dedup_on) {
+		if (chain_unshare(of, offset / BLOCK_SIZE, last_blk) == -1)
+			return 0;
+		unshared = 1;
+	}
+	uint8_t *block = block_get();
+	uint8_t *other = dedup_on ? block_get() : NULL; // what a block held before
+	if (block == NULL || (dedup_on && other == NULL))
+		goto out;
+	while (done < count) {
+		size_t blk = offset / BLOCK_SIZE;
+		size_t block_offset = offset % BLOCK_SIZE;
+		size_t len = BLOCK_SIZE - block_offset;
+		if (len > count - done)
+			len = count - done;
+		uint16_t data_index = cursor_data_ind(of, offset, entry->first_data_index);
+		int exists = data_index != 0xFFFF && of->cursor_blk == blk;
+		uint64_t hash = 0;
+		int filled = 0; // the new content of the block is in @block
+		if (dedup_on) {
+			if (len == BLOCK_SIZE) {
+				iov_copy(cur, block, BLOCK_SIZE, 0);
+				hash = block_hash(block);
+				filled = 1;
+				dedup.written++;
+			}
+			// an existing block is only rewritten if its content changes
+			if (exists && (len < BLOCK_SIZE || dedup.hash[data_index] == hash)) {
+				if (csum_read(data_index + super.data_start, other) == -1)
+					break;
+				if (!filled) {
+					memcpy(block, other, BLOCK_SIZE);
+					iov_copy(cur, block + block_offset, len, 0);
+					filled = 1;
+				}
+				if (memcmp(block, other, BLOCK_SIZE) == 0) {
+					if (len == BLOCK_SIZE)
+						dedup.avoided++;
+					done += len;
+					offset += len;
+					continue;
+				}
+			}
+			if (!unshared) {
+				// the chain changes from here: copy what it shares
+				if (chain_unshare(of, blk, last_blk) == -1)
+					break;
+				unshared = 1;
+				data_index = cursor_data_ind(of, offset, entry->first_data_index);
+			}
+			if (!exists && len == BLOCK_SIZE &&
+			    (data_index == 0xFFFF || of->cursor_blk + 1 == blk) &&
+			    dedup_link(of, data_index, hash, block, other)) {
+				dedup.avoided++;
+				unshared = refcnt.arr == NULL;
+				done += len;
+				offset += len;
+				continue;
+			}
+		}
+		if (entry->first_data_index == 0xFFFF) {
+			data_index = chain_alloc(of, 0xFFFF);
+			if (data_index == 0xFFFF)
+				break;
+			entry->first_data_index = data_index;
+			rootdir_dirty = 1;
+			of->cursor_blk = 0;
+			of->cursor_index = data_index;
+		}
+		while (of->cursor_blk < blk) {
+			// past the end of the chain: grow it
+			uint16_t next_index = chain_alloc(of, data_index);
+			if (next_index == 0xFFFF)
+				break;
+			fat_set(data_index, next_index);
+			data_index = next_index;
+			of->cursor_blk++;
+			of->cursor_index = data_index;
+		}
+		if (of->cursor_blk < blk)
+			break; // disk full
+		if (!filled) {
+			// partial block: keep the bytes we do not overwrite
+			if (len < BLOCK_SIZE && csum_read(data_index + super.data_start, block) == -1)
+				break;
+			iov_copy(cur, block + block_offset, len, 0);
+		}
+		if (csum_write(data_index + super.data_start, block) == -1)
+			break;
+		if (dedup_on) {
+			if (len == BLOCK_SIZE)
+				dedup_insert(data_index, hash);
+			else
+				dedup.hash[data_index] = 0;
+		}
+		done += len;
+		offset += len;
+	}
+out:
+	if (block != NULL)
+		block_put(block);
+	if (other != NULL)
+		block_put(other);
+	return done;
+}
+
+static size_t chain_write(struct OpenFile *of, size_t offset, const void *buf, size_t count)
+{
+	struct iovec iov = { (void*)buf, count };
+	struct IovCursor cur = { &iov, 1 };
+	return chain_writev(of, offset, &cur, count);
+}
+
+static size_t chain_blocks(uint16_t data_index)
+{
+	size_t blocks = 0;
+	for (; data_index != 0xFFFF; data_index = fat.arr[data_index])
+		blocks++;
+	return blocks;
+}
+
+static void chain_trim(struct OpenFile *of)
+{
+	// cut the chain of a file after the blocks its size needs: in dedup
+	// mode, a file sharing the chain of another one may stop short of its
+	// end. Best effort: the extra blocks are left on any failure.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	int blocks_num = entry_blocks_expected(entry);
+	if (blocks_num == 0 || (entry->flags & ENTRY_COMPRESSED))
+		return;
+	uint16_t last_index = meta_file_block(of->entry_index, blocks_num - 1);
+	if (last_index == 0xFFFF || fat.arr[last_index] == 0xFFFF)
+		return;
+	// the last block gets a new link, it must be private
+	if (chain_unshare(of, blocks_num - 1, blocks_num - 1) == -1)
+		return;
+	last_index = meta_file_block(of->entry_index, blocks_num - 1);
+	uint16_t rest = fat.arr[last_index];
+	fat_set(last_index, 0xFFFF);
+	chain_release(rest, fat.arr, 1);
+	of->cursor_index = 0xFFFF;
+}
+
+static size_t chain_alloc_run(struct OpenFile *of, uint16_t tail, size_t num, uint16_t *run)
+{
+	// claim @num blocks to follow @tail in the chain of @of, into @run: the
+	// ones right after @tail if they are all free, else the first run of
+	// @num free blocks from the file's group on, else one at a time as
+	// chain_alloc() picks them. Return the number of blocks claimed.
+	size_t start = 0, len = 0;
+	if (next_block_ok(of, tail) && tail + num < super.data_blocks_num) {
+		for (len = 1; len < num && fat.arr[tail + 1 + len] == 0; len++)
+			;
+		start = tail + 1;
+	}
+	if (len < num) {
+		if (of->group == -1)
+			group_pick(of, tail);
+		size_t first = of->group == -1 ? 1 : (size_t)of->group * alloc.group_blocks;
+		len = 0;
+		for (size_t k = 0; k < super.data_blocks_num && len < num; k++) {
+			size_t i = (first + k) % super.data_blocks_num;
+			if (i == 0 || fat.arr[i] != 0)
+				len = 0; // block 0 is never handed out, and runs do not wrap
+			else if (len++ == 0)
+				start = i;
+		}
+	}
+	size_t claimed = 0;
+	for (; claimed < num; claimed++) {
+		if (len == num)
+			run[claimed] = block_claim(start + claimed);
+		else
+			run[claimed] = chain_alloc(of, claimed ? run[claimed - 1] : tail);
+		if (run[claimed] == 0xFFFF)
+			break;
+	}
+	return claimed;
+}
+
+static int delay_flush(struct OpenFile *of)
+{
+	// give the data buffered for @of its blocks, as one run if possible,
+	// and write them at once. Return -1 on failure, the data stays buffered.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t blocks_num = entry->size_file / BLOCK_SIZE;
+	size_t num = (of->delay_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint16_t run[DELALLOC_BLOCKS];
+	size_t blocks[DELALLOC_BLOCKS];
+	if (of->delay_len == 0)
+		return 0;
+	// the reserved blocks are claimed for good below
+	delalloc.reserved -= num;
+	chain_trim(of);
+	uint16_t tail = 0xFFFF;
+	if (blocks_num > 0) {
+		// the last block gets a new link, it must be private
+		if (refcnt.arr != NULL && chain_unshare(of, blocks_num, blocks_num - 1) == -1)
+			goto fail;
+		tail = meta_file_block(of->entry_index, blocks_num - 1);
+	} else if (entry->first_data_index != 0xFFFF) {
+		chain_release(entry->first_data_index, fat.arr, 1); // nothing of it is in use
+		entry->first_data_index = 0xFFFF;
+		rootdir_dirty = 1;
+	}
+	size_t claimed = chain_alloc_run(of, tail, num, run);
+	for (size_t i = 0; i < claimed; i++)
+		blocks[i] = run[i] + super.data_start;
+	memset(of->delay + of->delay_len, 0, num * BLOCK_SIZE - of->delay_len);
+	if (claimed < num || csum_write_many(blocks, num, of->delay) == -1) {
+		for (size_t i = 0; i < claimed; i++)
+			chain_release(run[i], fat.arr, 1);
+		goto fail;
+	}
+	for (size_t i = 0; i < num; i++) {
+		if (tail == 0xFFFF) {
+			entry->first_data_index = run[i];
+			rootdir_dirty = 1;
+		} else {
+			fat_set(tail, run[i]);
+		}
+		tail = run[i];
+	}
+	entry->size_file += of->delay_len;
+	rootdir_dirty = 1;
+	of->delay_len = 0;
+	of->cursor_index = 0xFFFF;
+	return 0;
+
+fail:
+	delalloc.reserved += num;
+	return -1;
+}
+
+static void delay_release(struct OpenFile *of)
+{
+	// give the buffer of @of back to the pool, what it still holds is lost
+	if (of->delay == NULL)
+		return;
+	delalloc.reserved -= (of->delay_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	of->delay_len = 0;
+	delalloc.free[delalloc.free_num++] = of->delay;
+	of->delay = NULL;
+}
+
+static int delalloc_flush_all(void)
+{
+	// flush the data buffered for every file
+	int ret = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (delay_flush(&files_table.open_file[i]) == -1)
+			ret = -1;
+	}
+	return ret;
+}
+
+static int delay_ok(struct OpenFile *of)
+{
+	// whether data appended to @of can be buffered, with a buffer for it
+	if (!delalloc.enabled || dedup.enabled || of->maps > 0 ||
+	    (rootdir.entry[of->entry_index].flags & ENTRY_COMPRESSED))
+		return 0;
+	if (of->delay == NULL) {
+		if (delalloc.free_num == 0)
+			return 0; // every buffer is taken
+		of->delay = delalloc.free[--delalloc.free_num];
+	}
+	return 1;
+}
 
-	// The FAT has array attribute which consists of num_data_blocks two bytes long data block indexes
-	fat.arr = (uint16_t*)malloc(super.data_blocks_num * sizeof(uint16_t));
-	// FAT start at block index # 1
-	size_t i = 1;
-	// Mapping the reading block to FAT : we use bounce buffer 
-	void *buffer = (void*)malloc(BLOCK_SIZE);
-	for (; i < super.root_index; i++) {
-		// for each (i-1)th fat block, loads
-		// fat block offset starts at 1 instead of 0, so mapping is i-1
-		if (block_read(i, buffer) == -1)
-			return -1;
-		memcpy(fat.arr + (i-1)*BLOCK_SIZE, buffer, BLOCK_SIZE);
+static size_t delay_write(struct OpenFile *of, struct IovCursor *cur, size_t pos, size_t count)
+{
+	// buffer @count bytes from the iovecs at @pos past the end of the
+	// file's chain, reserving the blocks they need, and flush the buffer
+	// whenever it fills up. Return the number of bytes buffered, short if
+	// the disk is full.
+	size_t done = 0;
+	while (done < count) {
+		size_t len = DELALLOC_BLOCKS * BLOCK_SIZE - pos;
+		if (len > count - done)
+			len = count - done;
+		// the blocks reserved so far, and as many more as are free
+		size_t held = (of->delay_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t room = (held + alloc_free_num() - delalloc.reserved) * BLOCK_SIZE;
+		if (room < pos + len)
+			len = room > pos ? room - pos : 0;
+		if (len == 0)
+			break; // disk full
+		iov_copy(cur, of->delay + pos, len, 0);
+		done += len;
+		pos += len;
+		if (pos > of->delay_len) {
+			delalloc.reserved += (pos + BLOCK_SIZE - 1) / BLOCK_SIZE - held;
+			of->delay_len = pos;
+		}
+		if (pos == DELALLOC_BLOCKS * BLOCK_SIZE) {
+			if (delay_flush(of) == -1)
+				break;
+			pos = 0;
+		}
 	}
-	// The first entry of the FAT (entry #0) is always invalid is 0xFFFF
-	if (fat.arr[0] != 0xFFFF)
-		return -1; 
+	return done;
+}
 
-	// load the root dir infos
-	if (block_read(super.root_index, &rootdir) == -1)
+static int zmap_reserve(struct OpenFile *of, size_t num)
+{
+	// make room for @num chunk offsets
+	if (num <= of->zmap_cap)
+		return 0;
+	size_t cap = of->zmap_cap ? of->zmap_cap : 16;
+	while (cap < num)
+		cap *= 2;
+	uint32_t *zmap = realloc(of->zmap, cap * sizeof(uint32_t));
+	if (zmap == NULL)
 		return -1;
-
+	of->zmap = zmap;
+	of->zmap_cap = cap;
 	return 0;
 }
 
-int fs_umount(void)
+static int zfile_open(struct OpenFile *of)
 {
-	if (block_write(0,&super)==-1){
+	// load the chunk map of a compressed file
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t num = (entry->size_file + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+	of->zchunk = (uint8_t*)malloc(ZCHUNK_SIZE);
+	of->zchunk_no = -1;
+	if (of->zchunk == NULL || zmap_reserve(of, num) == -1)
 		return -1;
-	}
-	size_t i = 1;
-	for (; i < super.root_index; i++) {
-		// for each fat block, writes the block into
-		// fat block offset starts at 1 instead of 0, so mapping is i-1
-		if (block_write(i, fat.arr + (i-1) * BLOCK_SIZE) == -1){
-			return -1;
-		}
-	}
-	if (block_write(super.root_index, &rootdir) == -1){
+	if (chain_read(of, entry->stream_len, of->zmap, num * sizeof(uint32_t)) != num * sizeof(uint32_t))
 		return -1;
-	}
-	return block_disk_close();
+	return 0;
 }
 
-int fs_info(void)
+static void zfile_close(struct OpenFile *of)
 {
-	printf("FS Info:\n");
-	printf("total_blk_count=%i\n",super.total_blocks_num);
-	printf("fat_blk_count=%i\n",super.fat_blocks_num);
-	printf("rdir_blk=%i\n",super.root_index);
-	printf("data_blk=%i\n",super.data_start);
-	printf("data_blk_count=%i\n",super.data_blocks_num);
+	free(of->zmap);
+	free(of->zchunk);
+	of->zmap = NULL;
+	of->zmap_cap = 0;
+	of->zchunk = NULL;
+}
 
-	int num_free_fat = 0;
-	for(int i = 0; i < super.data_blocks_num; i++){
-		if(fat.arr[i] == 0)
-			num_free_fat ++;
+static int zchunk_load(struct OpenFile *of, size_t chunk_no)
+{
+	// decompress chunk @chunk_no into of->zchunk, return its length
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t num = (entry->size_file + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+	size_t raw_len = entry->size_file - chunk_no * ZCHUNK_SIZE;
+	if (raw_len > ZCHUNK_SIZE)
+		raw_len = ZCHUNK_SIZE;
+	if (of->zchunk_no == chunk_no)
+		return raw_len;
+	uint32_t start = of->zmap[chunk_no];
+	uint32_t end = chunk_no + 1 < num ? of->zmap[chunk_no + 1] : entry->stream_len;
+	if (end < start || end - start > ZCHUNK_SIZE)
+		return -1; // corrupted map
+	of->zchunk_no = -1; // overwritten below
+	// chunks that did not shrink are stored as is
+	if (end - start == raw_len) {
+		if (chain_read(of, start, of->zchunk, raw_len) != raw_len)
+			return -1;
+		of->zchunk_no = chunk_no;
+		return raw_len;
 	}
-	printf("fat_free_ratio=%d/%d\n", num_free_fat,super.data_blocks_num);
+	uint8_t *packed = block_get();
+	if (packed == NULL)
+		return -1;
+	int ret = -1;
+	if (chain_read(of, start, packed, end - start) == end - start &&
+	    lz4_decompress(packed, end - start, of->zchunk, raw_len) == raw_len)
+		ret = raw_len;
+	block_put(packed);
+	if (ret == -1)
+		return -1;
+	of->zchunk_no = chunk_no;
+	return raw_len;
+}
 
-	int num_free_root = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if (rootdir.entry[i].filename[0] == '\0')
-			num_free_root++;
+static int zfile_read(struct OpenFile *of, struct IovCursor *cur, size_t count, size_t offset)
+{
+	size_t size = rootdir.entry[of->entry_index].size_file;
+	size_t done = 0;
+	while (done < count && offset < size) {
+		size_t chunk_no = offset / ZCHUNK_SIZE;
+		int raw_len = zchunk_load(of, chunk_no);
+		if (raw_len == -1)
+			return done ? done : -1;
+		size_t chunk_offset = offset % ZCHUNK_SIZE;
+		size_t len = raw_len - chunk_offset;
+		if (len > count - done)
+			len = count - done;
+		iov_copy(cur, of->zchunk + chunk_offset, len, 1);
+		done += len;
+		offset += len;
 	}
-	printf("rdir_free_ratio=%d/%d\n", num_free_root, FS_FILE_MAX_COUNT);
-	return 0;
+	return done;
 }
 
-int fs_create(const char *filename)
+static int zfile_write(struct OpenFile *of, struct IovCursor *cur, size_t count, size_t offset)
 {
-	// Verify that filename to create is valid 
-	if (filename == NULL || strlen(filename) > FS_FILENAME_LEN )
+	// compressed files can only be appended to. The last chunk, if partial,
+	// is decompressed and compressed again with the new data. Chunks are
+	// written over the old map, then the new map follows them.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t size = entry->size_file;
+	if (offset != size)
 		return -1;
-	// NEXT we check first before we create file
-	int file_count = 0;
-	// Searching  through root directory
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdir.entry[i].filename[0] != '\0') {
-			file_count += 1; // if the entry isn't for empty file, file count incremented
-		}
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
-			return -1; // file already exists
-		}
-	}
-	// The root directory already contains FS_FILE_MAX_COUNT files.
-	if (file_count >= FS_FILE_MAX_COUNT)
-		return -1; 
-	//After checking, move forward for creation
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
-		if (rootdir.entry[i].filename[0] == '\0') {
-			memcpy(rootdir.entry[i].filename, filename, FS_FILENAME_LEN); // copy the file name
-			rootdir.entry[i].size_file = 0; // the root dir has size of 0
-			rootdir.entry[i].first_data_index = 0xFFFF;  // the first data starts from 0xFFFF
+	size_t num = (size + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+	size_t fill = size % ZCHUNK_SIZE;
+
+	// never start what the disk cannot hold: assume chunks do not shrink,
+	// and that every block from the old map on may have to be copied
+	size_t chain_len = chain_blocks(entry->first_data_index);
+	size_t avail = (chain_len + fs_free_count()) * BLOCK_SIZE;
+	size_t stream_start = fill ? of->zmap[num - 1] : entry->stream_len;
+	size_t reserve = (chain_len - stream_start / BLOCK_SIZE) * BLOCK_SIZE;
+	while (count > 0) {
+		size_t new_num = (size + count + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE;
+		size_t need = stream_start + fill + count + new_num * sizeof(uint32_t) + BLOCK_SIZE;
+		if (refcnt.arr != NULL)
+			need += reserve;
+		if (need <= avail)
 			break;
+		count = count > ZCHUNK_SIZE ? count - ZCHUNK_SIZE : 0;
+	}
+	if (count == 0)
+		return 0;
+
+	int ret = -1;
+	uint8_t *raw = block_get();
+	uint8_t *packed = block_get();
+	if (raw == NULL || packed == NULL)
+		goto out;
+	if (fill) {
+		// reopen the partial last chunk
+		if (zchunk_load(of, num - 1) != fill)
+			goto out;
+		memcpy(raw, of->zchunk, fill);
+		num--;
+	}
+	if (zmap_reserve(of, (size + count + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE) == -1)
+		goto out;
+	size_t stream_len = stream_start;
+	size_t done = 0;
+	while (done < count) {
+		size_t len = ZCHUNK_SIZE - fill;
+		if (len > count - done)
+			len = count - done;
+		iov_copy(cur, raw + fill, len, 0);
+		fill += len;
+		done += len;
+		if (fill < ZCHUNK_SIZE && done < count)
+			continue;
+		// chunks that do not shrink are stored as is
+		const uint8_t *chunk = packed;
+		int chunk_len = lz4_compress(raw, fill, packed, fill - 1);
+		if (chunk_len == 0) {
+			chunk = raw;
+			chunk_len = fill;
 		}
+		if (chain_write(of, stream_len, chunk, chunk_len) != chunk_len)
+			goto out;
+		of->zmap[num++] = stream_len;
+		stream_len += chunk_len;
+		fill = 0;
 	}
+	if (chain_write(of, stream_len, of->zmap, num * sizeof(uint32_t)) != num * sizeof(uint32_t))
+		goto out;
+	of->zchunk_no = -1;
+	entry->stream_len = stream_len;
+	entry->size_file += count;
+	rootdir_dirty = 1;
+	ret = count;
+out:
+	if (raw != NULL)
+		block_put(raw);
+	if (packed != NULL)
+		block_put(packed);
+	return ret;
+}
 
-	return 0;
+static int file_compress(const char *filename)
+{
+	if (filename == NULL || filename[0] == FS_META_PREFIX)
+		return -1;
+	int entry_index = entry_find(filename);
+	if (entry_index == -1)
+		return -1; // there is no file named @filename
+	if (rootdir.entry[entry_index].size_file != 0 || files_table.open_file[entry_index].ref_count > 0)
+		return -1; // only empty, closed files can switch mode
+	rootdir.entry[entry_index].flags |= ENTRY_COMPRESSED;
+	rootdir.entry[entry_index].stream_len = 0;
+	rootdir_dirty = 1;
+	return meta_update();
 }
 
-int fs_delete(const char *filename)
+int fs_compress(const char *filename)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = file_compress(filename);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+static int copy_range(const char *src, const char *dst, size_t offset, size_t len)
 {
-	if (filename == NULL)
+	if (src == NULL || dst == NULL || src[0] == FS_META_PREFIX || offset % BLOCK_SIZE != 0)
 		return -1;
-	uint16_t data_index = 0xFFFF;
-	int file_found = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
-			file_found = 1; // find the file!
-			data_index = rootdir.entry[i].first_data_index; // find the first data index
-			//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
-			rootdir.entry[i].filename[0] = '\0'; //set the entry name to NULL
-			rootdir.entry[i].size_file = 0; // cleans
-			rootdir.entry[i].first_data_index = 0xFFFF; // cleans
+	int src_index = entry_find(src);
+	if (src_index == -1)
+		return -1; // there is no file named @src
+	struct Entry *entry = &rootdir.entry[src_index];
+	if (entry->flags & ENTRY_COMPRESSED)
+		return -1; // its blocks hold the compressed stream
+	if (delalloc_flush_all() == -1)
+		return -1;
+	if (offset > entry->size_file || len > entry->size_file - offset)
+		return -1; // the range must lie within the file
+	size_t blocks_num = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// the blocks still in the chain, the last one may be a packed tail
+	size_t chain_num = blocks_num;
+	if ((entry->flags & ENTRY_TAIL) && offset / BLOCK_SIZE + chain_num > entry->size_file / BLOCK_SIZE)
+		chain_num = entry->size_file / BLOCK_SIZE - offset / BLOCK_SIZE;
+	uint16_t *run = (uint16_t*)malloc((blocks_num + 1) * sizeof(uint16_t));
+	uint8_t *block = block_get();
+	if (run == NULL || block == NULL)
+		goto fail;
 
-			block_write(super.root_index, &rootdir);
-			break;
-		}
+	batch_begin();
+	if (entry_create(dst) == -1) {
+		batch_commit();
+		goto fail;
 	}
-	if (file_found == -1) // file not found
+	int dst_index = entry_find(dst);
+	// the whole chain of @dst is allocated up front, in one run if possible
+	struct OpenFile of = { .entry_index = dst_index, .cursor_index = 0xFFFF, .group = -1 };
+	size_t claimed = chain_alloc_run(&of, 0xFFFF, blocks_num, run);
+	if (of.group != -1)
+		alloc.group[of.group].growers--;
+	int ret = claimed < blocks_num ? -1 : 0;
+	// the data moves between runs of blocks adjacent on both sides
+	uint16_t data_index = chain_num ? meta_file_block(src_index, offset / BLOCK_SIZE) : 0xFFFF;
+	for (size_t i = 0, n; ret == 0 && i < chain_num; i += n) {
+		uint16_t first_index = data_index;
+		for (n = 1; i + n < chain_num && fat.arr[data_index] == data_index + 1 &&
+			    run[i + n] == run[i] + n; n++)
+			data_index++;
+		data_index = fat.arr[data_index];
+		ret = csum_copy(first_index + super.data_start, run[i] + super.data_start, n);
+	}
+	if (ret == 0 && chain_num < blocks_num) {
+		// the packed tail gets a block of its own
+		uint8_t *frag_data = frag_block(entry->tail_index);
+		memset(block, 0, BLOCK_SIZE);
+		if (frag_data != NULL)
+			memcpy(block, frag_data + entry->tail_offset, entry->size_file % BLOCK_SIZE);
+		ret = frag_data == NULL ? -1 : csum_write(run[chain_num] + super.data_start, block);
+	}
+	if (ret == -1) {
+		for (size_t i = 0; i < claimed; i++)
+			chain_release(run[i], fat.arr, 1);
+		entry_delete(dst);
+		batch_commit();
+		goto fail;
+	}
+	for (size_t i = 0; i + 1 < blocks_num; i++)
+		fat_set(run[i], run[i + 1]);
+	rootdir.entry[dst_index].first_data_index = blocks_num ? run[0] : 0xFFFF;
+	rootdir.entry[dst_index].size_file = len;
+	rootdir_dirty = 1;
+	free(run);
+	block_put(block);
+	return batch_commit();
+
+fail:
+	free(run);
+	if (block != NULL)
+		block_put(block);
+	return -1;
+}
+
+int fs_copy_range(const char *src, const char *dst, size_t offset, size_t len)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = copy_range(src, dst, offset, len);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_COPY_RANGE, -1, offset, len, ret, src, dst);
+	return ret;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+	if (src == NULL)
+		return -1;
+	pthread_mutex_lock(&fs_lock);
+	int src_index = entry_find(src); // -1 if there is no file named @src
+	int ret = src_index == -1 ? -1 : delalloc_flush_all();
+	size_t size = ret == -1 ? 0 : rootdir.entry[src_index].size_file;
+	pthread_mutex_unlock(&fs_lock);
+	if (ret == -1)
 		return -1;
+	return fs_copy_range(src, dst, 0, size);
+}
 
-	//now we have the starting data index in FAT, clean!
-	while (data_index != 0xFFFF) {
-		// while the data_index doesn't reach to the end of the file
-		uint16_t next_index = fat.arr[data_index];
-		fat.arr[data_index] = 0;
-		data_index = next_index;
+static int file_readv(struct OpenFile *of, struct IovCursor *cur, size_t count, size_t offset)
+{
+	// read up to @count bytes of the file at @offset, whatever its storage
+	// mode. Return the number of bytes read, -1 on error.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t size = entry->size_file;
+	if (offset >= size + of->delay_len)
+		return 0;
+	if (count > size + of->delay_len - offset)
+		count = size + of->delay_len - offset;
+	if (entry->flags & ENTRY_COMPRESSED)
+		return zfile_read(of, cur, count, offset);
+	size_t delayed = 0; // what is past the stored part, still buffered
+	if (offset + count > size) {
+		delayed = offset >= size ? count : offset + count - size;
+		count -= delayed;
 	}
-
-	return 0;
+	size_t chain_size = entry->flags & ENTRY_TAIL ? size - size % BLOCK_SIZE : size;
+	size_t done = 0;
+	if (offset < chain_size) {
+		size_t len = count < chain_size - offset ? count : chain_size - offset;
+		done = chain_readv(of, offset, cur, len);
+		if (done < len)
+			return done ? done : -1; // broken chain
+	}
+	if (done < count) {
+		// the rest is in the packed tail
+		uint8_t *frag_data = frag_block(entry->tail_index);
+		if (frag_data == NULL)
+			return done ? done : -1;
+		iov_copy(cur, frag_data + entry->tail_offset + (offset + done - chain_size), count - done, 1);
+		done = count;
+	}
+	if (delayed > 0) {
+		iov_copy(cur, of->delay + (offset + done - size), delayed, 1);
+		done += delayed;
+	}
+	return done;
 }
 
-int fs_ls(void)
+static int file_writev(struct OpenFile *of, struct IovCursor *cur, size_t count, size_t offset)
 {
-	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		//An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
-		if (rootdir.entry[i].filename[0] != '\0') {
-			// if the file entry isn't null, we access the struct
-			struct Entry cur = rootdir.entry[i];
-			printf("file: %s, size: %i, data_blk: %i\n", (char*)cur.filename, cur.size_file, cur.first_data_index);
+	// write @count bytes of the file at @offset, growing it as needed.
+	// Return the number of bytes written, short if the disk is full, -1 if
+	// @offset is past the end of the file.
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	if (offset > entry->size_file + of->delay_len)
+		return -1;
+	if (count == 0)
+		return 0;
+	if (entry->flags & ENTRY_COMPRESSED)
+		return zfile_write(of, cur, count, offset);
+	if (tail_unpack(of->entry_index) == -1)
+		return 0; // no space left to bring the tail back
+	of->written = 1;
+	// the blocks of the chain are written in place, what goes past them is
+	// buffered if delayed allocation allows
+	size_t chain_end = entry->size_file;
+	if (of->delay_len == 0)
+		chain_end = (chain_end + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if (offset + count > chain_end && !delay_ok(of)) {
+		if (delay_flush(of) == -1)
+			return 0;
+		chain_end = SIZE_MAX;
+	}
+	size_t done = 0;
+	if (offset < chain_end) {
+		size_t len = count < chain_end - offset ? count : chain_end - offset;
+		done = chain_writev(of, offset, cur, len);
+		if (offset + done > entry->size_file) {
+			entry->size_file = offset + done;
+			rootdir_dirty = 1;
 		}
+		if (done < len)
+			return done; // disk full
+	}
+	if (done < count)
+		done += delay_write(of, cur, offset + done - entry->size_file, count - done);
+	return done;
+}
+
+static int files_table_grow(void)
+{
+	// double the descriptor table and thread the new slots onto the free list
+	int new_capacity = files_table.capacity ? files_table.capacity * 2 : FS_OPEN_MAX_COUNT;
+	struct File *file = realloc(files_table.file, new_capacity * sizeof(struct File));
+	if (file == NULL)
+		return -1;
+	for (int i = new_capacity - 1; i >= files_table.capacity; i--) {
+		file[i].of = NULL;
+		file[i].offset = 0;
+		file[i].next_free = files_table.free_head;
+		files_table.free_head = i;
 	}
+	files_table.file = file;
+	files_table.capacity = new_capacity;
 	return 0;
 }
 
-int fs_open(const char *filename)
+static struct File *fd_lookup(int fd)
+{
+	//return the open descriptor @fd, NULL if out of bounds or not currently opened
+	if (fd < 0 || fd >= files_table.capacity)
+		return NULL;
+	return files_table.file[fd].of == NULL ? NULL : &files_table.file[fd];
+}
+
+static int fd_open(const char *filename)
 {
 	// Error verification: @filename is valid
 	if (filename == NULL || strnlen(filename, FS_FILENAME_LEN) >= FS_FILENAME_LEN)
 		return -1; 
+	if (filename[0] == FS_META_PREFIX)
+		return -1; // metadata files are not accessible through descriptors
 
 	// Error verification:: check whether file exists in root directory
-	int fd_find = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0)
-			fd_find = 1;
-	}
-
-	if (fd_find == -1)
+	int entry_index = entry_find(filename);
+	if (entry_index == -1)
 		return -1; // there is no file named @filename to open
 
-	// Error verification: check whether we have over 32 files opened
-	if (files_table.num_open == FS_OPEN_MAX_COUNT)
-		return -1; // _OPEN_MAX_COUNT files currently open
-
-	//after error checking we proceed to open the file
-	int ret_fd = -1;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		// if the filename first character is NULL, then it's empty file slot
-		if (files_table.file[i].filename[0] == '\0') {
-			files_table.num_open++; //increament open files count
-			memcpy(files_table.file[i].filename, filename, FS_FILENAME_LEN); // copy the file name
-			files_table.file[i].offset = 0; //set offset to 0
-			ret_fd = i; // get the fd to return
-			break;
+	// no free descriptor left, grow the table
+	if (files_table.free_head == -1 && files_table_grow() == -1)
+		return -1;
+
+	//after error checking we proceed to open the file, popping the free list
+	int ret_fd = files_table.free_head;
+	struct File *file = &files_table.file[ret_fd];
+	files_table.free_head = file->next_free;
+
+	struct OpenFile *of = &files_table.open_file[entry_index];
+	if (of->ref_count == 0) {
+		// first descriptor on this file: set up the shared object
+		of->entry_index = entry_index;
+		of->cursor_blk = 0;
+		of->cursor_index = 0xFFFF;
+		of->written = 0;
+		of->group = -1;
+		of->delay = NULL;
+		of->delay_len = 0;
+		if ((rootdir.entry[entry_index].flags & ENTRY_COMPRESSED) && zfile_open(of) == -1) {
+			zfile_close(of);
+			files_table.file[ret_fd].next_free = files_table.free_head;
+			files_table.free_head = ret_fd;
+			return -1;
 		}
 	}
-	if (ret_fd == -1)
-		return -1; //if ret fd isn't updated at all
+	of->ref_count++;
+	file->of = of;
+	file->offset = 0; //set offset to 0
+	files_table.num_open++; //increament open files count
 	return ret_fd;
 }
 
-int fs_close(int fd)
+static int of_put(struct OpenFile *of)
+{
+	// drop a descriptor's or a mapping's reference on the shared object.
+	// Return -1 if the last one cannot write the data buffered for the
+	// file: the reference is kept, along with the buffer.
+	if (of->ref_count == 1 && delay_flush(of) == -1)
+		return -1;
+	if (--of->ref_count > 0)
+		return 0;
+	// last one: the file is complete, pack its tail if enabled
+	if (of->written) {
+		chain_trim(of);
+		tail_pack(of);
+		// the new size and blocks of the file reach the disk as one update
+		meta_update();
+	}
+	if (of->group != -1)
+		alloc.group[of->group].growers--;
+	of->group = -1;
+	delay_release(of);
+	zfile_close(of);
+	return 0;
+}
+
+static int fd_close(int fd)
 {
-	if (fd > 31 || fd < 0)
-		return -1; // out of bounds
-	if (files_table.file[fd].filename[0] == '\0')
-		return -1; // not currently opened
-	// now we proceed to reset
-	files_table.file[fd].filename[0] = '\0'; // change the file name to NULL
-	files_table.file[fd].offset = 0; // reset offset
+	struct File *file = fd_lookup(fd);
+	if (file == NULL)
+		return -1; // out of bounds or not currently opened
+	// now we proceed to reset and push the slot back onto the free list
+	if (of_put(file->of) == -1)
+		return -1; // buffered data cannot be written, the descriptor stays open
+	file->of = NULL;
+	file->offset = 0; // reset offset
+	file->next_free = files_table.free_head;
+	files_table.free_head = fd;
 
 	files_table.num_open--; // decrease the open count
 	return 0;
 }
 
-int fs_stat(int fd)
+int fs_open(const char *filename)
 {
-	if (fd > 31 || fd < 0)
-		return -1; // out of bounds
-	if (files_table.file[fd].filename[0] == '\0')
-		return -1; // not currently opened
-	char *filename = (char*)files_table.file[fd].filename;
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int fd = fd_open(filename);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_OPEN, -1, 0, 0, fd, filename, NULL);
+	return fd;
+}
 
-	int ret_size = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
-			// if the name matches
-			ret_size = rootdir.entry[i].size_file;
-		}
-	}
-	return ret_size;
+int fs_close(int fd)
+{
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	int ret = fd_close(fd);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_CLOSE, fd, 0, 0, ret, NULL, NULL);
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_stat(int fd)
 {
-	int size = fs_stat(fd);
-	if (size == -1)
-		return -1;
-	if (offset > size)
-		return -1;
-	files_table.file[fd].offset = offset;
-	return 0;
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&fs_lock);
+	struct File *file = fd_lookup(fd);
+	int size = file == NULL ? -1 : (int)(rootdir.entry[file->of->entry_index].size_file + file->of->delay_len);
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_STAT, fd, 0, 0, size, NULL, NULL);
+	return size; // -1 if out of bounds or not currently opened
 }
 
-uint16_t data_ind(size_t offset, uint16_t file_start) {
-	//return index of data block according to the offset
-	// file_start is the starting fat index
-	// offset is the file current offset
-	int count_offset = BLOCK_SIZE - 1; //initial boundary is the end of the file
-	uint16_t data_index = file_start;
-	while (data_index != 0xFFFF && count_offset < offset) {
-		// while the data_index doesn't reach to the end of the file
-		// AND meanwhile we haven't reached the offset position
-		if (fat.arr[data_index] == 0xFFFF)
-			return data_index; //return index cannot be 0xFFFF
-		data_index = fat.arr[data_index]; // update data_index through block chain
-		count_offset += BLOCK_SIZE; // increment counts
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t start = trace_begin();
+	int ret = -1;
+	pthread_mutex_lock(&fs_lock);
+	struct File *file = fd_lookup(fd);
+	if (file != NULL && offset <= rootdir.entry[file->of->entry_index].size_file + file->of->delay_len) {
+		file->offset = offset;
+		ret = 0;
 	}
-	return data_index ; //return data index + offset
+	pthread_mutex_unlock(&fs_lock);
+	trace_end(start, FS_TRACE_LSEEK, fd, offset, 0, ret, NULL, NULL);
+	return ret;
 }
 
-uint16_t fat_1stEmpty_ind() {
-	//claim the first empty availble fat entry, and change the value of it to 0XFFFF
-	uint16_t i;
-	for (i = 1; i < super.data_blocks_num; i++){
-		//i should definitely start from 1 here!
-		if (fat.arr[i] == 0){
-			fat.arr[i] = 0xFFFF; //set the entry value to FAT_EOC
-			return i;
-		}
+static int fd_io(int fd, const struct iovec *iov, int iovcnt, const size_t *pos, int writing)
+{
+	// common path of the descriptor I/O calls. @pos is the file offset to
+	// use, NULL for the descriptor's own, which then moves past the bytes
+	// transferred.
+	uint64_t start = trace_begin();
+	size_t count = 0;
+	if (iov == NULL || iovcnt < 0)
+		return -1;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len > 0)
+			return -1;
+		count += iov[i].iov_len;
+		if (count > INT_MAX)
+			return -1; // the byte count must fit the return value
 	}
-	return (uint16_t)0xFFFF;
+	struct IovCursor cur = { iov, iovcnt };
+	int ret = -1;
+	size_t offset = pos != NULL ? *pos : 0;
+	pthread_mutex_lock(&fs_lock);
+	struct File *file = fd_lookup(fd);
+	if (file != NULL) {
+		if (pos == NULL)
+			offset = file->offset;
+		if (writing)
+			ret = file_writev(file->of, &cur, count, offset);
+		else
+			ret = file_readv(file->of, &cur, count, offset);
+		if (pos == NULL && ret > 0)
+			file->offset += ret;
+		if (writing && ret > 0 && durability.mode == FS_DURABLE_GROUP && commit_tick(ret) == -1)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if (pos != NULL)
+		trace_end(start, writing ? FS_TRACE_PWRITE : FS_TRACE_PREAD, fd, offset, count, ret, NULL, NULL);
+	else
+		trace_end(start, writing ? FS_TRACE_WRITE : FS_TRACE_READ, fd, offset, count, ret, NULL, NULL);
+	return ret;
 }
 
 int fs_write(int fd, void *buf, size_t count)
 {
-	if (count < 0 || buf == NULL)
+	struct iovec iov = { buf, count };
+	return fd_io(fd, &iov, 1, NULL, 1);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	return fd_io(fd, &iov, 1, NULL, 0);
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { (void*)buf, count };
+	return fd_io(fd, &iov, 1, &offset, 1);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { buf, count };
+	return fd_io(fd, &iov, 1, &offset, 0);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fd_io(fd, iov, iovcnt, NULL, 1);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fd_io(fd, iov, iovcnt, NULL, 0);
+}
+
+static int mapping_fill(struct Mapping *map)
+{
+	// map the blocks of the file in place, a run of consecutive blocks at a
+	// time. Return -1 if the disk cannot be mapped.
+	struct OpenFile *of = map->of;
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	size_t first_blk = map->offset / BLOCK_SIZE;
+	size_t blocks_num = map->size / BLOCK_SIZE;
+	if (entry->flags & ENTRY_TAIL && entry->size_file / BLOCK_SIZE - first_blk < blocks_num)
+		blocks_num = entry->size_file / BLOCK_SIZE - first_blk; // the rest is packed
+	uint16_t data_index = cursor_data_ind(of, map->offset, entry->first_data_index);
+	if (blocks_num > 0 && of->cursor_blk != first_blk)
 		return -1;
-	if (count == 0)
-		return 0;
-	if (fd > 31 || fd < 0)
-		return -1; // out of bounds
-	if (files_table.file[fd].filename[0] == '\0')
-		return -1; // not currently opened
-
-	char *filename = (char*)files_table.file[fd].filename; //get the filename
-	size_t offset = files_table.file[fd].offset;
-	int size = fs_stat(fd); //get fd size
-	uint16_t file_start = 0xFFFF;
-	//now we get the first data index for file
-	int root_index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
-			file_start = rootdir.entry[i].first_data_index;
-			root_index = i;
-			break;
+	for (size_t blk = 0; blk < blocks_num;) {
+		if (data_index == 0xFFFF)
+			return -1; // broken chain
+		size_t run = 1;
+		uint16_t next_index = fat.arr[data_index];
+		while (blk + run < blocks_num && next_index == data_index + run) {
+			next_index = fat.arr[next_index];
+			run++;
 		}
-	}
-	if (root_index == -1 || file_start == 0)
-		return -1; // file not found or file start with FAT 0, so weird
-
-	if (size == 0) {
-		//the file is empty with no allocated data block
-		uint16_t next_fat_index = fat_1stEmpty_ind(); 
-		if (next_fat_index == 0xFFFF){
-			return 0;
-		}else{
-			rootdir.entry[root_index].first_data_index  = next_fat_index;
-		}
-		file_start = rootdir.entry[root_index].first_data_index; //update our file_start
-	}
-
-	void *bounce_buffer = (void*)malloc(BLOCK_SIZE);
-	uint16_t data_index = data_ind(offset, file_start);
-	// FAT entry contents must be added to the data block start index in order to find the real block number on disk.
-	uint16_t block_number = data_index + super.data_start;
-	block_read((size_t )block_number, bounce_buffer);
-	size_t bounce_offset = offset % BLOCK_SIZE; //get local bounce offset for the bounce buf(first data block)
-	int size_incrementing_flag = 0;
-	int count_byte = 0;
-	for (size_t i = 0; i < count; i++, bounce_offset++, offset++) {
-		files_table.file[fd].offset = offset; //update file table current offset
-		//for every write operation, we incremented buf offset i, bounce(in_block) offset, file offset
-		if (offset >= size) // if reach the end of the file and we are still writing
-			size_incrementing_flag = 1; //start to incrementing the size of the file
-
-		if (bounce_offset >= BLOCK_SIZE) {
-			bounce_offset = 0; //reset bounce offset to the beginning
-			if (size_incrementing_flag == 1) {
-				// if we're incrementing size of the file and need new space
-				uint16_t next_fat_index = fat_1stEmpty_ind(); //get current data block index
-				if (next_fat_index == 0xFFFF) {
-					return count_byte; // return if we have no next data block
-				}
-				fat.arr[data_index] = next_fat_index; //update fat array linked structure, cur points to next
-				data_index = next_fat_index;
-			} else {
-				// Enough data block for this file
-				data_index = data_ind(offset, file_start); //get next data block index
-			}
-		uint16_t block_number = data_index + super.data_start; //data_index = fat index + offset
-                block_read((size_t )block_number, bounce_buffer); //get new bounce buffer
+		if (block_map(map->base + blk * BLOCK_SIZE, data_index + super.data_start, run, map->writable) == -1)
+			return -1;
+		if (map->writable && dedup.hash != NULL) {
+			// written behind the index's back
+			for (size_t i = 0; i < run; i++)
+				dedup.hash[data_index + i] = 0;
 		}
-		
-		memcpy(bounce_buffer + bounce_offset, buf + i, 1); //copy 1 byte each write: buf -> bounce
-		count_byte++;
-		// Potential Performance improvements: writing in 2 cases: reaching the final count OR bounce_offset is 4095
-		// which is: if (i == count - 1 || bounce_offset == BLOCK_SIZE - 1)
-		uint16_t block_number = data_index + super.data_start;
-		block_write((size_t )block_number, bounce_buffer);
-		
-		if (size_incrementing_flag == 1){ // if we are writing new bytes to the file
-			rootdir.entry[root_index].size_file ++; // increment the size file
+		if (map->writable && csum.arr != NULL) {
+			// and of the checksums'
+			for (size_t i = 0; i < run; i++)
+				csum_set(data_index + i + super.data_start, 0);
 		}
+		blk += run;
+		data_index = next_index;
+	}
+	if (blocks_num < map->size / BLOCK_SIZE) {
+		// a packed tail lies within a fragment block, it gets copied
+		uint8_t *frag_data = frag_block(entry->tail_index);
+		if (frag_data == NULL)
+			return -1;
+		memcpy(map->base + blocks_num * BLOCK_SIZE, frag_data + entry->tail_offset,
+		       entry->size_file % BLOCK_SIZE);
 	}
-	return count_byte;
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+static int mapping_copy(struct Mapping *map)
 {
-	if (count < 0)
-		return -1;
-	if (fd > 31 || fd < 0)
-		return -1; // out of bounds
-	if (files_table.file[fd].filename[0] == '\0')
-		return -1; // not currently opened
-
-	char *filename = (char*)files_table.file[fd].filename; //get the filename
-	size_t offset = files_table.file[fd].offset;
-
-	int size = fs_stat(fd); //get fd size
-	uint16_t file_start = 0xFFFF;
+	// fill the mapping with a copy of the file, from the block holding the
+	// offset to the end of the range or of the file
+	struct Entry *entry = &rootdir.entry[map->of->entry_index];
+	size_t start = map->offset - map->offset % BLOCK_SIZE;
+	size_t len = entry->size_file - start < map->size ? entry->size_file - start : map->size;
+	struct iovec iov = { map->base, len };
+	struct IovCursor cur = { &iov, 1 };
+	map->copied = 1;
+	return file_readv(map->of, &cur, len, start) == (int)len ? 0 : -1;
+}
 
-	//now we get the first data index for file
-	int root_index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rootdir.entry[i].filename, filename) == 0) {
-			file_start = rootdir.entry[i].first_data_index;
-			root_index = i;
-			break;
+void *fs_mmap(int fd, size_t offset, size_t len, int writable)
+{
+	pthread_mutex_lock(&fs_lock);
+	struct File *file = fd_lookup(fd);
+	struct Mapping *map = NULL;
+	if (file == NULL)
+		goto fail;
+	struct OpenFile *of = file->of;
+	struct Entry *entry = &rootdir.entry[of->entry_index];
+	if (delay_flush(of) == -1)
+		goto fail; // the mapping covers blocks, buffered data needs them
+	if (len == 0 || offset > entry->size_file || len > entry->size_file - offset)
+		goto fail; // the range must lie within the file
+	if (writable && (entry->flags & ENTRY_COMPRESSED))
+		goto fail; // compressed files are only appended to
+	size_t first_blk = offset / BLOCK_SIZE;
+	size_t last_blk = (offset + len - 1) / BLOCK_SIZE;
+	// writing through the mapping bypasses copy-on-write: the blocks must
+	// be private, the tail included
+	if (writable && (tail_unpack(of->entry_index) == -1 ||
+			 (refcnt.arr != NULL && chain_unshare(of, first_blk, last_blk) == -1)))
+		goto fail;
+	map = (struct Mapping*)calloc(1, sizeof(struct Mapping));
+	if (map == NULL)
+		goto fail;
+	map->size = (last_blk - first_blk + 1) * BLOCK_SIZE;
+	map->of = of;
+	map->offset = offset;
+	map->len = len;
+	map->writable = writable != 0;
+	// reserve the whole range, the blocks are mapped over it
+	map->base = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->base == MAP_FAILED)
+		goto fail;
+	if ((entry->flags & ENTRY_COMPRESSED) || mapping_fill(map) == -1) {
+		// the disk cannot be mapped (RAM disk) or the file is compressed
+		if (mmap(map->base, map->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED ||
+		    mapping_copy(map) == -1) {
+			munmap(map->base, map->size);
+			goto fail;
 		}
 	}
+	if (!map->writable)
+		mprotect(map->base, map->size, PROT_READ);
+	of->ref_count++;
+	of->maps++;
+	of->maps_writable += map->writable;
+	of->written |= map->writable;
+	map->next = mappings;
+	mappings = map;
+	pthread_mutex_unlock(&fs_lock);
+	return map->base + offset % BLOCK_SIZE;
 
-	if (size == 0) //if the file is empty
-		return 0; //cannot read anything, return 0
-	if (root_index == -1 || file_start == 0xFFFF || file_start == 0)
-		return -1; //fd is not found OR starts with 0th fat, so weird
-	if (offset == size && count != 0) //if offset is at the very end of the file
-		return 0; //cannot read anything, return
+fail:
+	free(map);
+	pthread_mutex_unlock(&fs_lock);
+	return NULL;
+}
 
-	void *bounce_buffer = (void*)malloc(BLOCK_SIZE);
-	int start_data_index = data_ind(offset, file_start);
-	uint16_t start_data_block_number = start_data_index + super.data_start;
-	block_read((size_t )start_data_block_number, bounce_buffer);
-	
-	size_t bounce_offset = offset % BLOCK_SIZE; //get local bounce offset for the bounce buf(first data block)
-	int count_byte = 0;
-	for (size_t i = 0; i < count; i++, bounce_offset++, offset++) {
-		//for every read operation, we incremented buf offset i, bounce(in_block) offset, file offset
-		files_table.file[fd].offset = offset; //update file table current offset
-		if (offset >= size) {
-			return count_byte; //reach the end of the file
-		}
-		if (bounce_offset >= BLOCK_SIZE) { // if offset is >= 4096, aka > 4095
-			bounce_offset = 0; //reset bounce offset to the beginning
-			int next_data_index = data_ind(offset, file_start); //get next data block index
-			if (next_data_index == 0xFFFF) {
-				return count_byte; // return if we have no next data block
-			}
-			uint16_t next_data_block_number = next_data_index + super.data_start;
-			block_read((size_t )next_data_block_number, bounce_buffer); //get new bounce buffer
-		}
-		memcpy(buf + i, bounce_buffer + bounce_offset, 1); //copy 1 byte each read
-		count_byte++;
+int fs_munmap(void *addr)
+{
+	pthread_mutex_lock(&fs_lock);
+	struct Mapping **link = &mappings;
+	while (*link != NULL && (*link)->base + (*link)->offset % BLOCK_SIZE != (uint8_t*)addr)
+		link = &(*link)->next;
+	struct Mapping *map = *link;
+	if (map == NULL) {
+		pthread_mutex_unlock(&fs_lock);
+		return -1; // not returned by fs_mmap()
+	}
+	int ret = 0;
+	if (map->writable && map->copied) {
+		// a copy is written back, the blocks of the file were never mapped
+		struct iovec iov = { addr, map->len };
+		struct IovCursor cur = { &iov, 1 };
+		ret = file_writev(map->of, &cur, map->len, map->offset) == (int)map->len ? 0 : -1;
+		if (ret == 0 && durability.mode == FS_DURABLE_GROUP)
+			ret = commit_tick(map->len);
 	}
-	return count_byte;
+	*link = map->next;
+	munmap(map->base, map->size);
+	map->of->maps--;
+	map->of->maps_writable -= map->writable;
+	if (of_put(map->of) == -1)
+		ret = -1;
+	free(map);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
 }
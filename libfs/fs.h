@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for the fixed-size types of trace records */
+#include <sys/uio.h> /* for struct iovec */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,7 +11,10 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Leading character of the hidden file names used for file system metadata */
+#define FS_META_PREFIX '$'
+
+/** Initial size of the open file table, which grows on demand */
 #define FS_OPEN_MAX_COUNT 32
 
 /**
@@ -32,7 +37,8 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * cannot be closed, or if there are still open file descriptors or mappings
+ * made by fs_mmap(). 0 otherwise.
  */
 int fs_umount(void);
 
@@ -45,6 +51,16 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_free_count - Count free data blocks
+ *
+ * Blocks reserved for data buffered by fs_delalloc() are not counted as free.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of free data blocks.
+ */
+int fs_free_count(void);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -52,7 +68,7 @@ int fs_info(void);
  * Create a new and empty file named @filename in the root directory of the
  * mounted file system. String @filename must be NULL-terminated and its total
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * character). Names starting with %FS_META_PREFIX are reserved.
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
  * or if string @filename is too long, or if the root directory already contains
@@ -72,6 +88,517 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_rename - Rename a file
+ * @oldname: Current file name
+ * @newname: New file name
+ *
+ * Rename the file named @oldname to @newname. Descriptors already open on the
+ * file remain valid.
+ *
+ * Return: -1 if either name is invalid, if there is no file named @oldname, or
+ * if a file named @newname already exists. 0 otherwise.
+ */
+int fs_rename(const char *oldname, const char *newname);
+
+/**
+ * fs_begin - Start a metadata batch
+ *
+ * Until the matching fs_commit(), fs_create(), fs_delete() and fs_rename()
+ * only update the in-memory root directory and FAT. Batches can be nested; the
+ * changes are persisted when the outermost batch is committed.
+ *
+ * Return: 0.
+ */
+int fs_begin(void);
+
+/**
+ * fs_commit - Commit a metadata batch
+ *
+ * End the batch started by the matching fs_begin(). When it is the outermost
+ * batch, the modified FAT blocks and the root directory are written back to
+ * disk once.
+ *
+ * Return: -1 if no batch is in progress or if writing the metadata fails. 0
+ * otherwise.
+ */
+int fs_commit(void);
+
+/**
+ * fs_create_many - Create several files in one batch
+ * @filenames: Array of file names
+ * @count: Number of entries in @filenames
+ *
+ * Same as calling fs_create() on each name inside a single
+ * fs_begin()/fs_commit() batch.
+ *
+ * Return: -1 if @filenames is invalid or if the metadata cannot be written.
+ * Otherwise return the number of files actually created.
+ */
+int fs_create_many(const char **filenames, int count);
+
+/**
+ * fs_delete_many - Delete several files in one batch
+ * @filenames: Array of file names
+ * @count: Number of entries in @filenames
+ *
+ * Same as calling fs_delete() on each name inside a single
+ * fs_begin()/fs_commit() batch.
+ *
+ * Return: -1 if @filenames is invalid or if the metadata cannot be written.
+ * Otherwise return the number of files actually deleted.
+ */
+int fs_delete_many(const char **filenames, int count);
+
+/** Durability policies, see fs_durability(). Each includes the ones before. */
+enum {
+	FS_DURABLE_NONE,	/* never flushed to storage by the library */
+	FS_DURABLE_UMOUNT,	/* flushed by fs_umount() */
+	FS_DURABLE_SYNC,	/* also flushed by fs_sync(), the default */
+	FS_DURABLE_GROUP,	/* also flushed periodically, by group commit */
+};
+
+/**
+ * fs_durability - Choose when changes are flushed to storage
+ * @mode: One of the FS_DURABLE_* policies
+ * @interval_ms: Under %FS_DURABLE_GROUP, maximum age of an uncommitted change
+ * @interval_bytes: Under %FS_DURABLE_GROUP, amount of written data that
+ *                  triggers a commit
+ *
+ * Set the durability policy of the mounted file system, reset to
+ * %FS_DURABLE_SYNC by fs_mount(). A flush (fdatasync() of the virtual disk
+ * file) makes durable every block written so far. With %FS_DURABLE_NONE or
+ * %FS_DURABLE_UMOUNT, fs_sync() only writes back pending metadata, and the
+ * blocks held by fs_writeback().
+ *
+ * Under %FS_DURABLE_GROUP, metadata changes are no longer written as they
+ * happen but wait for the next commit: the data written by every caller is
+ * flushed, then the metadata pointing to it is written and flushed. On a crash,
+ * the image is left as of the last commit, never with metadata pointing to
+ * data that did not reach the disk. A commit happens once the oldest change is
+ * @interval_ms old or @interval_bytes bytes were written (0 disables either
+ * limit). @interval_bytes is checked on each write, while @interval_ms is kept
+ * by a background thread, so it holds even when the file system goes idle.
+ *
+ * Return: -1 if no file system is mounted, if @mode is invalid, if both limits
+ * are 0 for %FS_DURABLE_GROUP, if the commit thread cannot be started, or if
+ * leaving %FS_DURABLE_GROUP fails to commit pending changes. 0 otherwise.
+ */
+int fs_durability(int mode, unsigned int interval_ms, size_t interval_bytes);
+
+/**
+ * fs_sync - Flush changes to storage
+ *
+ * Under %FS_DURABLE_SYNC or %FS_DURABLE_GROUP, make every change made so far
+ * durable, data first, then metadata. The metadata of a batch in progress is
+ * left in memory until its fs_commit(). Under the other policies, only write
+ * back pending metadata, and the blocks held by fs_writeback(). Under every
+ * policy, data buffered by fs_delalloc() is first given its blocks.
+ *
+ * Return: -1 if no file system is mounted or if writing or flushing fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_writeback - Write blocks back to the disk in the background
+ * @dirty_max: Most blocks held in memory, 0 to write blocks as they change
+ * @expire_ms: Age at which a block held in memory is written, 0 for no limit
+ *
+ * Until fs_umount(), keep the data and metadata blocks written by the file
+ * system in a cache of @dirty_max blocks instead of writing them to the disk
+ * right away, so that writes complete at memory speed. A background thread
+ * writes them back once the oldest one is @expire_ms old, or as soon as half
+ * the cache is in use, merging adjacent blocks into range writes. Writers wait
+ * while the cache is full. The durability policy is unchanged: every flush
+ * writes the cache back first, and so do fs_sync() and fs_umount().
+ *
+ * Memory mappings made by fs_mmap() only see the blocks written through a
+ * descriptor afterwards once they are written back.
+ *
+ * Return: -1 if no file system is mounted, if the disk is a RAM disk, or if the
+ * cache cannot be set up, or written back when it is resized. 0 otherwise.
+ */
+int fs_writeback(size_t dirty_max, unsigned int expire_ms);
+
+/**
+ * fs_delalloc - Enable or disable delayed allocation
+ * @enable: Non-zero to enable delayed allocation, 0 to disable it
+ *
+ * With delayed allocation, data appended to a file past its last block is
+ * kept in memory, in one of 32 buffers of 32 blocks set up here, instead of
+ * being given blocks one write at a time. Only the blocks it needs are
+ * reserved, and fs_free_count() leaves them out. Once the buffer is full, or
+ * when the file is closed, mapped, cloned, copied or snapshotted, or when
+ * fs_sync(), fs_ls(), fs_opendir(), fs_check(), fs_defrag() or fs_umount() is
+ * called, the data gets its blocks as one run of contiguous blocks if the
+ * disk has one, written with a single range write. Files
+ * appended to by many small writes, or several at once, thus stay in one
+ * piece. Files appended to while no buffer is left are written directly.
+ *
+ * Buffering does not apply while fs_dedup() is enabled, nor to compressed
+ * files or files mapped with fs_mmap(). Group commits of %FS_DURABLE_GROUP
+ * only cover the data already given its blocks: buffered data only reaches
+ * the disk once flushed as above. Disabling delayed allocation flushes every
+ * buffer.
+ *
+ * Return: -1 if no file system is mounted, if the buffers cannot be
+ * allocated, or if buffered data cannot be written. 0 otherwise.
+ */
+int fs_delalloc(int enable);
+
+/**
+ * fs_discard - Enable or disable discarding freed blocks
+ * @enable: Non-zero to discard freed blocks, 0 to stop
+ *
+ * In discard mode, the data blocks freed by fs_delete() and the other calls
+ * are recorded, and given back to the host with block_discard() once the
+ * metadata freeing them is flushed to storage, by fs_sync(), a group commit, a
+ * journal checkpoint or fs_umount(): runs of adjacent blocks are punched out of
+ * the virtual disk file at once, so that it shrinks on the host, and
+ * snapshots or backups of the file skip them. Blocks claimed again in the
+ * meantime are left alone. Discarding is best effort: hosts that cannot punch
+ * holes keep the blocks. Blocks freed while the mode is off can be discarded
+ * with fs_trim().
+ *
+ * Return: -1 if no file system is mounted or if memory cannot be allocated. 0
+ * otherwise.
+ */
+int fs_discard(int enable);
+
+/**
+ * fs_trim - Discard every free data block
+ *
+ * Write pending metadata, flushed to storage under %FS_DURABLE_SYNC or
+ * %FS_DURABLE_GROUP, then give every free data block back to the host as
+ * fs_discard() does, whether it was already or not.
+ *
+ * Return: -1 if no file system is mounted, if a batch is in progress, or if
+ * the metadata cannot be written or the blocks cannot be discarded. Otherwise
+ * return the number of blocks discarded.
+ */
+int fs_trim(void);
+
+/**
+ * fs_journal - Add a metadata journal to the file system
+ * @blocks_num: Size of the journal in blocks, 0 for a default size
+ *
+ * Reserve a run of @blocks_num contiguous free blocks as a write-ahead journal
+ * for the metadata, recorded in the superblock. From then on, every metadata
+ * update of the image (FAT, root directory and reference count blocks) is
+ * first logged to the journal as a transaction, with one sequential write, and
+ * only written in place at the next checkpoint: when the journal runs out of
+ * room, and at unmount. fs_mount() replays the transactions logged since the
+ * last checkpoint, so a crash leaves the metadata as of a transaction, never
+ * halfway between two. Closing the last descriptor of a file that was written
+ * to logs its new size and blocks.
+ *
+ * Checkpoints always flush the image to storage, whatever the durability
+ * policy. A journaled image stays readable by implementations that ignore the
+ * journal, as long as it was unmounted cleanly.
+ *
+ * Return: -1 if no file system is mounted, if it already has a journal, if a
+ * batch is in progress, if @blocks_num is too small to hold the largest
+ * transaction, or if no run of free blocks is large enough. 0 otherwise.
+ */
+int fs_journal(int blocks_num);
+
+/** Checksum modes, see fs_checksum() */
+enum {
+	FS_CSUM_NONE,	/* blocks are not checksummed */
+	FS_CSUM_SCRUB,	/* checksummed, only checked by fs_scrub() */
+	FS_CSUM_VERIFY,	/* checksummed, and checked by every read */
+};
+
+/**
+ * fs_checksum - Choose how blocks are checksummed
+ * @mode: One of the FS_CSUM_* modes
+ *
+ * Keep a CRC32C of every block of the disk in a hidden table, created the
+ * first time and filled from the blocks in use, and deleted by
+ * %FS_CSUM_NONE. Every block written gets its checksum updated, and the table
+ * blocks changed are written along with the FAT and root directory, in the
+ * same transaction with a journal. Blocks freed, the journal's and the table's
+ * own are not checked. With %FS_CSUM_VERIFY, fs_read() and the other calls
+ * reading data fail on a block that does not match its checksum. The CRCs are
+ * computed with the SSE4.2 crc32 instruction when the processor has it.
+ *
+ * The mode is stored in the image. fs_mount() checks the superblock, FAT, root
+ * directory and reference counts against the table, and fails on a mismatch;
+ * after a crash, the table is rebuilt from the blocks instead. Images with
+ * checksums cannot be written by implementations that do not know about them.
+ *
+ * Return: -1 if no file system is mounted, if @mode is invalid, if a batch is
+ * in progress, or if the table cannot be created: the disk is full, files are
+ * mapped writable with fs_mmap(), or the journal is too small to log it. 0
+ * otherwise.
+ */
+int fs_checksum(int mode);
+
+/**
+ * fs_scrub - Check every block against its checksum
+ *
+ * Write buffered data and, with a journal, checkpoint the metadata, then read
+ * every checksummed block of the disk and count those not matching.
+ *
+ * Return: -1 if no file system is mounted, if it has no checksums, if a batch
+ * is in progress, or if a block cannot be read. Otherwise return the number of
+ * blocks that do not match their checksum.
+ */
+int fs_scrub(void);
+
+/**
+ * fs_compress - Store a file compressed
+ * @filename: File name
+ *
+ * Switch the empty file named @filename to compressed storage. Its content is
+ * then split in chunks of %BLOCK_SIZE bytes, each compressed on its own with
+ * LZ4, so that fs_lseek() and fs_read() keep random access at the cost of one
+ * chunk decompression. A compressed file can only be appended to: fs_write()
+ * fails unless the file offset is at the end of the file.
+ *
+ * Return: -1 if there is no file named @filename, or if it is not empty or
+ * currently open. 0 otherwise.
+ */
+int fs_compress(const char *filename);
+
+/**
+ * fs_tailpack - Pack the tails of small files together
+ * @enable: Non-zero to enable tail packing, zero to disable it
+ *
+ * When enabled, closing the last descriptor of a file that was written to
+ * moves the partial last block of the file (the whole file if it is smaller
+ * than %BLOCK_SIZE) into a fragment block shared with the tails of other
+ * files, and frees that block. A later fs_write() to the file moves the tail
+ * back into a block of its own first. Packed tails are always readable, the
+ * setting only decides whether new ones get packed; it is reset by fs_mount().
+ * Images holding packed tails cannot be read by implementations that do not
+ * know about them.
+ *
+ * Files sharing blocks with a clone are never packed, and fs_clone(),
+ * fs_snapshot() and exports of the live state through fs_snapshot_diff()
+ * unpack the tails of the files involved.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_tailpack(int enable);
+
+/**
+ * fs_dedup - Share the blocks whose content is already on disk
+ * @enable: Non-zero to enable deduplication, zero to disable it
+ *
+ * When enabled, every full block written to a plain file with fs_write() is
+ * hashed into an in-memory index, which first receives the blocks of the files
+ * already on disk. A block whose content does not change is not written again,
+ * and a block appended to a file is not written either when the index finds
+ * one with the same content: the file shares it through reference counts, as
+ * a clone would. A block is shared along with the rest of its chain, so the
+ * sharing lasts as long as the file's next blocks match the next blocks of the
+ * chain it joined. Writing different content to a shared block copies it
+ * first, and closing a file whose size ends before the chain it shares makes
+ * the cut in a copy of its own.
+ *
+ * The index is dropped when deduplication is disabled and by fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if the index cannot be built.
+ * 0 otherwise.
+ */
+int fs_dedup(int enable);
+
+/**
+ * struct fs_dedup_stats - Deduplication statistics
+ * @logical_blocks: Data blocks in the chains of the files, shared ones
+ * counted once per file
+ * @physical_blocks: Distinct data blocks holding them
+ * @blocks_written: Full blocks written since deduplication was enabled
+ * @writes_avoided: Among them, those found on disk and not written
+ * @blocks_copied: Shared blocks copied before being modified since
+ * deduplication was enabled
+ *
+ * The dedup ratio is @logical_blocks / @physical_blocks.
+ */
+struct fs_dedup_stats {
+	size_t logical_blocks;
+	size_t physical_blocks;
+	size_t blocks_written;
+	size_t writes_avoided;
+	size_t blocks_copied;
+};
+
+/**
+ * fs_dedup_stats - Get deduplication statistics
+ * @stats: Filled with the statistics
+ *
+ * Hidden metadata files are not counted.
+ *
+ * Return: -1 if no FS is currently mounted or if @stats is NULL. 0 otherwise.
+ */
+int fs_dedup_stats(struct fs_dedup_stats *stats);
+
+/**
+ * fs_defrag - Make file chains contiguous
+ * @budget: Maximum number of data blocks to move
+ *
+ * Relocate the data blocks of fragmented files so that each file's chain
+ * becomes a single run of consecutive blocks, moving at most @budget blocks
+ * so that it can be called repeatedly on a mounted FS. A block is first
+ * copied to its new place, then the chain is relinked to the copy, then the
+ * old block is freed, with the metadata written back in between: a crash at
+ * any point leaves every file readable.
+ *
+ * Blocks shared with a clone or a snapshot, and hidden metadata files, are
+ * left in place.
+ *
+ * Return: -1 if no FS is currently mounted, if @budget is not positive, or if
+ * nothing could be moved because of an I/O error. Otherwise return the number
+ * of blocks moved, 0 once there is nothing left to do.
+ */
+int fs_defrag(int budget);
+
+/**
+ * fs_frag_score - Measure file fragmentation
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise return the average
+ * length, in blocks, of the runs of consecutive blocks the files are made of:
+ * the higher, the better. 0 if no file has any data block.
+ */
+double fs_frag_score(void);
+
+/**
+ * fs_check - Check the consistency of the FS
+ * @repair: Non-zero to repair the problems found
+ *
+ * Walk the chain of every file, hidden metadata files and files frozen in
+ * snapshots included, once, and print each problem found: links out of the
+ * FAT or to free blocks, cycles, blocks in two chains without a reference
+ * count table to account for it, sizes that disagree with the chain length,
+ * broken packed tails, blocks in use that nothing holds and reference counts
+ * that disagree with the holders found. On large FATs, the work is split
+ * across several threads.
+ *
+ * When @repair is set, broken chains are cut after their last valid block,
+ * cross-linked chains are cut before the shared block (the first file in the
+ * root directory keeps it), sizes are truncated to what the chain holds,
+ * extra blocks and leaked blocks are freed, and reference counts are set to
+ * the number of holders found. Hidden metadata files, compressed files and
+ * snapshots are only reported.
+ *
+ * Return: -1 if no FS is currently mounted, if @repair is set while files are
+ * open, or on memory or I/O errors. Otherwise return the number of problems
+ * found, 0 if the FS is consistent.
+ */
+int fs_check(int repair);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as @src without copying
+ * any data: both files share the data blocks of @src, tracked by per-block
+ * reference counts in a hidden metadata file. A shared block is copied the
+ * first time either file writes to it.
+ *
+ * Return: -1 if @src is invalid or does not exist, if @dst cannot be created,
+ * or if there is no space left for the reference count table. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_copy - Copy a file within the file system
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst holding a copy of the content of @src. Unlike
+ * fs_clone(), both files get blocks of their own. The whole chain of @dst is
+ * allocated up front, as one run of contiguous blocks if the disk has one, and
+ * the data moves from block to block inside the virtual disk, a run of blocks
+ * adjacent on both sides at a time, without going through a user buffer.
+ *
+ * Return: -1 if @src is invalid, does not exist or is compressed, if @dst
+ * cannot be created, or if there is no space left for the copy. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst);
+
+/**
+ * fs_copy_range - Copy part of a file within the file system
+ * @src: Name of the file to copy from
+ * @dst: Name of the new file
+ * @offset: Offset in @src of the first byte to copy, a multiple of %BLOCK_SIZE
+ * @len: Number of bytes to copy
+ *
+ * Same as fs_copy(), but @dst only holds the @len bytes of @src from @offset.
+ *
+ * Return: -1 if @src is invalid, does not exist or is compressed, if @offset
+ * is not a multiple of %BLOCK_SIZE or the range goes past the end of @src, if
+ * @dst cannot be created, or if there is no space left for the copy. 0
+ * otherwise.
+ */
+int fs_copy_range(const char *src, const char *dst, size_t offset, size_t len);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Freeze the current content of every file under @name. Taking a snapshot
+ * copies the root directory into a hidden metadata file and adds a reference
+ * to every data block in use, so the blocks are only copied later, when a file
+ * modifies them. @name cannot be longer than 9 characters.
+ *
+ * Return: -1 if @name is invalid or already used, or if there is no space left
+ * for the snapshot. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Drop snapshot @name, freeing the blocks that only it was still holding.
+ *
+ * Return: -1 if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_ls - List snapshots
+ *
+ * Return: 0.
+ */
+int fs_snapshot_ls(void);
+
+/**
+ * fs_snapshot_diff - Export the difference between two snapshots
+ * @from: Name of the older snapshot, or NULL for an empty file system
+ * @to: Name of the newer snapshot, or NULL for the current state
+ * @diffname: Name of the host file to write the diff into
+ *
+ * Write into host file @diffname what fs_snapshot_apply() needs to bring an
+ * image holding the state of @from to the state of @to: the root directory and
+ * chain layout of @to, plus the content of the data blocks @from does not
+ * share with @to. The size of the diff is therefore proportional to the amount
+ * of data changed between both states.
+ *
+ * Return: -1 if a snapshot cannot be found or if @diffname cannot be written.
+ * Otherwise return the number of data blocks in the diff.
+ */
+int fs_snapshot_diff(const char *from, const char *to, const char *diffname);
+
+/**
+ * fs_snapshot_apply - Apply a diff to a replica
+ * @diffname: Name of the host file holding the diff
+ *
+ * Bring the mounted image from the state a diff was taken from to the state it
+ * leads to. The image must be a replica holding no metadata files, with no
+ * file currently open, and its files must match the starting state of the
+ * diff exactly (as built by applying the previous diffs in order, starting
+ * from a full diff on an empty image).
+ *
+ * Return: -1 if @diffname cannot be read, if it does not apply to the current
+ * state of the image, or if writing fails. 0 otherwise.
+ */
+int fs_snapshot_apply(const char *diffname);
+
 /**
  * fs_ls - List files on file system
  *
@@ -81,6 +608,62 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** Flags of fs_opendir() */
+#define FS_DIR_SORTED 0x01 /* files in name order, not directory order */
+
+/**
+ * struct fs_dirent - Directory entry returned by fs_readdir()
+ * @name: File name
+ * @size: File size in bytes
+ * @data_blk: First data block of the file, as printed by fs_ls() (65535 for
+ * an empty file)
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int data_blk;
+};
+
+/** Directory cursor, see fs_opendir() */
+struct fs_dir;
+
+/**
+ * fs_opendir - Open a cursor over the files of the root directory
+ * @prefix: Only list the files whose name starts with @prefix, NULL for all
+ * @flags: 0, or %FS_DIR_SORTED
+ *
+ * Take a snapshot of the root directory in a single pass, for fs_readdir() to
+ * return the files in batches: the name, size and first block of every file,
+ * which fs_open(), fs_stat() and fs_close() would otherwise look up one file at
+ * a time. The files are returned in directory order, the order of fs_ls(), or
+ * in name order with %FS_DIR_SORTED. Files created, deleted or written after
+ * the call do not show. Hidden metadata files are not listed.
+ *
+ * Return: NULL if no FS is currently mounted, if @flags is invalid, or if memory
+ * cannot be allocated. Otherwise return the cursor, to be released with
+ * fs_closedir().
+ */
+struct fs_dir *fs_opendir(const char *prefix, int flags);
+
+/**
+ * fs_readdir - Read the next files of a directory cursor
+ * @dir: Cursor returned by fs_opendir()
+ * @entries: Filled with the next files
+ * @count: Most entries to fill
+ *
+ * Return: -1 if @dir or @entries is NULL or @count is negative. Otherwise
+ * return the number of entries filled, 0 once every file was returned.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entries, int count);
+
+/**
+ * fs_closedir - Release a directory cursor
+ * @dir: Cursor returned by fs_opendir()
+ *
+ * Return: -1 if @dir is NULL. 0 otherwise.
+ */
+int fs_closedir(struct fs_dir *dir);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -90,12 +673,13 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. The descriptor table starts with %FS_OPEN_MAX_COUNT slots and
+ * doubles whenever it is full; all descriptors on the same file share one
+ * in-memory file object, so no directory scan is needed after opening.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the descriptor table cannot be grown. Otherwise, return the file
+ * descriptor.
  */
 int fs_open(const char *filename);
 
@@ -103,10 +687,13 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Closing the last descriptor of a file first
+ * writes the data buffered for it by fs_delalloc().
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the buffered data cannot be written: @fd then stays open and
+ * the data buffered, so that closing can be retried once blocks are freed. 0
+ * otherwise.
  */
 int fs_close(int fd);
 
@@ -151,6 +738,13 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * The file offset of the file descriptor is implicitly incremented by the
+ * number of bytes that were actually written.
+ *
+ * A file grows with the block following its last one when it is free, or in
+ * the allocation group (a range of the disk) it took when it first grew since
+ * it was opened: files growing at the same time end up in different groups,
+ * each with a contiguous run of blocks.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -177,4 +771,308 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset, which cannot be larger than the
+ * current file size, and leave the file offset of the file descriptor
+ * unchanged.
+ *
+ * fs_open(), fs_close(), fs_stat(), fs_lseek() and the read and write
+ * functions may be called from several threads at once, on the same file
+ * descriptor too: each call is atomic. The other functions must not run
+ * concurrently with any call.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is larger than the current file size. Otherwise return
+ * the number of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset and leave the file offset of the
+ * file descriptor unchanged.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() on the concatenation of the @iovcnt buffers of @iov, in
+ * array order, as a single write: the file's chain is walked once and each
+ * block written once, whatever the number of buffers it gets data from.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iov is invalid, or if the total length does not fit in an int.
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read() into the concatenation of the @iovcnt buffers of @iov, in
+ * array order, as a single read: the file's chain is walked once and each
+ * block read once, whatever the number of buffers it fills.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iov is invalid, or if the total length does not fit in an int.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_mmap - Map a file's contents in memory
+ * @fd: File descriptor
+ * @offset: File offset of the first byte to map
+ * @len: Number of bytes to map
+ * @writable: Non-zero to map the bytes for writing as well
+ *
+ * Map @len bytes of the file referenced by file descriptor @fd, from offset
+ * @offset, as one contiguous range of memory, read-only unless @writable. On
+ * disks backed by files, the data blocks of the file are mapped in place, run
+ * by run whether or not its chain is contiguous: nothing is read upfront,
+ * each page is read from the disk the first time it is accessed, and writes
+ * through a writable mapping go straight to the disk, with fs_sync() making
+ * them durable. Data written later with fs_write() shows through the mapping,
+ * unless it lands in a block shared with a clone, a snapshot or a duplicate,
+ * which the write replaces with a copy. Packed tails are copied.
+ *
+ * RAM disks and compressed files cannot be mapped in place: the mapping then
+ * holds a copy of the range, which a writable mapping writes back when it is
+ * unmapped. Compressed files can only be mapped read-only.
+ *
+ * A writable mapping first makes the blocks it covers private to the file,
+ * which cannot be cloned nor snapshotted, and whose blocks are not shared by
+ * fs_dedup(), while it exists. Like an open file descriptor, a mapping keeps
+ * the file from being deleted. It stays valid after @fd is closed, until it is
+ * given to fs_munmap().
+ *
+ * Return: NULL if @fd is invalid (out of bounds or not currently open), if
+ * @len is 0 or the range does not lie within the file, if a compressed file is
+ * mapped writable or if memory or disk space is missing. Otherwise return the
+ * address of the byte at @offset.
+ */
+void *fs_mmap(int fd, size_t offset, size_t len, int writable);
+
+/**
+ * fs_munmap - Remove a mapping
+ * @addr: Address returned by fs_mmap()
+ *
+ * Remove the mapping starting at @addr. A writable mapping holding a copy of
+ * the file writes it back first.
+ *
+ * Return: -1 if @addr was not returned by fs_mmap() or was already unmapped,
+ * or if writing back a copy fails (the mapping is removed all the same). 0
+ * otherwise.
+ */
+int fs_munmap(void *addr);
+
+/** Signature at the start of trace files, see fs_trace_start() */
+#define FS_TRACE_SIGNATURE "ECS150TR"
+
+/** Calls recorded in trace files, the values are part of the file format */
+enum {
+	FS_TRACE_MOUNT,		/* fs_mount(@name) */
+	FS_TRACE_UMOUNT,	/* fs_umount() */
+	FS_TRACE_CREATE,	/* fs_create(@name) */
+	FS_TRACE_DELETE,	/* fs_delete(@name) */
+	FS_TRACE_RENAME,	/* fs_rename(@name, @name2) */
+	FS_TRACE_OPEN,		/* fs_open(@name) */
+	FS_TRACE_CLOSE,		/* fs_close(@fd) */
+	FS_TRACE_STAT,		/* fs_stat(@fd) */
+	FS_TRACE_LSEEK,		/* fs_lseek(@fd, @offset) */
+	FS_TRACE_READ,		/* fs_read(@fd, buf, @count), from @offset */
+	FS_TRACE_WRITE,		/* fs_write(@fd, buf, @count), at @offset */
+	FS_TRACE_PREAD,		/* fs_pread(@fd, buf, @count, @offset) */
+	FS_TRACE_PWRITE,	/* fs_pwrite(@fd, buf, @count, @offset) */
+	FS_TRACE_SYNC,		/* fs_sync() */
+	FS_TRACE_BEGIN,		/* fs_begin() */
+	FS_TRACE_COMMIT,	/* fs_commit() */
+	FS_TRACE_CLONE,		/* fs_clone(@name, @name2) */
+	FS_TRACE_COPY_RANGE,	/* fs_copy_range(@name, @name2, @offset, @count) */
+	FS_TRACE_OPS		/* number of calls */
+};
+
+/**
+ * struct fs_trace_record - Call recorded in a trace file
+ * @start_ns: Time the call started, in nanoseconds since the trace started
+ * @duration_ns: Time the call took, in nanoseconds (at most UINT32_MAX)
+ * @op: One of the FS_TRACE_* calls
+ * @names_len: Number of bytes of names following the record
+ * @fd: File descriptor, -1 for the calls that take none
+ * @ret: Return value of the call
+ * @offset: File offset (at most UINT32_MAX)
+ * @count: Number of bytes (at most UINT32_MAX)
+ *
+ * Trace files hold %FS_TRACE_SIGNATURE, without its NULL character, followed
+ * by the records in the order the calls completed, in host byte order. A
+ * record is followed by the name arguments of its call, each with its NULL
+ * character. The arguments a call does not take are 0.
+ */
+struct fs_trace_record {
+	uint64_t start_ns;
+	uint32_t duration_ns;
+	uint16_t op;
+	uint16_t names_len;
+	int32_t fd;
+	int32_t ret;
+	uint32_t offset;
+	uint32_t count;
+} __attribute__((packed));
+
+/**
+ * fs_trace_start - Record the calls made to the file system
+ * @filename: Name of the trace file to write, on the host
+ *
+ * Record every call listed by the FS_TRACE_* values into @filename, created or
+ * truncated, with its arguments, its result and its timing, until
+ * fs_trace_stop(). The data read or written is not recorded. fs_readv() and
+ * fs_writev() are recorded as fs_read() and fs_write() of their total byte
+ * count, and fs_create_many(), fs_delete_many() and fs_copy() as the calls
+ * they are made of. The tuning calls (fs_durability(), fs_dedup(), ...) are
+ * not recorded, so that a trace can be replayed with any setting. Tracing can
+ * start before the FS is mounted, and go on across several mounts. Records are
+ * buffered, and only all written once tracing stops.
+ *
+ * Return: -1 if a trace is already being recorded, or if @filename cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *filename);
+
+/**
+ * fs_trace_stop - Stop recording calls
+ *
+ * Return: -1 if no trace is being recorded, or if writing the trace file
+ * failed at any point. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+/** Maximum number of worker threads of the asynchronous request pool */
+#define FS_ASYNC_MAX_WORKERS 64
+
+/** Operations of asynchronous requests */
+enum {
+	FS_OP_READ,	/* fs_pread(@fd, @buf, @count, @offset) */
+	FS_OP_WRITE,	/* fs_pwrite(@fd, @buf, @count, @offset) */
+	FS_OP_CREATE,	/* fs_create(@filename) */
+	FS_OP_DELETE,	/* fs_delete(@filename) */
+};
+
+/**
+ * struct fs_request - Asynchronous request
+ * @opcode: One of the FS_OP_* operations
+ * @fd: File descriptor, for reads and writes
+ * @buf: Data buffer, for reads and writes
+ * @count: Number of bytes to transfer, for reads and writes
+ * @offset: File offset to transfer at, for reads and writes
+ * @filename: File name, for creations and deletions
+ * @callback: Function called on completion, NULL to queue the completed
+ * request for fs_reap() instead
+ * @user_data: Left for the caller
+ * @result: Return value of the operation, set on completion
+ * @next: Private to the library
+ *
+ * A request belongs to the library from fs_submit() until it is passed to
+ * @callback or returned by fs_reap(), and must stay valid until then.
+ */
+struct fs_request {
+	int opcode;
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	const char *filename;
+	void (*callback)(struct fs_request *req);
+	void *user_data;
+	int result;
+	struct fs_request *next;
+};
+
+/**
+ * fs_async_init - Start the asynchronous request pool
+ * @workers: Number of worker threads, at most %FS_ASYNC_MAX_WORKERS
+ *
+ * Start @workers threads that run the requests passed to fs_submit(), with
+ * the synchronous functions: reads and writes run concurrently (each one
+ * being atomic), creations and deletions run alone. The pool must be stopped
+ * with fs_async_exit() before the FS is unmounted.
+ *
+ * Return: -1 if @workers is invalid, if the pool is already running, or if it
+ * cannot be started. 0 otherwise.
+ */
+int fs_async_init(int workers);
+
+/**
+ * fs_async_eventfd - Get the completion event file descriptor
+ *
+ * The returned file descriptor (see eventfd(2)), non-blocking, becomes
+ * readable whenever requests without callback complete, and reading it returns
+ * the number of such completions since the last read. It can be polled by an
+ * event loop, which then calls fs_reap().
+ *
+ * Return: -1 if the pool is not running. Otherwise return the file descriptor.
+ */
+int fs_async_eventfd(void);
+
+/**
+ * fs_submit - Submit asynchronous requests
+ * @reqs: Array of requests
+ * @nr: Number of requests in @reqs
+ *
+ * Queue the @nr requests of @reqs, which the worker threads run in submission
+ * order (several can run at the same time). On completion, the @result of a
+ * request is set, then its @callback is called from a worker thread, or, if it
+ * has none, the request is queued on the completion queue.
+ *
+ * Return: -1 if @reqs holds an invalid request, in which case none is
+ * submitted, or if the pool is not running. Otherwise return @nr.
+ */
+int fs_submit(struct fs_request **reqs, int nr);
+
+/**
+ * fs_reap - Reap completed requests
+ * @reqs: Array filled with the completed requests
+ * @max_nr: Maximum number of requests to reap
+ * @min_nr: Number of requests to wait for
+ *
+ * Take up to @max_nr requests off the completion queue, in completion order,
+ * waiting until at least @min_nr are available or no request is in flight
+ * anymore. With a @min_nr of 0, fs_reap() never blocks.
+ *
+ * Return: -1 if @reqs is NULL or if @min_nr is larger than @max_nr. Otherwise
+ * return the number of requests reaped.
+ */
+int fs_reap(struct fs_request **reqs, int max_nr, int min_nr);
+
+/**
+ * fs_async_exit - Stop the asynchronous request pool
+ *
+ * Wait for every submitted request to complete, then stop the worker threads
+ * and close the completion event file descriptor. Completed requests that were
+ * not reaped are dropped.
+ *
+ * Return: -1 if the pool is not running. 0 otherwise.
+ */
+int fs_async_exit(void);
+
 #endif /* _FS_H */
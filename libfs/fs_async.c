@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+// Requests run on a pool of worker threads, through the synchronous calls
+
+struct AsyncPool {
+	pthread_t workers[FS_ASYNC_MAX_WORKERS];
+	int workers_num; // 0 when the pool is not running
+	pthread_mutex_t lock; // protects everything below
+	pthread_cond_t submitted; // the submission queue got requests, or the pool stops
+	pthread_cond_t completed; // a request completed
+	struct fs_request *sq_head, *sq_tail; // submitted, not yet taken by a worker
+	struct fs_request *cq_head, *cq_tail; // completed without callback, not yet reaped
+	int inflight; // submitted and not yet completed
+	int stopping; // workers exit once the submission queue is empty
+	int eventfd; // counts completions queued on the completion queue
+	// reads and writes are thread-safe on their own, but creating or
+	// deleting a file must not overlap any other request
+	pthread_rwlock_t files_lock;
+};
+
+struct AsyncPool async_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.submitted = PTHREAD_COND_INITIALIZER,
+	.completed = PTHREAD_COND_INITIALIZER,
+	.eventfd = -1,
+	.files_lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static void async_execute(struct fs_request *req)
+{
+	switch (req->opcode) {
+	case FS_OP_READ:
+		pthread_rwlock_rdlock(&async_pool.files_lock);
+		req->result = fs_pread(req->fd, req->buf, req->count, req->offset);
+		break;
+	case FS_OP_WRITE:
+		pthread_rwlock_rdlock(&async_pool.files_lock);
+		req->result = fs_pwrite(req->fd, req->buf, req->count, req->offset);
+		break;
+	case FS_OP_CREATE:
+		pthread_rwlock_wrlock(&async_pool.files_lock);
+		req->result = fs_create(req->filename);
+		break;
+	default: // FS_OP_DELETE, opcodes are checked at submission
+		pthread_rwlock_wrlock(&async_pool.files_lock);
+		req->result = fs_delete(req->filename);
+		break;
+	}
+	pthread_rwlock_unlock(&async_pool.files_lock);
+}
+
+static void *async_worker(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&async_pool.lock);
+		while (async_pool.sq_head == NULL && !async_pool.stopping)
+			pthread_cond_wait(&async_pool.submitted, &async_pool.lock);
+		struct fs_request *req = async_pool.sq_head;
+		if (req == NULL) {
+			// stopping, and nothing left to do
+			pthread_mutex_unlock(&async_pool.lock);
+			return NULL;
+		}
+		async_pool.sq_head = req->next;
+		if (async_pool.sq_head == NULL)
+			async_pool.sq_tail = NULL;
+		pthread_mutex_unlock(&async_pool.lock);
+
+		async_execute(req);
+		// once passed to its callback, the request belongs to the caller
+		// again: it may be freed or reused, do not look at it afterwards
+		int queued = req->callback == NULL;
+		if (!queued)
+			req->callback(req);
+
+		pthread_mutex_lock(&async_pool.lock);
+		if (queued) {
+			req->next = NULL;
+			if (async_pool.cq_tail == NULL)
+				async_pool.cq_head = req;
+			else
+				async_pool.cq_tail->next = req;
+			async_pool.cq_tail = req;
+		}
+		async_pool.inflight--;
+		pthread_cond_broadcast(&async_pool.completed);
+		pthread_mutex_unlock(&async_pool.lock);
+		if (queued) {
+			// a saturated counter stays readable, no wakeup is lost
+			uint64_t one = 1;
+			ssize_t ret = write(async_pool.eventfd, &one, sizeof(one));
+			(void)ret;
+		}
+	}
+}
+
+int fs_async_init(int workers)
+{
+	if (workers <= 0 || workers > FS_ASYNC_MAX_WORKERS)
+		return -1;
+	pthread_mutex_lock(&async_pool.lock);
+	if (async_pool.workers_num > 0) {
+		pthread_mutex_unlock(&async_pool.lock);
+		return -1; // already running
+	}
+	async_pool.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (async_pool.eventfd == -1) {
+		pthread_mutex_unlock(&async_pool.lock);
+		return -1;
+	}
+	async_pool.stopping = 0;
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(&async_pool.workers[i], NULL, async_worker, NULL) != 0)
+			break;
+		async_pool.workers_num++;
+	}
+	int ret = async_pool.workers_num > 0 ? 0 : -1;
+	if (ret == -1) {
+		close(async_pool.eventfd);
+		async_pool.eventfd = -1;
+	}
+	pthread_mutex_unlock(&async_pool.lock);
+	return ret;
+}
+
+int fs_async_eventfd(void)
+{
+	return async_pool.eventfd;
+}
+
+int fs_submit(struct fs_request **reqs, int nr)
+{
+	if (reqs == NULL || nr < 0)
+		return -1;
+	for (int i = 0; i < nr; i++) {
+		if (reqs[i] == NULL || reqs[i]->opcode < FS_OP_READ || reqs[i]->opcode > FS_OP_DELETE)
+			return -1;
+	}
+	pthread_mutex_lock(&async_pool.lock);
+	if (async_pool.workers_num == 0 || async_pool.stopping) {
+		pthread_mutex_unlock(&async_pool.lock);
+		return -1; // no pool to run the requests
+	}
+	for (int i = 0; i < nr; i++) {
+		reqs[i]->next = NULL;
+		if (async_pool.sq_tail == NULL)
+			async_pool.sq_head = reqs[i];
+		else
+			async_pool.sq_tail->next = reqs[i];
+		async_pool.sq_tail = reqs[i];
+	}
+	async_pool.inflight += nr;
+	pthread_cond_broadcast(&async_pool.submitted);
+	pthread_mutex_unlock(&async_pool.lock);
+	return nr;
+}
+
+int fs_reap(struct fs_request **reqs, int max_nr, int min_nr)
+{
+	if (reqs == NULL || max_nr < 0 || min_nr > max_nr)
+		return -1;
+	pthread_mutex_lock(&async_pool.lock);
+	int reaped = 0;
+	while (reaped < max_nr) {
+		if (async_pool.cq_head != NULL) {
+			reqs[reaped++] = async_pool.cq_head;
+			async_pool.cq_head = async_pool.cq_head->next;
+			if (async_pool.cq_head == NULL)
+				async_pool.cq_tail = NULL;
+			continue;
+		}
+		if (reaped >= min_nr || async_pool.inflight == 0)
+			break; // enough, or nothing more can complete
+		pthread_cond_wait(&async_pool.completed, &async_pool.lock);
+	}
+	pthread_mutex_unlock(&async_pool.lock);
+	return reaped;
+}
+
+int fs_async_exit(void)
+{
+	pthread_mutex_lock(&async_pool.lock);
+	if (async_pool.workers_num == 0) {
+		pthread_mutex_unlock(&async_pool.lock);
+		return -1; // not running
+	}
+	// workers drain the submission queue before they exit
+	async_pool.stopping = 1;
+	pthread_cond_broadcast(&async_pool.submitted);
+	pthread_mutex_unlock(&async_pool.lock);
+	for (int i = 0; i < async_pool.workers_num; i++)
+		pthread_join(async_pool.workers[i], NULL);
+
+	pthread_mutex_lock(&async_pool.lock);
+	async_pool.workers_num = 0;
+	async_pool.cq_head = NULL; // completions never reaped are dropped
+	async_pool.cq_tail = NULL;
+	close(async_pool.eventfd);
+	async_pool.eventfd = -1;
+	pthread_mutex_unlock(&async_pool.lock);
+	return 0;
+}
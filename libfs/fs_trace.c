@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_trace.h"
+
+// Records are gathered in a buffer of this many bytes, written out when full
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+struct Trace {
+	int on; // set while recording, read without the lock by trace_begin()
+	pthread_mutex_t lock; // protects everything below
+	int fd; // trace file
+	uint64_t origin; // time the trace started
+	uint8_t *buf;
+	size_t len; // bytes of @buf not yet written out
+	int error; // writing the trace file failed
+};
+
+struct Trace trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t trace_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void trace_write_out(void)
+{
+	// write out the buffered records, the lock held
+	size_t done = 0;
+	while (done < trace.len && !trace.error) {
+		ssize_t ret = write(trace.fd, trace.buf + done, trace.len - done);
+		if (ret <= 0)
+			trace.error = 1;
+		else
+			done += ret;
+	}
+	trace.len = 0;
+}
+
+uint64_t trace_begin(void)
+{
+	if (!__atomic_load_n(&trace.on, __ATOMIC_RELAXED))
+		return 0;
+	return trace_now();
+}
+
+void trace_end(uint64_t start, int op, int fd, size_t offset, size_t count,
+	       int ret, const char *name, const char *name2)
+{
+	if (start == 0)
+		return;
+	uint64_t end = trace_now();
+	size_t name_len = name != NULL ? strlen(name) + 1 : 0;
+	size_t name2_len = name2 != NULL ? strlen(name2) + 1 : 0;
+	if (name_len + name2_len > TRACE_BUFFER_SIZE - sizeof(struct fs_trace_record))
+		name_len = name2_len = 0; // too long to be valid anyway, drop them
+	struct fs_trace_record rec = {
+		.duration_ns = end - start > UINT32_MAX ? UINT32_MAX : end - start,
+		.op = op,
+		.names_len = name_len + name2_len,
+		.fd = fd,
+		.ret = ret,
+		.offset = offset > UINT32_MAX ? UINT32_MAX : offset,
+		.count = count > UINT32_MAX ? UINT32_MAX : count,
+	};
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.on) {
+		// a call that began before the trace was restarted starts with it
+		rec.start_ns = start > trace.origin ? start - trace.origin : 0;
+		if (trace.len + sizeof(rec) + rec.names_len > TRACE_BUFFER_SIZE)
+			trace_write_out();
+		memcpy(trace.buf + trace.len, &rec, sizeof(rec));
+		trace.len += sizeof(rec);
+		if (name_len > 0)
+			memcpy(trace.buf + trace.len, name, name_len);
+		trace.len += name_len;
+		if (name2_len > 0)
+			memcpy(trace.buf + trace.len, name2, name2_len);
+		trace.len += name2_len;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+int fs_trace_start(const char *filename)
+{
+	if (filename == NULL)
+		return -1;
+	int ret = -1;
+	pthread_mutex_lock(&trace.lock);
+	if (trace.on)
+		goto out; // a trace is already being recorded
+	trace.buf = malloc(TRACE_BUFFER_SIZE);
+	if (trace.buf == NULL)
+		goto out;
+	trace.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace.fd == -1) {
+		free(trace.buf);
+		trace.buf = NULL;
+		goto out;
+	}
+	memcpy(trace.buf, FS_TRACE_SIGNATURE, strlen(FS_TRACE_SIGNATURE));
+	trace.len = strlen(FS_TRACE_SIGNATURE);
+	trace.error = 0;
+	trace.origin = trace_now();
+	__atomic_store_n(&trace.on, 1, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&trace.lock);
+	return ret;
+}
+
+int fs_trace_stop(void)
+{
+	pthread_mutex_lock(&trace.lock);
+	if (!trace.on) {
+		pthread_mutex_unlock(&trace.lock);
+		return -1; // no trace is being recorded
+	}
+	__atomic_store_n(&trace.on, 0, __ATOMIC_RELAXED);
+	trace_write_out();
+	if (close(trace.fd) == -1)
+		trace.error = 1;
+	trace.fd = -1;
+	free(trace.buf);
+	trace.buf = NULL;
+	int ret = trace.error ? -1 : 0;
+	pthread_mutex_unlock(&trace.lock);
+	return ret;
+}
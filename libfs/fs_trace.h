@@ -0,0 +1,31 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * trace_begin - Start timing a call to record
+ *
+ * Return: 0 if no trace is being recorded. Otherwise return the current time,
+ * to be passed to trace_end() once the call is done.
+ */
+uint64_t trace_begin(void);
+
+/**
+ * trace_end - Record a call in the trace
+ * @start: Return value of trace_begin(), nothing is recorded if 0
+ * @op: One of the FS_TRACE_* calls
+ * @fd: File descriptor, -1 for the calls that take none
+ * @offset: File offset
+ * @count: Number of bytes
+ * @ret: Return value of the call
+ * @name: First name argument, NULL for none
+ * @name2: Second name argument, NULL for none
+ *
+ * Offsets and counts larger than UINT32_MAX are recorded as UINT32_MAX.
+ */
+void trace_end(uint64_t start, int op, int fd, size_t offset, size_t count,
+	       int ret, const char *name, const char *name2);
+
+#endif /* _FS_TRACE_H */
@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+/* Format constants, see the LZ4 block format description */
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define MAX_DISTANCE 65535
+
+/* Match finder: one candidate position per hash of 4 bytes */
+#define HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Write the extra bytes of a length that did not fit in its token nibble */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, int len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Emit one sequence: literals, then a match (none if @match_len is 0) */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     int lit_len, int offset, int match_len)
+{
+	uint8_t *token = op++;
+	if (token >= oend)
+		return NULL;
+
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15)))
+		return NULL;
+	if (op + lit_len > oend)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+	if (op + 2 > oend)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match_len -= MINMATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15 && !(op = put_length(op, oend, match_len - 15)))
+		return NULL;
+	return op;
+}
+
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+	int32_t table[1 << HASH_LOG];
+	uint8_t *op = dst, *oend = dst + dst_cap;
+	int ip = 0, anchor = 0;
+
+	for (int i = 0; i < (1 << HASH_LOG); i++)
+		table[i] = -1;
+
+	/* Greedy parse, matches cannot start in the last MFLIMIT bytes */
+	while (src_len > MFLIMIT && ip < src_len - MFLIMIT) {
+		uint32_t v = read32(src + ip);
+		uint32_t h = hash32(v);
+		int ref = table[h];
+		table[h] = ip;
+
+		if (ref < 0 || ip - ref > MAX_DISTANCE || read32(src + ref) != v) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match, leaving the last literals alone */
+		int match_len = MINMATCH;
+		while (ip + match_len < src_len - LASTLITERALS &&
+		       src[ref + match_len] == src[ip + match_len])
+			match_len++;
+
+		op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref,
+				  match_len);
+		if (!op)
+			return 0;
+		ip += match_len;
+		anchor = ip;
+	}
+
+	/* Last sequence holds the remaining literals only */
+	op = put_sequence(op, oend, src + anchor, src_len - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - dst;
+}
+
+/* Read a length continued over extra bytes, -1 if @src runs out */
+static int get_length(const uint8_t *src, int src_len, int *ip)
+{
+	int len = 0;
+	uint8_t b;
+
+	do {
+		if (*ip >= src_len)
+			return -1;
+		b = src[(*ip)++];
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+	int ip = 0, op = 0;
+
+	while (ip < src_len) {
+		uint8_t token = src[ip++];
+		int len = token >> 4;
+
+		/* Literals */
+		if (len == 15) {
+			int extra = get_length(src, src_len, &ip);
+			if (extra < 0)
+				return -1;
+			len += extra;
+		}
+		if (len > src_len - ip || len > dst_cap - op)
+			return -1;
+		memcpy(dst + op, src + ip, len);
+		ip += len;
+		op += len;
+
+		/* The last sequence has no match */
+		if (ip == src_len)
+			break;
+
+		/* Match */
+		if (src_len - ip < 2)
+			return -1;
+		int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+		len = token & 15;
+		if (len == 15) {
+			int extra = get_length(src, src_len, &ip);
+			if (extra < 0)
+				return -1;
+			len += extra;
+		}
+		len += MINMATCH;
+		if (len > dst_cap - op)
+			return -1;
+		/* Byte by byte: the match may overlap what it produces */
+		for (int i = 0; i < len; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+	return op;
+}
@@ -0,0 +1,36 @@
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include <stdint.h>
+
+/**
+ * lz4_compress - Compress a buffer in the LZ4 block format
+ * @src: Data to compress
+ * @src_len: Number of bytes in @src (at most 65536)
+ * @dst: Buffer receiving the compressed data
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Compress @src_len bytes from @src into @dst as a single, independently
+ * decodable LZ4 block (no frame header).
+ *
+ * Return: 0 if the compressed data does not fit in @dst_cap bytes. Otherwise
+ * return the compressed length.
+ */
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+
+/**
+ * lz4_decompress - Decompress an LZ4 block
+ * @src: Compressed data
+ * @src_len: Number of bytes in @src
+ * @dst: Buffer receiving the decompressed data
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Decode the LZ4 block in @src into @dst, never reading or writing out of the
+ * given bounds, whatever the content of @src.
+ *
+ * Return: -1 if @src is malformed or does not fit in @dst_cap bytes. Otherwise
+ * return the decompressed length.
+ */
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+
+#endif /* _LZ4_H */
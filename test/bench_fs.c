@@ -0,0 +1,932 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Number of random reads per measurement */
+#define RANDOM_READS 1000
+
+/* Size of the file and number of calls of each kind in the alloc benchmark */
+#define ALLOC_FILE_BLOCKS 64
+#define ALLOC_ROUNDS 10000
+
+/* Size of each read, and passes over the file, in the stream benchmark */
+#define STREAM_READ_SIZE (256 * 1024)
+#define STREAM_ROUNDS 8
+
+/* Writer threads, and blocks written by each, in the durability and append
+ * benchmarks */
+#define DURABLE_WRITERS 4
+#define DURABLE_WRITES 256
+
+/* Blocks appended one at a time, and age limit of the cache, in the writeback
+ * benchmark */
+#define WRITEBACK_WRITES 2048
+#define WRITEBACK_EXPIRE_MS 30
+
+/* Files appended to in turn, size and number of pieces appended to each, in
+ * the delalloc benchmark */
+#define DELALLOC_FILES 32
+#define DELALLOC_PIECE 1000
+#define DELALLOC_PIECES 128
+
+/* Size of the file, staging buffer and copies made in the copy benchmark */
+#define COPY_FILE_BLOCKS 1024
+#define COPY_BUF_SIZE (64 * 1024)
+#define COPY_ROUNDS 8
+
+/* Files listed, batch size and sweeps over them in the readdir benchmark */
+#define READDIR_FILES 100
+#define READDIR_BATCH 16
+#define READDIR_ROUNDS 1000
+
+/* Size of the file, and block reads of it with and without a trace being
+ * recorded, in the trace benchmark */
+#define TRACE_FILE_BLOCKS 64
+#define TRACE_READS 100000
+
+/* Size of the file, and passes writing then reading it, in the checksum
+ * benchmark */
+#define CSUM_FILE_BLOCKS 1024
+#define CSUM_ROUNDS 8
+
+/*
+ * bench_fs.x is linked with --wrap for the allocator entry points and for
+ * fdatasync(), so every heap allocation and every flush made by the library
+ * (or by this program) is counted.
+ */
+static size_t heap_allocs;
+static size_t flushes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	heap_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	heap_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	heap_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	heap_allocs++;
+	return __real_posix_memalign(memptr, alignment, size);
+}
+
+int __real_fdatasync(int fd);
+
+int __wrap_fdatasync(int fd)
+{
+	__atomic_fetch_add(&flushes, 1, __ATOMIC_RELAXED);
+	return __real_fdatasync(fd);
+}
+
+struct bench_arg {
+	int argc;
+	char **argv;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Map a host file into memory, return its size */
+static size_t map_host_file(const char *filename, char **buf)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	*buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*buf == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+	return st.st_size;
+}
+
+/* Write @size bytes of @buf into new file @filename, in blocks */
+static void write_file(const char *filename, const char *buf, size_t size,
+		       int compressed)
+{
+	size_t off;
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create file");
+	if (compressed && fs_compress(filename))
+		die("Cannot compress file");
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file");
+	for (off = 0; off < size; off += BLOCK_SIZE) {
+		size_t len = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+		if (fs_lseek(fd, off) || fs_write(fd, (void *)(buf + off), len) != len)
+			die("Cannot write file");
+	}
+	fs_close(fd);
+}
+
+/* Read file @filename sequentially then randomly, print the throughputs */
+static void read_file(const char *label, const char *filename, size_t size)
+{
+	char block[BLOCK_SIZE];
+	double start, seq, rnd;
+	size_t off;
+	int fd, i;
+
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now();
+	for (off = 0; off < size; off += BLOCK_SIZE) {
+		if (fs_lseek(fd, off) || fs_read(fd, block, BLOCK_SIZE) <= 0)
+			die("Cannot read file");
+	}
+	seq = now() - start;
+
+	srand(1);
+	start = now();
+	for (i = 0; i < RANDOM_READS; i++) {
+		off = (size_t)rand() % size;
+		if (fs_lseek(fd, off) || fs_read(fd, block, BLOCK_SIZE) <= 0)
+			die("Cannot read file");
+	}
+	rnd = now() - start;
+
+	fs_close(fd);
+	printf("%s: sequential %.1f MB/s, random %.0f reads/s\n", label,
+	       size / seq / 1e6, RANDOM_READS / rnd);
+}
+
+void bench_compress(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	char *diskname, *buf;
+	int free_start, plain_blocks, packed_blocks;
+	size_t size;
+
+	if (b_arg->argc < 2)
+		die("need <diskname> <host filename>");
+
+	diskname = b_arg->argv[0];
+	size = map_host_file(b_arg->argv[1], &buf);
+	if (!size)
+		die("Empty host file");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	free_start = fs_free_count();
+	write_file("bench_plain", buf, size, 0);
+	plain_blocks = free_start - fs_free_count();
+	free_start = fs_free_count();
+	write_file("bench_packed", buf, size, 1);
+	packed_blocks = free_start - fs_free_count();
+
+	printf("size: %zu bytes\n", size);
+	printf("plain: %d blocks\n", plain_blocks);
+	printf("compressed: %d blocks (%.1f%% saved)\n", packed_blocks,
+	       100.0 * (plain_blocks - packed_blocks) / plain_blocks);
+	read_file("plain", "bench_plain", size);
+	read_file("compressed", "bench_packed", size);
+
+	fs_delete("bench_plain");
+	fs_delete("bench_packed");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	munmap(buf, size);
+}
+
+void bench_stream(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	char *diskname, *buf, *dst;
+	double start, elapsed;
+	size_t size, off;
+	int fd, i;
+
+	if (b_arg->argc < 2)
+		die("need <diskname> <host filename>");
+
+	diskname = b_arg->argv[0];
+	size = map_host_file(b_arg->argv[1], &buf);
+	if (!size)
+		die("Empty host file");
+	dst = malloc(STREAM_READ_SIZE);
+	if (!dst)
+		die_perror("malloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	write_file("bench_stream", buf, size, 0);
+
+	fd = fs_open("bench_stream");
+	if (fd < 0)
+		die("Cannot open file");
+	start = now();
+	for (i = 0; i < STREAM_ROUNDS; i++) {
+		for (off = 0; off < size; off += STREAM_READ_SIZE) {
+			size_t len = size - off < STREAM_READ_SIZE ? size - off : STREAM_READ_SIZE;
+			if (fs_pread(fd, dst, len, off) != len ||
+			    memcmp(dst, buf + off, len))
+				die("Cannot read file");
+		}
+	}
+	elapsed = now() - start;
+	fs_close(fd);
+
+	printf("size: %zu bytes, %d KiB reads\n", size, STREAM_READ_SIZE / 1024);
+	printf("sequential: %.1f MB/s\n", size * STREAM_ROUNDS / elapsed / 1e6);
+
+	fs_delete("bench_stream");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(dst);
+	munmap(buf, size);
+}
+
+/* Run one round of every kind of read and write on @fd, return the calls made */
+static int alloc_round(int fd, char *buf, size_t size)
+{
+	struct iovec iov[3] = {
+		{ buf, 100 },
+		{ buf + 100, BLOCK_SIZE },
+		{ buf + 100 + BLOCK_SIZE, 1000 },
+	};
+	size_t off = (size_t)rand() % (size - 2 * BLOCK_SIZE);
+	size_t blk_off = off / BLOCK_SIZE * BLOCK_SIZE;
+
+	if (fs_pread(fd, buf, BLOCK_SIZE, blk_off) != BLOCK_SIZE)
+		die("Cannot pread");
+	if (fs_pwrite(fd, buf, BLOCK_SIZE, blk_off) != BLOCK_SIZE)
+		die("Cannot pwrite");
+	if (fs_pwrite(fd, buf, 100, off) != 100)
+		die("Cannot pwrite");
+	if (fs_lseek(fd, off) || fs_read(fd, buf, 300) != 300)
+		die("Cannot read");
+	if (fs_lseek(fd, off) || fs_write(fd, buf, 300) != 300)
+		die("Cannot write");
+	if (fs_lseek(fd, off) || fs_readv(fd, iov, 3) != 1100 + BLOCK_SIZE)
+		die("Cannot readv");
+	if (fs_lseek(fd, off) || fs_writev(fd, iov, 3) != 1100 + BLOCK_SIZE)
+		die("Cannot writev");
+	return 7;
+}
+
+void bench_alloc(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	char buf[3 * BLOCK_SIZE];
+	size_t size = ALLOC_FILE_BLOCKS * BLOCK_SIZE;
+	size_t allocs;
+	double start, elapsed;
+	int fd, i, calls = 0;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	memset(buf, 'a', sizeof(buf));
+	if (fs_create("bench_alloc"))
+		die("Cannot create file");
+	fd = fs_open("bench_alloc");
+	if (fd < 0)
+		die("Cannot open file");
+	for (i = 0; i < ALLOC_FILE_BLOCKS; i++) {
+		if (fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot write file");
+	}
+
+	/* Steady state: the file is open and fully allocated */
+	srand(1);
+	alloc_round(fd, buf, size);
+	heap_allocs = 0;
+	start = now();
+	for (i = 0; i < ALLOC_ROUNDS; i++)
+		calls += alloc_round(fd, buf, size);
+	elapsed = now() - start;
+	allocs = heap_allocs;
+
+	fs_close(fd);
+	fs_delete("bench_alloc");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("calls: %d, %.0f calls/s\n", calls, calls / elapsed);
+	printf("heap allocations: %zu\n", allocs);
+	if (allocs)
+		die("The read and write paths allocate");
+}
+
+struct durable_writer {
+	int fd;
+	int sync_each; /* call fs_sync() after every write */
+};
+
+static void *durable_write(void *arg)
+{
+	struct durable_writer *w = arg;
+	char block[BLOCK_SIZE];
+	int i;
+
+	memset(block, 'd', sizeof(block));
+	for (i = 0; i < DURABLE_WRITES; i++) {
+		if (fs_pwrite(w->fd, block, BLOCK_SIZE, (size_t)i * BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot write file");
+		if (w->sync_each && fs_sync())
+			die("Cannot sync");
+	}
+	return NULL;
+}
+
+void bench_durability(void *arg)
+{
+	static const struct {
+		const char *label;
+		int mode;
+		unsigned int interval_ms;
+		size_t interval_bytes;
+		int sync_each;
+		const char *at_risk;
+	} policies[] = {
+		{ "none",		FS_DURABLE_NONE, 0, 0, 0,	"everything" },
+		{ "umount",		FS_DURABLE_UMOUNT, 0, 0, 0,	"since mount" },
+		{ "sync each write",	FS_DURABLE_SYNC, 0, 0, 1,	"nothing" },
+		{ "group 10 ms",	FS_DURABLE_GROUP, 10, 0, 0,	"last 10 ms" },
+		{ "group 256 KiB",	FS_DURABLE_GROUP, 0, 256 * 1024, 0,	"last 256 KiB" },
+	};
+	struct bench_arg *b_arg = arg;
+	struct durable_writer writers[DURABLE_WRITERS];
+	pthread_t threads[DURABLE_WRITERS];
+	char filename[FS_FILENAME_LEN];
+	double start, elapsed;
+	size_t p, i;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	for (p = 0; p < ARRAY_SIZE(policies); p++) {
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (fs_durability(policies[p].mode, policies[p].interval_ms,
+				  policies[p].interval_bytes))
+			die("Cannot set durability");
+		for (i = 0; i < DURABLE_WRITERS; i++) {
+			snprintf(filename, sizeof(filename), "durable%zu", i);
+			if (fs_create(filename))
+				die("Cannot create file");
+			writers[i].fd = fs_open(filename);
+			if (writers[i].fd < 0)
+				die("Cannot open file");
+			writers[i].sync_each = policies[p].sync_each;
+		}
+
+		/* Time the writes up to the unmount, which flushes what is left */
+		flushes = 0;
+		start = now();
+		for (i = 0; i < DURABLE_WRITERS; i++)
+			pthread_create(&threads[i], NULL, durable_write, &writers[i]);
+		for (i = 0; i < DURABLE_WRITERS; i++)
+			pthread_join(threads[i], NULL);
+		for (i = 0; i < DURABLE_WRITERS; i++)
+			fs_close(writers[i].fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		elapsed = now() - start;
+
+		printf("%s: %.1f MB/s, %zu flushes, lost on crash: %s\n",
+		       policies[p].label,
+		       DURABLE_WRITERS * DURABLE_WRITES * BLOCK_SIZE / elapsed / 1e6,
+		       flushes, policies[p].at_risk);
+
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		for (i = 0; i < DURABLE_WRITERS; i++) {
+			snprintf(filename, sizeof(filename), "durable%zu", i);
+			fs_delete(filename);
+		}
+		fs_durability(FS_DURABLE_NONE, 0, 0);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+}
+
+void bench_append(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	struct durable_writer writers[DURABLE_WRITERS];
+	pthread_t threads[DURABLE_WRITERS];
+	char filename[FS_FILENAME_LEN];
+	double start, elapsed, score;
+	size_t i;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+	for (i = 0; i < DURABLE_WRITERS; i++) {
+		snprintf(filename, sizeof(filename), "append%zu", i);
+		if (fs_create(filename))
+			die("Cannot create file");
+		writers[i].fd = fs_open(filename);
+		if (writers[i].fd < 0)
+			die("Cannot open file");
+		writers[i].sync_each = 0;
+	}
+
+	/* Every writer appends to its own file at the same time */
+	start = now();
+	for (i = 0; i < DURABLE_WRITERS; i++)
+		pthread_create(&threads[i], NULL, durable_write, &writers[i]);
+	for (i = 0; i < DURABLE_WRITERS; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+	for (i = 0; i < DURABLE_WRITERS; i++)
+		fs_close(writers[i].fd);
+	score = fs_frag_score();
+
+	printf("%d appenders: %.1f MB/s, fragmentation score %.2f (%d blocks each)\n",
+	       DURABLE_WRITERS,
+	       DURABLE_WRITERS * DURABLE_WRITES * BLOCK_SIZE / elapsed / 1e6,
+	       score, DURABLE_WRITES);
+
+	for (i = 0; i < DURABLE_WRITERS; i++) {
+		snprintf(filename, sizeof(filename), "append%zu", i);
+		fs_delete(filename);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void bench_writeback(void *arg)
+{
+	static const size_t caches[] = { 0, 64, 1024 };
+	struct bench_arg *b_arg = arg;
+	char block[BLOCK_SIZE];
+	double start, t, worst, total, unmount;
+	size_t c;
+	int fd, i;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	memset(block, 'w', sizeof(block));
+	for (c = 0; c < ARRAY_SIZE(caches); c++) {
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (fs_durability(FS_DURABLE_UMOUNT, 0, 0))
+			die("Cannot set durability");
+		if (caches[c] && fs_writeback(caches[c], WRITEBACK_EXPIRE_MS))
+			die("Cannot enable write-back");
+		if (fs_create("ingest"))
+			die("Cannot create file");
+		fd = fs_open("ingest");
+		if (fd < 0)
+			die("Cannot open file");
+
+		/* Latency of each append, then what is left at the unmount */
+		worst = total = 0;
+		for (i = 0; i < WRITEBACK_WRITES; i++) {
+			start = now();
+			if (fs_write(fd, block, BLOCK_SIZE) != BLOCK_SIZE)
+				die("Cannot write file");
+			t = now() - start;
+			total += t;
+			if (t > worst)
+				worst = t;
+		}
+		fs_close(fd);
+		start = now();
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		unmount = now() - start;
+
+		printf("cache %zu blocks: %.1f us/write, worst %.1f us, unmount %.1f ms\n",
+		       caches[c], total / WRITEBACK_WRITES * 1e6, worst * 1e6,
+		       unmount * 1e3);
+
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		fs_delete("ingest");
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+}
+
+void bench_delalloc(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	char piece[DELALLOC_PIECE];
+	char filename[FS_FILENAME_LEN];
+	int fds[DELALLOC_FILES];
+	double start, elapsed, score;
+	int delayed, i, f;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	memset(piece, 'd', sizeof(piece));
+	for (delayed = 0; delayed <= 1; delayed++) {
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (delayed && fs_delalloc(1))
+			die("Cannot enable delayed allocation");
+		for (f = 0; f < DELALLOC_FILES; f++) {
+			snprintf(filename, sizeof(filename), "log%d", f);
+			if (fs_create(filename))
+				die("Cannot create file");
+			fds[f] = fs_open(filename);
+			if (fds[f] < 0)
+				die("Cannot open file");
+		}
+
+		/* Small appends to every file in turn, up to the last close */
+		start = now();
+		for (i = 0; i < DELALLOC_PIECES; i++) {
+			for (f = 0; f < DELALLOC_FILES; f++) {
+				if (fs_write(fds[f], piece, DELALLOC_PIECE) != DELALLOC_PIECE)
+					die("Cannot write file");
+			}
+		}
+		for (f = 0; f < DELALLOC_FILES; f++)
+			fs_close(fds[f]);
+		elapsed = now() - start;
+		score = fs_frag_score();
+
+		printf("delayed allocation %s: %.1f MB/s, fragmentation score %.2f\n",
+		       delayed ? "on" : "off",
+		       (double)DELALLOC_FILES * DELALLOC_PIECES * DELALLOC_PIECE / elapsed / 1e6,
+		       score);
+
+		for (f = 0; f < DELALLOC_FILES; f++) {
+			snprintf(filename, sizeof(filename), "log%d", f);
+			fs_delete(filename);
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+}
+
+void bench_copy(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	static char buf[COPY_BUF_SIZE];
+	double start, staged, copied;
+	int fd, src_fd, dst_fd, i, ret;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+	if (fs_create("src"))
+		die("Cannot create file");
+	fd = fs_open("src");
+	if (fd < 0)
+		die("Cannot open file");
+	memset(buf, 'c', sizeof(buf));
+	for (i = 0; i < COPY_FILE_BLOCKS * BLOCK_SIZE / COPY_BUF_SIZE; i++) {
+		if (fs_write(fd, buf, COPY_BUF_SIZE) != COPY_BUF_SIZE)
+			die("Cannot write file");
+	}
+	fs_close(fd);
+
+	/* Through a user buffer, then from block to block */
+	start = now();
+	for (i = 0; i < COPY_ROUNDS; i++) {
+		if (fs_create("dst"))
+			die("Cannot create file");
+		src_fd = fs_open("src");
+		dst_fd = fs_open("dst");
+		while ((ret = fs_read(src_fd, buf, COPY_BUF_SIZE)) > 0) {
+			if (fs_write(dst_fd, buf, ret) != ret)
+				die("Cannot write file");
+		}
+		fs_close(src_fd);
+		fs_close(dst_fd);
+		fs_delete("dst");
+	}
+	staged = now() - start;
+
+	start = now();
+	for (i = 0; i < COPY_ROUNDS; i++) {
+		if (fs_copy("src", "dst"))
+			die("Cannot copy file");
+		fs_delete("dst");
+	}
+	copied = now() - start;
+
+	printf("read/write: %.1f MB/s\n",
+	       (double)COPY_ROUNDS * COPY_FILE_BLOCKS * BLOCK_SIZE / staged / 1e6);
+	printf("fs_copy: %.1f MB/s\n",
+	       (double)COPY_ROUNDS * COPY_FILE_BLOCKS * BLOCK_SIZE / copied / 1e6);
+
+	fs_delete("src");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void bench_readdir(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	struct fs_dirent entries[READDIR_BATCH];
+	char filename[FS_FILENAME_LEN];
+	struct fs_dir *dir;
+	double start, stat_time, readdir_time;
+	size_t total, expected = 0;
+	int i, r, n, fd;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+	for (i = 0; i < READDIR_FILES; i++) {
+		snprintf(filename, sizeof(filename), "inv%d", i);
+		if (fs_create(filename))
+			die("Cannot create file");
+		fd = fs_open(filename);
+		if (fd < 0 || fs_write(fd, filename, strlen(filename)) < 0)
+			die("Cannot write file");
+		expected += strlen(filename);
+		fs_close(fd);
+	}
+
+	/* Total size of the files, one lookup per file, then in one pass */
+	start = now();
+	for (r = 0; r < READDIR_ROUNDS; r++) {
+		total = 0;
+		for (i = 0; i < READDIR_FILES; i++) {
+			snprintf(filename, sizeof(filename), "inv%d", i);
+			fd = fs_open(filename);
+			total += fs_stat(fd);
+			fs_close(fd);
+		}
+		if (total != expected)
+			die("Wrong total size");
+	}
+	stat_time = now() - start;
+
+	start = now();
+	for (r = 0; r < READDIR_ROUNDS; r++) {
+		total = 0;
+		dir = fs_opendir(NULL, 0);
+		if (!dir)
+			die("Cannot open directory");
+		while ((n = fs_readdir(dir, entries, READDIR_BATCH)) > 0) {
+			for (i = 0; i < n; i++)
+				total += entries[i].size;
+		}
+		fs_closedir(dir);
+		if (total != expected)
+			die("Wrong total size");
+	}
+	readdir_time = now() - start;
+
+	printf("open/stat/close: %.1f us per sweep of %d files\n",
+	       stat_time / READDIR_ROUNDS * 1e6, READDIR_FILES);
+	printf("opendir/readdir: %.1f us per sweep of %d files\n",
+	       readdir_time / READDIR_ROUNDS * 1e6, READDIR_FILES);
+
+	for (i = 0; i < READDIR_FILES; i++) {
+		snprintf(filename, sizeof(filename), "inv%d", i);
+		fs_delete(filename);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void bench_trace(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	static char buf[BLOCK_SIZE];
+	char tracename[PATH_MAX];
+	double start, plain, traced;
+	struct stat st;
+	int fd, i;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+	snprintf(tracename, sizeof(tracename), "%s.trace", b_arg->argv[0]);
+
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+	if (fs_create("traced"))
+		die("Cannot create file");
+	fd = fs_open("traced");
+	if (fd < 0)
+		die("Cannot open file");
+	memset(buf, 't', sizeof(buf));
+	for (i = 0; i < TRACE_FILE_BLOCKS; i++) {
+		if (fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot write file");
+	}
+
+	/* The same reads, without then with every call recorded */
+	start = now();
+	for (i = 0; i < TRACE_READS; i++)
+		fs_pread(fd, buf, BLOCK_SIZE, (i % TRACE_FILE_BLOCKS) * BLOCK_SIZE);
+	plain = now() - start;
+
+	if (fs_trace_start(tracename))
+		die("Cannot start trace");
+	start = now();
+	for (i = 0; i < TRACE_READS; i++)
+		fs_pread(fd, buf, BLOCK_SIZE, (i % TRACE_FILE_BLOCKS) * BLOCK_SIZE);
+	traced = now() - start;
+	if (fs_trace_stop())
+		die("Cannot write trace");
+	if (stat(tracename, &st))
+		die_perror("stat");
+	unlink(tracename);
+
+	printf("untraced: %.0f ns per read\n", plain / TRACE_READS * 1e9);
+	printf("traced: %.0f ns per read, %.1f bytes of trace per call\n",
+	       traced / TRACE_READS * 1e9,
+	       (double)(st.st_size - strlen(FS_TRACE_SIGNATURE)) / TRACE_READS);
+
+	fs_close(fd);
+	fs_delete("traced");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void bench_checksum(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	static const char *modes[] = { "none", "scrub", "verify" };
+	static char buf[CSUM_FILE_BLOCKS * BLOCK_SIZE];
+	double start, written, read, hw, sw;
+	int fd, mode, i;
+
+	if (b_arg->argc < 1)
+		die("need <diskname>");
+
+	memset(buf, 'k', sizeof(buf));
+	for (mode = FS_CSUM_NONE; mode <= FS_CSUM_VERIFY; mode++) {
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (fs_checksum(mode))
+			die("Cannot set checksums");
+		if (fs_create("summed"))
+			die("Cannot create file");
+		fd = fs_open("summed");
+		if (fd < 0)
+			die("Cannot open file");
+
+		/* The whole file rewritten, then read back, block by block */
+		start = now();
+		for (i = 0; i < CSUM_ROUNDS * CSUM_FILE_BLOCKS; i++) {
+			if (fs_pwrite(fd, buf, BLOCK_SIZE, (i % CSUM_FILE_BLOCKS) * BLOCK_SIZE) != BLOCK_SIZE)
+				die("Cannot write file");
+		}
+		fs_sync();
+		written = now() - start;
+
+		start = now();
+		for (i = 0; i < CSUM_ROUNDS * CSUM_FILE_BLOCKS; i++) {
+			if (fs_pread(fd, buf, BLOCK_SIZE, (i % CSUM_FILE_BLOCKS) * BLOCK_SIZE) != BLOCK_SIZE)
+				die("Cannot read file");
+		}
+		read = now() - start;
+
+		printf("checksums %s: write %.1f MB/s, read %.1f MB/s\n", modes[mode],
+		       (double)CSUM_ROUNDS * sizeof(buf) / written / 1e6,
+		       (double)CSUM_ROUNDS * sizeof(buf) / read / 1e6);
+
+		fs_close(fd);
+		fs_delete("summed");
+		if (fs_checksum(FS_CSUM_NONE))
+			die("Cannot remove checksums");
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	/* The CRC alone, with and without the crc32 instruction */
+	start = now();
+	for (i = 0; i < CSUM_ROUNDS; i++)
+		crc32c(0, buf, sizeof(buf));
+	hw = now() - start;
+	start = now();
+	for (i = 0; i < CSUM_ROUNDS; i++)
+		crc32c_sw(0, buf, sizeof(buf));
+	sw = now() - start;
+
+	printf("crc32c (%s): %.1f MB/s\n", crc32c_hw_enabled() ? "crc32 instruction" : "tables",
+	       (double)CSUM_ROUNDS * sizeof(buf) / hw / 1e6);
+	printf("crc32c (tables): %.1f MB/s\n",
+	       (double)CSUM_ROUNDS * sizeof(buf) / sw / 1e6);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "compress",	bench_compress },
+	{ "stream",	bench_stream },
+	{ "alloc",	bench_alloc },
+	{ "durability",	bench_durability },
+	{ "append",	bench_append },
+	{ "writeback",	bench_writeback },
+	{ "delalloc",	bench_delalloc },
+	{ "copy",	bench_copy },
+	{ "readdir",	bench_readdir },
+	{ "trace",	bench_trace },
+	{ "checksum",	bench_checksum },
+};
+
+void usage(char *program)
+{
+	int i;
+	fprintf(stderr, "Usage: %s <benchmark> [<arg>]\n", program);
+	fprintf(stderr, "Possible benchmarks are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	char *program;
+	char *cmd;
+	struct bench_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		bench_error("invalid benchmark '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
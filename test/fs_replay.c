@@ -0,0 +1,387 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Size of the blocks stamped in the data written, so that no two blocks
+ * written by the replay are the same */
+#define STAMP_BLOCK_SIZE 4096
+
+static const char *op_names[FS_TRACE_OPS] = {
+	[FS_TRACE_MOUNT] = "mount",
+	[FS_TRACE_UMOUNT] = "umount",
+	[FS_TRACE_CREATE] = "create",
+	[FS_TRACE_DELETE] = "delete",
+	[FS_TRACE_RENAME] = "rename",
+	[FS_TRACE_OPEN] = "open",
+	[FS_TRACE_CLOSE] = "close",
+	[FS_TRACE_STAT] = "stat",
+	[FS_TRACE_LSEEK] = "lseek",
+	[FS_TRACE_READ] = "read",
+	[FS_TRACE_WRITE] = "write",
+	[FS_TRACE_PREAD] = "pread",
+	[FS_TRACE_PWRITE] = "pwrite",
+	[FS_TRACE_SYNC] = "sync",
+	[FS_TRACE_BEGIN] = "begin",
+	[FS_TRACE_COMMIT] = "commit",
+	[FS_TRACE_CLONE] = "clone",
+	[FS_TRACE_COPY_RANGE] = "copy_range",
+};
+
+/* A recorded call, and its names */
+struct call {
+	struct fs_trace_record rec;
+	const char *name;
+	const char *name2;
+};
+
+/* Latencies of the replayed calls of one kind */
+struct op_stats {
+	uint64_t *lat_ns;
+	size_t num;
+	uint64_t traced_ns; /* total time the calls took when recorded */
+};
+
+static struct {
+	char *trace; /* content of the trace file, which the calls point into */
+	const char *diskname;
+	int mounted;
+	int *fds; /* descriptor opened by the replay for each recorded one */
+	int fds_num;
+	char *buf;
+	size_t buf_size;
+	size_t bytes_read, bytes_written;
+	size_t calls, differed;
+	struct op_stats stats[FS_TRACE_OPS];
+} replay;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read the whole trace file, and split it into calls */
+static struct call *load_trace(const char *filename, size_t *calls_num)
+{
+	struct stat st;
+	struct call *calls = NULL;
+	struct fs_trace_record rec;
+	size_t sig_len = strlen(FS_TRACE_SIGNATURE), pos, num = 0, cap = 0;
+	char *data, *names;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	data = malloc(st.st_size + 1);
+	if (!data)
+		die_perror("malloc");
+	if (read(fd, data, st.st_size) != st.st_size)
+		die_perror("read");
+	close(fd);
+	replay.trace = data;
+
+	if ((size_t)st.st_size < sig_len || memcmp(data, FS_TRACE_SIGNATURE, sig_len))
+		die("Not a trace file: %s", filename);
+
+	for (pos = sig_len; pos < (size_t)st.st_size; num++) {
+		if (st.st_size - pos < sizeof(rec))
+			die("Truncated trace file: %s", filename);
+		memcpy(&rec, data + pos, sizeof(rec));
+		pos += sizeof(rec);
+		names = data + pos;
+		if (rec.op >= FS_TRACE_OPS || st.st_size - pos < rec.names_len ||
+		    (rec.names_len && names[rec.names_len - 1] != '\0'))
+			die("Corrupted trace file: %s", filename);
+		pos += rec.names_len;
+
+		if (num == cap) {
+			cap = cap ? cap * 2 : 64;
+			calls = realloc(calls, cap * sizeof(*calls));
+			if (!calls)
+				die_perror("realloc");
+		}
+		calls[num].rec = rec;
+		calls[num].name = rec.names_len ? names : NULL;
+		calls[num].name2 = NULL;
+		if (rec.names_len && rec.names_len > strlen(names) + 1)
+			calls[num].name2 = names + strlen(names) + 1;
+	}
+	*calls_num = num;
+	return calls;
+}
+
+/* Descriptor of the replay matching recorded descriptor @fd, -1 if none */
+static int fd_lookup(int fd)
+{
+	if (fd < 0 || fd >= replay.fds_num)
+		return -1;
+	return replay.fds[fd];
+}
+
+static void fd_map(int fd, int replay_fd)
+{
+	if (fd < 0)
+		return;
+	if (fd >= replay.fds_num) {
+		replay.fds = realloc(replay.fds, (fd + 1) * sizeof(int));
+		if (!replay.fds)
+			die_perror("realloc");
+		while (replay.fds_num <= fd)
+			replay.fds[replay.fds_num++] = -1;
+	}
+	replay.fds[fd] = replay_fd;
+}
+
+/* Make the data of each write differ from what was written before */
+static void stamp(size_t count)
+{
+	uint64_t mark[2];
+	size_t off;
+
+	for (off = 0; off < count; off += STAMP_BLOCK_SIZE) {
+		mark[0] = replay.calls;
+		mark[1] = off;
+		memcpy(replay.buf + off, mark,
+		       count - off < sizeof(mark) ? count - off : sizeof(mark));
+	}
+}
+
+/* Make a recorded call against the image, return its result */
+static int replay_call(const struct call *call)
+{
+	const struct fs_trace_record *rec = &call->rec;
+	int fd = fd_lookup(rec->fd);
+	int ret;
+
+	switch (rec->op) {
+	case FS_TRACE_MOUNT:
+		/* whatever image was recorded, replay against ours */
+		if (replay.mounted)
+			return 0;
+		ret = fs_mount(replay.diskname);
+		replay.mounted = ret == 0;
+		return ret;
+	case FS_TRACE_UMOUNT:
+		ret = fs_umount();
+		if (ret == 0)
+			replay.mounted = 0;
+		return ret;
+	case FS_TRACE_CREATE:
+		return fs_create(call->name);
+	case FS_TRACE_DELETE:
+		return fs_delete(call->name);
+	case FS_TRACE_RENAME:
+		return fs_rename(call->name, call->name2);
+	case FS_TRACE_OPEN:
+		ret = fs_open(call->name);
+		if (rec->ret >= 0)
+			fd_map(rec->ret, ret);
+		return ret;
+	case FS_TRACE_CLOSE:
+		ret = fs_close(fd);
+		if (ret == 0)
+			fd_map(rec->fd, -1);
+		return ret;
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, rec->offset);
+	case FS_TRACE_READ:
+		ret = fs_read(fd, replay.buf, rec->count);
+		break;
+	case FS_TRACE_PREAD:
+		ret = fs_pread(fd, replay.buf, rec->count, rec->offset);
+		break;
+	case FS_TRACE_WRITE:
+		stamp(rec->count);
+		ret = fs_write(fd, replay.buf, rec->count);
+		break;
+	case FS_TRACE_PWRITE:
+		stamp(rec->count);
+		ret = fs_pwrite(fd, replay.buf, rec->count, rec->offset);
+		break;
+	case FS_TRACE_SYNC:
+		return fs_sync();
+	case FS_TRACE_BEGIN:
+		return fs_begin();
+	case FS_TRACE_COMMIT:
+		return fs_commit();
+	case FS_TRACE_CLONE:
+		return fs_clone(call->name, call->name2);
+	default: /* FS_TRACE_COPY_RANGE, ops are checked when loading */
+		return fs_copy_range(call->name, call->name2, rec->offset,
+				     rec->count);
+	}
+
+	if (ret > 0 && (rec->op == FS_TRACE_READ || rec->op == FS_TRACE_PREAD))
+		replay.bytes_read += ret;
+	else if (ret > 0)
+		replay.bytes_written += ret;
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t elapsed_ns)
+{
+	double secs = elapsed_ns / 1e9;
+	struct op_stats *st;
+	uint64_t sum;
+	size_t i;
+	int op;
+
+	printf("Replayed %zu calls, %zu with a different result\n",
+	       replay.calls, replay.differed);
+	printf("Elapsed %.6f s, %.0f calls/s\n", secs, replay.calls / secs);
+	printf("Read %zu bytes, %.1f MiB/s\n", replay.bytes_read,
+	       replay.bytes_read / secs / (1024 * 1024));
+	printf("Written %zu bytes, %.1f MiB/s\n", replay.bytes_written,
+	       replay.bytes_written / secs / (1024 * 1024));
+	printf("%-12s %8s %10s %10s %10s %10s %10s\n", "call", "count",
+	       "mean us", "p50 us", "p99 us", "max us", "traced us");
+	for (op = 0; op < FS_TRACE_OPS; op++) {
+		st = &replay.stats[op];
+		if (!st->num)
+			continue;
+		qsort(st->lat_ns, st->num, sizeof(uint64_t), cmp_u64);
+		for (i = 0, sum = 0; i < st->num; i++)
+			sum += st->lat_ns[i];
+		printf("%-12s %8zu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		       op_names[op], st->num, sum / 1e3 / st->num,
+		       st->lat_ns[(st->num - 1) / 2] / 1e3,
+		       st->lat_ns[(st->num - 1) * 99 / 100] / 1e3,
+		       st->lat_ns[st->num - 1] / 1e3,
+		       st->traced_ns / 1e3 / st->num);
+	}
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t] <trace file> <diskname>\n", program);
+	fprintf(stderr, "\t-t\treplay with the timing of the trace, not as fast as possible\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct call *calls;
+	size_t calls_num, i, counts[FS_TRACE_OPS] = { 0 };
+	uint64_t start, before, lat;
+	struct timespec due;
+	struct op_stats *st;
+	int timed = 0, op, ret, same;
+
+	if (argc > 1 && !strcmp(argv[1], "-t")) {
+		timed = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 3)
+		usage(argv[0]);
+	replay.diskname = argv[2];
+
+	calls = load_trace(argv[1], &calls_num);
+	for (i = 0; i < calls_num; i++) {
+		counts[calls[i].rec.op]++;
+		if (calls[i].rec.count > replay.buf_size)
+			replay.buf_size = calls[i].rec.count;
+	}
+	for (op = 0; op < FS_TRACE_OPS; op++) {
+		replay.stats[op].lat_ns = malloc((counts[op] + 1) * sizeof(uint64_t));
+		if (!replay.stats[op].lat_ns)
+			die_perror("malloc");
+	}
+	/* random data, stamped before each write */
+	replay.buf = malloc(replay.buf_size + 1);
+	if (!replay.buf)
+		die_perror("malloc");
+	srand(1);
+	for (i = 0; i < replay.buf_size; i++)
+		replay.buf[i] = rand();
+
+	/* a trace started after the FS was mounted replays on it mounted */
+	if (!calls_num || calls[0].rec.op != FS_TRACE_MOUNT) {
+		if (fs_mount(replay.diskname))
+			die("Cannot mount diskname");
+		replay.mounted = 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < calls_num; i++) {
+		if (timed) {
+			lat = start + calls[i].rec.start_ns;
+			due.tv_sec = lat / 1000000000;
+			due.tv_nsec = lat % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		}
+		before = now_ns();
+		ret = replay_call(&calls[i]);
+		lat = now_ns() - before;
+		if (calls[i].rec.op == FS_TRACE_MOUNT && ret && !calls[i].rec.ret)
+			die("Cannot mount diskname");
+
+		/* descriptors may be numbered differently, only their validity
+		 * has to match */
+		if (calls[i].rec.op == FS_TRACE_OPEN)
+			same = (ret >= 0) == (calls[i].rec.ret >= 0);
+		else
+			same = ret == calls[i].rec.ret;
+		replay.differed += !same;
+		replay.calls++;
+
+		st = &replay.stats[calls[i].rec.op];
+		st->lat_ns[st->num++] = lat;
+		st->traced_ns += calls[i].rec.duration_ns;
+	}
+	report(now_ns() - start);
+
+	/* leave the image unmounted, whatever the trace left open */
+	if (replay.mounted) {
+		for (i = 0; i < (size_t)replay.fds_num; i++) {
+			if (replay.fds[i] >= 0)
+				fs_close(replay.fds[i]);
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	for (op = 0; op < FS_TRACE_OPS; op++)
+		free(replay.stats[op].lat_ns);
+	free(replay.buf);
+	free(replay.fds);
+	free(calls);
+	free(replay.trace);
+	return 0;
+}
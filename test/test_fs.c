@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -121,54 +124,712 @@ void thread_fs_cat(void *arg)
 	}
 
 	read = fs_read(fs_fd, buf, stat);
+	if (read < 0) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot read file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(buf);
+}
+
+void thread_fs_cat_mmap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fs_fd;
+	int stat;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	if (!stat) {
+		/* Nothing to map, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+
+	/* Print the file in place, without reading it into a buffer */
+	buf = fs_mmap(fs_fd, 0, stat, 0);
+	if (!buf) {
+		fs_umount();
+		die("Cannot map file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	if (fs_munmap(buf)) {
+		fs_umount();
+		die("Cannot unmap file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+}
+
+void thread_fs_cat_vec(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	struct iovec *iov;
+	size_t piece;
+	int fs_fd, iovcnt, i;
+	int stat, read;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <piece size>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	piece = atoi(t_arg->argv[2]);
+	if (!piece)
+		die("Invalid piece size");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	/* Scatter the whole file over pieces of @piece bytes, in one call */
+	iovcnt = (stat + piece - 1) / piece;
+	buf = malloc(stat + 1);
+	iov = malloc((iovcnt + 1) * sizeof(*iov));
+	if (!buf || !iov) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+	for (i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = buf + i * piece;
+		iov[i].iov_len = (i + 1) * piece > stat ? stat - i * piece : piece;
+	}
+
+	read = fs_readv(fs_fd, iov, iovcnt);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(iov);
+	free(buf);
+}
+
+/* Worker threads and block size of the reads issued by cat_async */
+#define ASYNC_WORKERS 4
+#define ASYNC_CHUNK 4096
+
+static void cat_async_done(struct fs_request *req)
+{
+	__atomic_fetch_add((int *)req->user_data, req->result, __ATOMIC_RELAXED);
+}
+
+void thread_fs_cat_async(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	struct fs_request *reqs, **ptrs;
+	struct pollfd pfd;
+	uint64_t events;
+	int fs_fd, nr, i, pending, done;
+	int stat, bytes = 0;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	/* One read per chunk, all in flight at once */
+	nr = (stat + ASYNC_CHUNK - 1) / ASYNC_CHUNK;
+	buf = malloc(stat + 1);
+	reqs = calloc(nr + 1, sizeof(*reqs));
+	ptrs = calloc(nr + 1, sizeof(*ptrs));
+	if (!buf || !reqs || !ptrs) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+	for (i = 0; i < nr; i++) {
+		reqs[i].opcode = FS_OP_READ;
+		reqs[i].fd = fs_fd;
+		reqs[i].buf = buf + i * ASYNC_CHUNK;
+		reqs[i].offset = i * ASYNC_CHUNK;
+		reqs[i].count = stat - reqs[i].offset < ASYNC_CHUNK ?
+			stat - reqs[i].offset : ASYNC_CHUNK;
+		/* Odd requests complete through a callback, even ones are
+		 * reaped from the completion queue */
+		if (i % 2) {
+			reqs[i].callback = cat_async_done;
+			reqs[i].user_data = &bytes;
+		}
+		ptrs[i] = &reqs[i];
+	}
+
+	if (fs_async_init(ASYNC_WORKERS) || fs_submit(ptrs, nr) != nr) {
+		fs_umount();
+		die("Cannot submit reads");
+	}
+
+	/* Event loop: wait for the eventfd, then reap what completed */
+	pending = (nr + 1) / 2;
+	pfd.fd = fs_async_eventfd();
+	pfd.events = POLLIN;
+	while (pending > 0) {
+		if (poll(&pfd, 1, -1) < 0)
+			die_perror("poll");
+		/* Clear the counter first, so that no completion is missed */
+		if (read(pfd.fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+			die_perror("read");
+		done = fs_reap(ptrs, nr, 0);
+		for (i = 0; i < done; i++)
+			__atomic_fetch_add(&bytes, ptrs[i]->result, __ATOMIC_RELAXED);
+		pending -= done;
+	}
+
+	/* Also waits for the callbacks */
+	fs_async_exit();
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, bytes, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(ptrs);
+	free(reqs);
+	free(buf);
+}
+
+/* Set by rm_discard: the blocks of the file are given back to the host */
+static int rm_discard;
+
+void thread_fs_rm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (rm_discard && fs_discard(1)) {
+		fs_umount();
+		die("Cannot enable discard");
+	}
+
+	if (fs_delete(filename)) {
+		fs_umount();
+		die("Cannot delete file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed file '%s'\n", filename);
+}
+
+void thread_fs_rm_discard(void *arg)
+{
+	rm_discard = 1;
+	thread_fs_rm(arg);
+}
+
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int trimmed;
+
+	if (t_arg->argc < 1)
+		die("need <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	trimmed = fs_trim();
+	if (trimmed < 0) {
+		fs_umount();
+		die("Cannot trim");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Trimmed %d blocks\n", trimmed);
+}
+
+void thread_fs_mv(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *oldname, *newname;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	oldname = t_arg->argv[1];
+	newname = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rename(oldname, newname)) {
+		fs_umount();
+		die("Cannot rename file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Renamed file '%s' to '%s'\n", oldname, newname);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <clone filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+	size_t offset, len;
+	int ret;
+
+	if (t_arg->argc != 3 && t_arg->argc != 5)
+		die("need <diskname> <filename> <copy filename> [<offset> <length>]");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc == 5) {
+		offset = atoi(t_arg->argv[3]);
+		len = atoi(t_arg->argv[4]);
+		ret = fs_copy_range(src, dst, offset, len);
+	} else {
+		ret = fs_copy(src, dst);
+	}
+	if (ret) {
+		fs_umount();
+		die("Cannot copy file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s'\n", src, dst);
+}
+
+static char *snap_arg(char *name)
+{
+	/* "-" stands for an empty file system or the current state */
+	return strcmp(name, "-") ? name : NULL;
+}
+
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Took snapshot '%s'\n", name);
+}
+
+void thread_fs_snap_rm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed snapshot '%s'\n", name);
+}
+
+void thread_fs_snap_ls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_snapshot_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snap_diff(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *from, *to, *diffname;
+	int blocks;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <from snapshot|-> <to snapshot|-> <diff filename>");
+
+	diskname = t_arg->argv[0];
+	from = snap_arg(t_arg->argv[1]);
+	to = snap_arg(t_arg->argv[2]);
+	diffname = t_arg->argv[3];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	blocks = fs_snapshot_diff(from, to, diffname);
+	if (blocks < 0) {
+		fs_umount();
+		die("Cannot export diff");
+	}
 
-	if (fs_close(fs_fd)) {
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Exported diff '%s' (%d data blocks)\n", diffname, blocks);
+}
+
+void thread_fs_snap_apply(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *diffname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <diff filename>");
+
+	diskname = t_arg->argv[0];
+	diffname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_apply(diffname)) {
 		fs_umount();
-		die("Cannot close file");
+		die("Cannot apply diff");
 	}
 
 	if (fs_umount())
-		die("cannot unmount diskname");
+		die("Cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	printf("%.*s", (int)stat, buf);
+	printf("Applied diff '%s'\n", diffname);
+}
 
-	free(buf);
+/* Blocks moved per fs_defrag() call when no budget is given */
+#define DEFRAG_BUDGET 64
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	double before, after;
+	int budget = 0, moved = 0, ret;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [budget]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget = atoi(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	before = fs_frag_score();
+	/* One bounded pass, or as many passes as it takes */
+	do {
+		ret = fs_defrag(budget ? budget : DEFRAG_BUDGET);
+		if (ret < 0) {
+			fs_umount();
+			die("Cannot defragment");
+		}
+		moved += ret;
+	} while (!budget && ret > 0);
+	after = fs_frag_score();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Moved %d blocks, fragmentation score %.2f -> %.2f\n", moved,
+	       before, after);
 }
 
-void thread_fs_rm(void *arg)
+void thread_fs_check(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename;
+	char *diskname;
+	int repair, problems;
 
-	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+	if (t_arg->argc < 1)
+		die("need <diskname> [-r]");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
+	repair = t_arg->argc > 1 && !strcmp(t_arg->argv[1], "-r");
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_delete(filename)) {
+	problems = fs_check(repair);
+	if (problems < 0) {
 		fs_umount();
-		die("Cannot delete file");
+		die("Cannot check diskname");
 	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Removed file '%s'\n", filename);
+	printf("%s %d problems\n", repair ? "Repaired" : "Found", problems);
+}
+
+void thread_fs_journal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int blocks = 0;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [blocks]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		blocks = atoi(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_journal(blocks)) {
+		fs_umount();
+		die("Cannot add a journal");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Added a journal\n");
+}
+
+void thread_fs_checksum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *modes[] = { "none", "scrub", "verify" };
+	char *diskname;
+	int mode = FS_CSUM_VERIFY;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [none|scrub|verify]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		for (mode = 0; mode < 3 && strcmp(t_arg->argv[1], modes[mode]); mode++)
+			;
+		if (mode == 3)
+			die("Unknown checksum mode");
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_checksum(mode)) {
+		fs_umount();
+		die("Cannot set checksums");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Checksums set to %s\n", modes[mode]);
+}
+
+void thread_fs_scrub(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int errors;
+
+	if (t_arg->argc < 1)
+		die("need <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	errors = fs_scrub();
+	if (errors < 0) {
+		fs_umount();
+		die("Cannot scrub");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Found %d blocks not matching their checksum\n", errors);
 }
 
+/* Set by add_compressed, add_packed, add_crash, add_dedup and add_writeback,
+ * which share thread_fs_add() (and its messages) */
+static int add_compressed;
+static int add_packed;
+static int add_crash;
+static int add_dedup;
+static int add_writeback;
+
+/* add_writeback appends pieces smaller than a block through a cache so small
+ * that writers keep waiting for it */
+#define WRITEBACK_PIECE 1000
+#define WRITEBACK_BLOCKS 4
+#define WRITEBACK_EXPIRE_MS 5
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	struct fs_dedup_stats stats;
+	int written, ret;
+	size_t piece;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -197,34 +858,238 @@ void thread_fs_add(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
+	if (add_packed && fs_tailpack(1)) {
+		fs_umount();
+		die("Cannot enable tail packing");
+	}
+
+	if (add_dedup && fs_dedup(1)) {
+		fs_umount();
+		die("Cannot enable deduplication");
+	}
+
+	if (add_writeback && fs_writeback(WRITEBACK_BLOCKS, WRITEBACK_EXPIRE_MS)) {
+		fs_umount();
+		die("Cannot enable write-back");
+	}
+
 	if (fs_create(filename)) {
 		fs_umount();
 		die("Cannot create file");
 	}
 
+	if (add_compressed && fs_compress(filename)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	if (!add_writeback) {
+		written = fs_write(fs_fd, buf, st.st_size);
+	} else {
+		for (written = 0; written < st.st_size; written += ret) {
+			piece = st.st_size - written;
+			if (piece > WRITEBACK_PIECE)
+				piece = WRITEBACK_PIECE;
+			ret = fs_write(fs_fd, buf + written, piece);
+			if (ret <= 0)
+				break;
+		}
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
 	}
 
+	/* Stop there, as if the machine went down */
+	if (add_crash) {
+		printf("Wrote file '%s' (%d/%zu bytes), not unmounted\n",
+		       filename, written, st.st_size);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	if (add_dedup && fs_dedup_stats(&stats)) {
+		fs_umount();
+		die("Cannot get deduplication statistics");
+	}
+
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
+	if (add_dedup)
+		printf("Dedup: %zu/%zu blocks, %zu/%zu writes avoided, %zu copied\n",
+		       stats.logical_blocks, stats.physical_blocks,
+		       stats.writes_avoided, stats.blocks_written,
+		       stats.blocks_copied);
 
 	munmap(buf, st.st_size);
 	close(fd);
 }
 
+void thread_fs_add_compressed(void *arg)
+{
+	add_compressed = 1;
+	thread_fs_add(arg);
+}
+
+void thread_fs_add_packed(void *arg)
+{
+	add_packed = 1;
+	thread_fs_add(arg);
+}
+
+void thread_fs_add_crash(void *arg)
+{
+	add_crash = 1;
+	thread_fs_add(arg);
+}
+
+void thread_fs_add_dedup(void *arg)
+{
+	add_dedup = 1;
+	thread_fs_add(arg);
+}
+
+void thread_fs_add_writeback(void *arg)
+{
+	add_writeback = 1;
+	thread_fs_add(arg);
+}
+
+/* add_interleaved appends a block to each file in turn, add_delalloc smaller
+ * pieces with delayed allocation, add_traced records the calls in a trace */
+#define INTERLEAVE_PIECE 4096
+#define INTERLEAVE_FILES_MAX 8
+#define DELALLOC_PIECE 1000
+
+static int add_delalloc;
+static char *add_trace;
+
+void thread_fs_add_interleaved(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *bufs[INTERLEAVE_FILES_MAX];
+	int fds[INTERLEAVE_FILES_MAX], written[INTERLEAVE_FILES_MAX];
+	size_t sizes[INTERLEAVE_FILES_MAX], off, piece, piece_max;
+	int i, files_num, fd, ret, more;
+	struct stat st;
+	double score;
+
+	if (t_arg->argc < 2 || t_arg->argc > INTERLEAVE_FILES_MAX + 1)
+		die("Usage: <diskname> <host filename>...");
+
+	diskname = t_arg->argv[0];
+	files_num = t_arg->argc - 1;
+
+	/* Map the host files into buffers */
+	for (i = 0; i < files_num; i++) {
+		fd = open(t_arg->argv[i + 1], O_RDONLY);
+		if (fd < 0)
+			die_perror("open");
+		if (fstat(fd, &st))
+			die_perror("fstat");
+		if (!S_ISREG(st.st_mode) || !st.st_size)
+			die("Not a non-empty regular file: %s\n", t_arg->argv[i + 1]);
+		bufs[i] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (bufs[i] == MAP_FAILED)
+			die_perror("mmap");
+		sizes[i] = st.st_size;
+		close(fd);
+	}
+
+	if (add_trace && fs_trace_start(add_trace))
+		die("Cannot start trace");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (add_delalloc && fs_delalloc(1)) {
+		fs_umount();
+		die("Cannot enable delayed allocation");
+	}
+	piece_max = add_delalloc ? DELALLOC_PIECE : INTERLEAVE_PIECE;
+
+	for (i = 0; i < files_num; i++) {
+		if (fs_create(t_arg->argv[i + 1])) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		fds[i] = fs_open(t_arg->argv[i + 1]);
+		if (fds[i] < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		written[i] = 0;
+	}
+
+	/* Every file grows at the same time */
+	for (off = 0, more = 1; more; off += piece_max) {
+		more = 0;
+		for (i = 0; i < files_num; i++) {
+			if (off >= sizes[i])
+				continue;
+			piece = sizes[i] - off;
+			if (piece > piece_max)
+				piece = piece_max;
+			ret = fs_write(fds[i], bufs[i] + off, piece);
+			if (ret > 0)
+				written[i] += ret;
+			more = 1;
+		}
+	}
+
+	for (i = 0; i < files_num; i++) {
+		if (fs_close(fds[i])) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+	score = fs_frag_score();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (add_trace && fs_trace_stop())
+		die("Cannot write trace");
+
+	for (i = 0; i < files_num; i++) {
+		printf("Wrote file '%s' (%d/%zu bytes)\n", t_arg->argv[i + 1],
+		       written[i], sizes[i]);
+		munmap(bufs[i], sizes[i]);
+	}
+	printf("Fragmentation score %.2f\n", score);
+}
+
+void thread_fs_add_delalloc(void *arg)
+{
+	add_delalloc = 1;
+	thread_fs_add_interleaved(arg);
+}
+
+void thread_fs_add_traced(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <trace file> <host filename>...");
+
+	/* the trace file comes before the host files */
+	add_trace = t_arg->argv[1];
+	t_arg->argv[1] = t_arg->argv[0];
+	t_arg->argv++;
+	t_arg->argc--;
+	thread_fs_add_interleaved(arg);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -244,6 +1109,43 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+/* dir reads the directory a few files at a time */
+#define DIR_BATCH 4
+
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entries[DIR_BATCH];
+	struct fs_dir *dir;
+	char *diskname, *prefix;
+	int i, n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<prefix>]");
+
+	diskname = t_arg->argv[0];
+	prefix = t_arg->argc > 1 ? t_arg->argv[1] : NULL;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	dir = fs_opendir(prefix, FS_DIR_SORTED);
+	if (!dir) {
+		fs_umount();
+		die("Cannot open directory");
+	}
+	while ((n = fs_readdir(dir, entries, DIR_BATCH)) > 0) {
+		for (i = 0; i < n; i++)
+			printf("file: %s, size: %zu, data_blk: %d\n",
+			       entries[i].name, entries[i].size,
+			       entries[i].data_blk);
+	}
+	fs_closedir(dir);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -263,6 +1165,68 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_write_mmap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *input_filename, *output_filename, *buf, *dst;
+	size_t offset;
+	int fd, fs_fd;
+	struct stat st;
+
+	if (t_arg->argc < 4)
+		die("Usage: <diskname> <host filename> <write filename> <offset>");
+
+	diskname = t_arg->argv[0];
+	input_filename = t_arg->argv[1];
+	output_filename = t_arg->argv[2];
+	offset = (size_t)atoi(t_arg->argv[3]);
+
+	/* Open file on host computer */
+	fd = open(input_filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", input_filename);
+
+	/* Map file into buffer */
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!buf)
+		die_perror("mmap");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(output_filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* Overwrite the file in place, the range must already exist */
+	dst = fs_mmap(fs_fd, offset, st.st_size, 1);
+	if (!dst) {
+		fs_umount();
+		die("Cannot map file");
+	}
+	memcpy(dst, buf, st.st_size);
+
+	if (fs_munmap(dst) || fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot unmap file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%zu/%zu bytes)\n", output_filename, st.st_size,
+	       st.st_size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
 void thread_fs_write_offset(void *arg) {
   struct thread_arg *t_arg = arg;
 	char *diskname, *input_filename, *output_filename, *buf;
@@ -389,10 +1353,38 @@ static struct {
 } commands[] = {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
+	{ "dir",	thread_fs_dir },
 	{ "add",	thread_fs_add },
+	{ "add_compressed",	thread_fs_add_compressed },
+	{ "add_packed",	thread_fs_add_packed },
+	{ "add_crash",	thread_fs_add_crash },
+	{ "add_dedup",	thread_fs_add_dedup },
+	{ "add_writeback",	thread_fs_add_writeback },
+	{ "add_interleaved",	thread_fs_add_interleaved },
+	{ "add_delalloc",	thread_fs_add_delalloc },
+	{ "add_traced",	thread_fs_add_traced },
 	{ "rm",		thread_fs_rm },
+	{ "rm_discard",	thread_fs_rm_discard },
+	{ "trim",	thread_fs_trim },
+	{ "mv",		thread_fs_mv },
+	{ "clone",	thread_fs_clone },
+	{ "copy",	thread_fs_copy },
+	{ "snap",	thread_fs_snap },
+	{ "snap_rm",	thread_fs_snap_rm },
+	{ "snap_ls",	thread_fs_snap_ls },
+	{ "snap_diff",	thread_fs_snap_diff },
+	{ "snap_apply",	thread_fs_snap_apply },
+	{ "defrag",	thread_fs_defrag },
+	{ "check",	thread_fs_check },
+	{ "journal",	thread_fs_journal },
+	{ "checksum",	thread_fs_checksum },
+	{ "scrub",	thread_fs_scrub },
 	{ "cat",	thread_fs_cat },
+	{ "cat_vec",	thread_fs_cat_vec },
+	{ "cat_mmap",	thread_fs_cat_mmap },
+	{ "cat_async",	thread_fs_cat_async },
 	{ "stat",	thread_fs_stat },
+	{ "write_mmap",	thread_fs_write_mmap },
   { "write_offset", thread_fs_write_offset },
   { "read_offset", thread_fs_read_offset }
 };
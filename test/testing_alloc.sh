@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 4096
+./fs_make.x adisk.fs 4096
+
+# files of 39, 30 and 52 blocks
+for i in $(seq -w 1 12000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 12000); do echo "bye world" >> file2; done
+for i in $(seq -w 1 15000); do echo "hi world, hi!" >> file3; done
+
+# one after the other with the reference lib, and growing at the same time
+# with ours: each file gets an allocation group and a single run of blocks
+for f in file1 file2 file3; do
+    ./fs_ref.x add disk.fs $f >/dev/null
+done
+cat >ref.stdout <<END
+Wrote file 'file1' (156000/156000 bytes)
+Wrote file 'file2' (120000/120000 bytes)
+Wrote file 'file3' (210000/210000 bytes)
+Fragmentation score 40.33
+END
+./test_fs.x add_interleaved adisk.fs file1 file2 file3 >lib.stdout 2>lib.stderr
+
+# every file reads the same
+for f in file1 file2 file3; do
+    ./fs_ref.x cat disk.fs $f >>ref.stdout 2>>ref.stderr
+    ./fs_ref.x cat adisk.fs $f >>lib.stdout 2>>lib.stderr
+done
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x info adisk.fs >>lib.stdout 2>>lib.stderr
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check adisk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs adisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3
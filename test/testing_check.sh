@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# make fresh virtual disk with two files
+./fs_make.x disk.fs 100
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 100); do echo "hi world!" >> file2; done
+./fs_ref.x add disk.fs file1
+./fs_ref.x add disk.fs file2
+cp disk.fs cdisk.fs
+
+# corrupt FAT entry $1 (a data block index) of cdisk.fs with bytes $2
+fat_set() {
+    printf "$2" | dd of=cdisk.fs bs=1 seek=$((4096 + 2 * $1)) conv=notrunc 2>/dev/null
+}
+# file1 (blocks 1-4) loops back on itself, file2 (block 5) gets an extra
+# block, and a free block is marked used
+fat_set 4 '\001\000'
+fat_set 5 '\074\000'
+fat_set 60 '\377\377'
+fat_set 50 '\377\377'
+
+# find the problems, repair them
+./test_fs.x check cdisk.fs
+./test_fs.x check cdisk.fs -r
+
+# the repaired image must be clean and hold the same content
+./test_fs.x check disk.fs >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./test_fs.x check cdisk.fs >lib.stdout 2>lib.stderr
+./fs_ref.x cat cdisk.fs file1 >>lib.stdout 2>>lib.stderr
+./fs_ref.x cat cdisk.fs file2 >>lib.stdout 2>>lib.stderr
+./fs_ref.x info cdisk.fs >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs cdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
@@ -0,0 +1,70 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x cdisk.fs 100
+
+# create files spanning several blocks
+for i in $(seq -w 1 3600); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 400); do echo "hi world!" >> file2; done
+
+# ours checksums the blocks of its disk, and rebuilds the checksums after a
+# crash: every block matches, and the files read back fine
+./test_fs.x checksum cdisk.fs >lib.stdout 2>lib.stderr
+./test_fs.x add cdisk.fs file1 >/dev/null
+./test_fs.x add_crash cdisk.fs file2 >/dev/null
+./test_fs.x scrub cdisk.fs >>lib.stdout 2>>lib.stderr
+./test_fs.x cat cdisk.fs file1 >>lib.stdout 2>>lib.stderr
+./test_fs.x cat cdisk.fs file2 >>lib.stdout 2>>lib.stderr
+
+# damage a data block of file1: reading it fails, and scrubbing finds it
+off=$(grep -obUa "hello world" cdisk.fs | head -1 | cut -d: -f1)
+printf 'X' | dd of=cdisk.fs bs=1 seek=$off conv=notrunc 2>/dev/null
+./test_fs.x cat cdisk.fs file1 >>lib.stdout 2>>lib.stderr
+./test_fs.x scrub cdisk.fs >>lib.stdout 2>>lib.stderr
+
+# damage the root directory: the disk no longer mounts
+printf 'X' | dd of=cdisk.fs bs=1 seek=$((2 * 4096 + 32)) conv=notrunc 2>/dev/null
+./test_fs.x ls cdisk.fs >>lib.stdout 2>>lib.stderr
+
+# the reference lib reads the same files
+./fs_ref.x add disk.fs file1 >/dev/null
+./fs_ref.x add disk.fs file2 >/dev/null
+echo "Checksums set to verify" >ref.stdout
+echo "Found 0 blocks not matching their checksum" >>ref.stdout
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+echo "Found 1 blocks not matching their checksum" >>ref.stdout
+cat >>ref.stderr <<END
+thread_fs_cat: Cannot read file
+thread_fs_ls: Cannot mount diskname
+END
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs cdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
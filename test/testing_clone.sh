@@ -0,0 +1,53 @@
+#!/bin/sh
+
+# make fresh virtual disk
+./fs_make.x disk.fs 100
+
+# create a file spanning several blocks and a patch for its second block
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+echo "patched!" > patch
+
+# add the file and keep its content from the reference lib
+./test_fs.x add disk.fs file1
+./fs_ref.x cat disk.fs file1 >ref.stdout 2>ref.stderr
+
+# clone it, then modify the clone in its second block: the original must be untouched
+./test_fs.x clone disk.fs file1 file2
+./test_fs.x write_offset disk.fs patch file2 5000
+./fs_ref.x cat disk.fs file1 >lib.stdout 2>lib.stderr
+
+# the clone must hold the patch
+./test_fs.x read_offset disk.fs file2 5000 8 | grep -q "patched!" || echo "Clone content doesn't match..."
+
+# deleting the original keeps the shared blocks alive for the clone
+./test_fs.x rm disk.fs file1
+./test_fs.x read_offset disk.fs file2 0 12 | grep -q "hello world!" || echo "Clone content doesn't match..."
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 patch
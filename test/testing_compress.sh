@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x zdisk.fs 100
+
+# highly compressible file spanning several chunks, and a short one
+for i in $(seq -w 1 10000); do echo "hello world!" >> file1; done
+echo "Hi!" > file2
+
+# store them plain with the reference lib, compressed with ours
+./fs_ref.x add disk.fs file1
+./fs_ref.x add disk.fs file2
+./test_fs.x add_compressed zdisk.fs file1
+./test_fs.x add_compressed zdisk.fs file2
+
+# the compressed file must use fewer blocks
+./fs_ref.x info disk.fs | grep fat_free
+./test_fs.x info zdisk.fs | grep fat_free
+
+# whole and random reads must give back the same content
+./fs_ref.x cat disk.fs file1 >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./test_fs.x read_offset disk.fs file1 70000 26 >>ref.stdout 2>>ref.stderr
+./test_fs.x cat zdisk.fs file1 >lib.stdout 2>lib.stderr
+./test_fs.x cat zdisk.fs file2 >>lib.stdout 2>>lib.stderr
+./test_fs.x read_offset zdisk.fs file1 70000 26 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs zdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x cdisk.fs 100
+
+# a file spanning several blocks, and the part of it from its third block
+for i in $(seq -w 1 3000); do echo "hello world!" >> file1; done
+cp file1 copy1
+tail -c +8193 file1 | head -c 20000 > part1
+
+# the reference lib writes the copies like any file, ours copies them from
+# block to block: same content, in the same blocks
+./fs_ref.x add disk.fs file1 >/dev/null
+./fs_ref.x add disk.fs copy1 >/dev/null
+./fs_ref.x add disk.fs part1 >/dev/null
+./fs_ref.x add cdisk.fs file1 >/dev/null
+cat >ref.stdout <<END
+Copied file 'file1' to 'copy1'
+Copied file 'file1' to 'part1'
+END
+./test_fs.x copy cdisk.fs file1 copy1 >lib.stdout 2>lib.stderr
+./test_fs.x copy cdisk.fs file1 part1 8192 20000 >>lib.stdout 2>>lib.stderr
+
+# the range must start on a block and lie within the file
+./test_fs.x copy cdisk.fs file1 bad1 100 20000 >>lib.stdout 2>>lib.stderr
+./test_fs.x copy cdisk.fs file1 bad2 8192 40000 >>lib.stdout 2>>lib.stderr
+echo "thread_fs_copy: Cannot copy file" >>ref.stderr
+echo "thread_fs_copy: Cannot copy file" >>ref.stderr
+
+for f in file1 copy1 part1; do
+    ./fs_ref.x cat disk.fs $f >>ref.stdout 2>>ref.stderr
+    ./fs_ref.x cat cdisk.fs $f >>lib.stdout 2>>lib.stderr
+done
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x ls cdisk.fs >>lib.stdout 2>>lib.stderr
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x info cdisk.fs >>lib.stdout 2>>lib.stderr
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check cdisk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs cdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 copy1 part1
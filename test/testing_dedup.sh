@@ -0,0 +1,79 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x ddisk.fs 100
+
+# a file, a copy of it, a longer version and its first two blocks
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+cp file1 file2
+cp file1 file3
+for i in $(seq -w 1 500); do echo "more" >> file3; done
+head -c 8192 file1 > file4
+
+# same files on a plain disk with the reference lib, and with ours in dedup
+# mode: the copy shares every block, the others share theirs until they
+# diverge or end
+for f in file1 file2 file3 file4; do
+    ./fs_ref.x add disk.fs $f >/dev/null
+done
+cat >ref.stdout <<END
+Wrote file 'file1' (13000/13000 bytes)
+Dedup: 4/4 blocks, 0/3 writes avoided, 0 copied
+Wrote file 'file2' (13000/13000 bytes)
+Dedup: 8/4 blocks, 3/3 writes avoided, 0 copied
+Wrote file 'file3' (15500/15500 bytes)
+Dedup: 12/8 blocks, 3/3 writes avoided, 4 copied
+Wrote file 'file4' (8192/8192 bytes)
+Dedup: 14/10 blocks, 2/2 writes avoided, 2 copied
+END
+for f in file1 file2 file3 file4; do
+    ./test_fs.x add_dedup ddisk.fs $f >>lib.stdout 2>lib.stderr
+done
+
+# every file reads the same
+for f in file1 file2 file3 file4; do
+    ./fs_ref.x cat disk.fs $f >>ref.stdout 2>>ref.stderr
+    ./fs_ref.x cat ddisk.fs $f >>lib.stdout 2>>lib.stderr
+done
+
+# overwriting a shared block copies it, deleting a file keeps the shared
+# blocks alive for the others
+echo "patched!" > patch
+./test_fs.x write_offset ddisk.fs patch file2 5000 >/dev/null
+./test_fs.x rm ddisk.fs file1 >/dev/null
+./fs_ref.x cat disk.fs file3 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat ddisk.fs file3 >>lib.stdout 2>>lib.stderr
+./test_fs.x read_offset ddisk.fs file2 5000 8 | grep -q "patched!" || echo "Patched content doesn't match..."
+./test_fs.x read_offset ddisk.fs file2 0 12 | grep -q "hello world!" || echo "Shared content doesn't match..."
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check ddisk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs ddisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3 file4 patch
@@ -0,0 +1,57 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x ddisk.fs 100
+
+# interleave files, then grow one into the holes left by another
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 400); do echo "hi world!" >> file2; done
+for i in $(seq -w 1 3000); do echo "bye world!" >> file3; done
+for d in disk.fs ddisk.fs; do
+    ./fs_ref.x add $d file1
+    ./fs_ref.x add $d file2
+    ./fs_ref.x rm $d file1
+    ./fs_ref.x add $d file3
+done
+
+# defragment one image in small steps, then finish the job
+./test_fs.x defrag ddisk.fs 2
+./test_fs.x defrag ddisk.fs
+
+# the reference lib must still read the same content
+./fs_ref.x cat disk.fs file2 >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file3 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat ddisk.fs file2 >lib.stdout 2>lib.stderr
+./fs_ref.x cat ddisk.fs file3 >>lib.stdout 2>>lib.stderr
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x info ddisk.fs >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs ddisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3
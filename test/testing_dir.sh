@@ -0,0 +1,50 @@
+#!/bin/sh
+
+# make fresh virtual disk
+./fs_make.x disk.fs 100
+
+# files created out of name order, some sharing a prefix
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+echo "bye world" > file2
+for f in log2 data log10 file1 log1 file2 empty; do
+    [ -f $f ] || touch $f
+    ./fs_ref.x add disk.fs $f >/dev/null
+done
+
+# every file in name order, read a few at a time, as fs_ls lists them
+./fs_ref.x ls disk.fs | tail -n +2 | LC_ALL=C sort >ref.stdout 2>ref.stderr
+./test_fs.x dir disk.fs >lib.stdout 2>lib.stderr
+
+# only those starting with a prefix
+./fs_ref.x ls disk.fs | grep "^file: log" | LC_ALL=C sort >>ref.stdout 2>>ref.stderr
+./test_fs.x dir disk.fs log >>lib.stdout 2>>lib.stderr
+./test_fs.x dir disk.fs nothing >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm log2 data log10 file1 log1 file2 empty
@@ -0,0 +1,72 @@
+#!/bin/sh
+
+# make fresh virtual disks, sparse
+./fs_make.x disk.fs 1000
+./fs_make.x ddisk.fs 1000
+
+# a file of 127 blocks, and one of 3 blocks that stays
+for i in $(seq -w 1 40000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 1000); do echo "bye world" >> file2; done
+
+# kilobytes the image takes on the host
+used() {
+    du -k $1 | cut -f1
+}
+
+# same files with the reference lib and with ours, the large one removed
+# with discard: its blocks leave the host file
+for d in disk.fs ddisk.fs; do
+    ./fs_ref.x add $d file1 >/dev/null
+    ./fs_ref.x add $d file2 >/dev/null
+done
+./fs_ref.x rm disk.fs file1 >/dev/null
+[ $(used ddisk.fs) -ge 508 ] || echo "Image is sparse before the removal..."
+./test_fs.x rm_discard ddisk.fs file1 >/dev/null
+[ $(used ddisk.fs) -lt 100 ] || echo "Image keeps the removed blocks..."
+
+# without discard, they stay until trimmed
+./fs_ref.x add ddisk.fs file1 >/dev/null
+./fs_ref.x rm ddisk.fs file1 >/dev/null
+[ $(used ddisk.fs) -ge 508 ] || echo "Image drops blocks without discard..."
+echo "Trimmed 996 blocks" >ref.stdout
+./test_fs.x trim ddisk.fs >lib.stdout 2>lib.stderr
+[ $(used ddisk.fs) -lt 100 ] || echo "Image keeps the trimmed blocks..."
+
+# the remaining file reads the same, and the disks hold the same
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat ddisk.fs file2 >>lib.stdout 2>>lib.stderr
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x ls ddisk.fs >>lib.stdout 2>>lib.stderr
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x info ddisk.fs >>lib.stdout 2>>lib.stderr
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check ddisk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs ddisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x jdisk.fs 100
+
+# create files spanning several blocks
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 400); do echo "hi world!" >> file2; done
+
+# ours adds them to a journaled disk, crashing each time: the next mount
+# replays the journal, and the unmount leaves a clean image
+./test_fs.x journal jdisk.fs
+./test_fs.x add_crash jdisk.fs file1
+./test_fs.x add_crash jdisk.fs file2
+./test_fs.x check jdisk.fs >lib.stdout 2>lib.stderr
+./fs_ref.x cat jdisk.fs file1 >>lib.stdout 2>>lib.stderr
+./fs_ref.x cat jdisk.fs file2 >>lib.stdout 2>>lib.stderr
+
+# a crash tearing the transaction that gives file3 its content (damage its
+# last block) leaves the file empty
+for i in $(seq -w 1 300); do echo "bye world!" >> file3; done
+./test_fs.x add_crash jdisk.fs file3
+printf 'X' | dd of=jdisk.fs bs=4096 seek=9 count=1 conv=notrunc 2>/dev/null
+./test_fs.x check jdisk.fs >>lib.stdout 2>>lib.stderr
+./fs_ref.x stat jdisk.fs file3 >>lib.stdout 2>>lib.stderr
+
+# the reference lib gets there on a plain disk
+: > file3
+./fs_ref.x add disk.fs file1
+./fs_ref.x add disk.fs file2
+./fs_ref.x add disk.fs file3
+./test_fs.x check disk.fs >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./test_fs.x check disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x stat disk.fs file3 >>ref.stdout 2>>ref.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs jdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3
@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# make fresh virtual disk
+./fs_make.x disk.fs 100
+
+# a fragmented file: file1 grows after file2 is added
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 700); do echo "bye world" >> file2; done
+echo "patched!" > patch
+./test_fs.x add disk.fs file1 >/dev/null
+./test_fs.x add disk.fs file2 >/dev/null
+./test_fs.x write_offset disk.fs file1 file1 13000 >/dev/null
+
+# mapped in place, or copied from a RAM disk, files read the same
+./fs_ref.x cat disk.fs file1 >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>>ref.stderr
+./test_fs.x cat_mmap disk.fs file1 >lib.stdout 2>lib.stderr
+./test_fs.x cat_mmap disk.fs file2 >>lib.stdout 2>>lib.stderr
+./test_fs.x cat_mmap ram:disk.fs file1 >>lib.stdout 2>>lib.stderr
+
+# writing through a mapping, across two runs of blocks, leaves a clone alone
+./test_fs.x clone disk.fs file1 file3 >/dev/null
+./fs_ref.x cat disk.fs file3 >>ref.stdout 2>>ref.stderr
+./test_fs.x write_mmap disk.fs patch file1 12996 >/dev/null
+./test_fs.x write_mmap ram:disk.fs patch file2 100 >/dev/null
+./test_fs.x cat_mmap disk.fs file3 >>lib.stdout 2>>lib.stderr
+./test_fs.x read_offset disk.fs file1 12996 9 | grep -q "patched!" || echo "Mapped write doesn't match..."
+./test_fs.x read_offset disk.fs file2 100 9 | grep -q "patched!" || echo "Mapped write doesn't match..."
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check disk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 patch
@@ -0,0 +1,57 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x rdisk.fs 100
+
+# same operations, on a plain disk with the reference lib and on a RAM disk
+# with ours: the RAM disk is written back to its image when unmounted
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 400); do echo "hi world!" >> file2; done
+./fs_ref.x add disk.fs file1
+./fs_ref.x add disk.fs file2
+./fs_ref.x rm disk.fs file1
+./test_fs.x add ram:rdisk.fs file1
+./test_fs.x add ram:rdisk.fs file2
+./test_fs.x rm ram:rdisk.fs file1
+
+# the reference lib must see the same images
+./fs_ref.x ls disk.fs >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./fs_ref.x info disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x ls rdisk.fs >lib.stdout 2>lib.stderr
+./fs_ref.x cat rdisk.fs file2 >>lib.stdout 2>>lib.stderr
+./fs_ref.x info rdisk.fs >>lib.stdout 2>>lib.stderr
+
+# and our lib must read them the same way from memory
+./test_fs.x cat ram:disk.fs file2 >>ref.stdout 2>>ref.stderr
+./test_fs.x cat ram:rdisk.fs file2 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs rdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
@@ -0,0 +1,65 @@
+#!/bin/sh
+
+# make a fresh virtual disk and an empty replica of the same geometry
+./fs_make.x disk.fs 100
+./fs_make.x replica.fs 100
+
+# create a file spanning several blocks and a patch for its third block
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+echo "patched!" > patch
+echo "Hi!" > file2
+
+# first snapshot, replicated in full
+./test_fs.x add disk.fs file1
+./test_fs.x snap disk.fs s1
+./test_fs.x snap_diff disk.fs - s1 full.diff
+./test_fs.x snap_apply replica.fs full.diff
+
+# change one block and add a small file, then replicate the increment only
+./test_fs.x write_offset disk.fs patch file1 9000
+./test_fs.x add disk.fs file2
+./test_fs.x snap disk.fs s2
+./test_fs.x snap_diff disk.fs s1 s2 inc.diff
+./test_fs.x snap_apply replica.fs inc.diff
+
+# the increment carries the two changed blocks only
+[ $(stat -c %s inc.diff) -lt $(stat -c %s full.diff) ] || echo "Diff size doesn't match..."
+
+# dropping the snapshots must not change the live files
+./test_fs.x snap_rm disk.fs s1
+./test_fs.x snap_rm disk.fs s2
+
+# the replica must hold the same files as the source
+./fs_ref.x cat disk.fs file1 >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat replica.fs file1 >lib.stdout 2>lib.stderr
+./fs_ref.x cat replica.fs file2 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs replica.fs full.diff inc.diff
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 patch
@@ -0,0 +1,77 @@
+#!/bin/sh
+
+# make fresh virtual disks of 8192 blocks
+./fs_make.x disk.fs 8186
+./fs_make.x vdisk.fs 8186
+
+# split one into a volume of 4 images, striped by 8 blocks
+UNIT=8
+MEMBERS=4
+STRIPES=$((8192 / UNIT))
+for s in $(seq 0 $((STRIPES - 1))); do
+    dd if=vdisk.fs of=member$((s % MEMBERS)).fs bs=4096 count=$UNIT \
+       skip=$((s * UNIT)) seek=$((s / MEMBERS * UNIT)) conv=notrunc 2>/dev/null
+done
+VOLUME=stripe:$UNIT:member0.fs,member1.fs,member2.fs,member3.fs
+
+# same operations, on a plain disk with the reference lib and on the
+# striped volume with ours
+for i in $(seq -w 1 40000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 4000); do echo "hi world!" >> file2; done
+./fs_ref.x add disk.fs file1
+./fs_ref.x add disk.fs file2
+./fs_ref.x rm disk.fs file1
+./fs_ref.x add disk.fs file1
+./test_fs.x add $VOLUME file1
+./test_fs.x add $VOLUME file2
+./test_fs.x rm $VOLUME file1
+./test_fs.x add $VOLUME file1
+
+# our lib sees the volume as one disk
+./fs_ref.x info disk.fs >ref.stdout 2>ref.stderr
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file2 >>ref.stdout 2>>ref.stderr
+./test_fs.x info $VOLUME >lib.stdout 2>lib.stderr
+./test_fs.x ls $VOLUME >>lib.stdout 2>>lib.stderr
+./test_fs.x cat $VOLUME file1 >>lib.stdout 2>>lib.stderr
+./test_fs.x cat $VOLUME file2 >>lib.stdout 2>>lib.stderr
+
+# joined back, the images make the same disk for the reference lib
+for s in $(seq 0 $((STRIPES - 1))); do
+    dd if=member$((s % MEMBERS)).fs of=vdisk.fs bs=4096 count=$UNIT \
+       skip=$((s / MEMBERS * UNIT)) seek=$((s * UNIT)) conv=notrunc 2>/dev/null
+done
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file1 >>ref.stdout 2>>ref.stderr
+./fs_ref.x ls vdisk.fs >>lib.stdout 2>>lib.stderr
+./fs_ref.x cat vdisk.fs file1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs vdisk.fs member0.fs member1.fs member2.fs member3.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2
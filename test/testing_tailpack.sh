@@ -0,0 +1,71 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x pdisk.fs 100
+
+# small files, and a larger one ending with a partial block
+echo "Hi!" > file1
+for i in $(seq 1 40); do echo "line $i of a short config file" >> file2; done
+for i in $(seq -w 1 1000); do echo "hello world!" >> file3; done
+echo "Bye!" > file4
+
+# store them plain with the reference lib, packed with ours
+for f in file1 file2 file3 file4; do
+    ./fs_ref.x add disk.fs $f
+    ./test_fs.x add_packed pdisk.fs $f
+done
+
+# the packed image must use fewer blocks
+./fs_ref.x info disk.fs | grep fat_free
+./test_fs.x info pdisk.fs | grep fat_free
+
+# overwrite across the tail (unpacks it), then free one packed tail and
+# pack another file in its place
+./test_fs.x write_offset disk.fs file1 file3 12000
+./test_fs.x write_offset pdisk.fs file1 file3 12000
+./fs_ref.x rm disk.fs file1
+./test_fs.x rm pdisk.fs file1
+echo "Hello again" > file5
+./fs_ref.x add disk.fs file5
+./test_fs.x add_packed pdisk.fs file5
+
+# whole and partial reads must give back the same content
+for f in file2 file3 file4 file5; do
+    ./fs_ref.x cat disk.fs $f >>ref.stdout 2>>ref.stderr
+    ./test_fs.x cat pdisk.fs $f >>lib.stdout 2>>lib.stderr
+done
+./test_fs.x read_offset disk.fs file3 4090 20 >>ref.stdout 2>>ref.stderr
+./test_fs.x read_offset pdisk.fs file3 4090 20 >>lib.stdout 2>>lib.stderr
+# packed files have no block of their own, compare names and sizes only
+./fs_ref.x ls disk.fs | sed 's/, data_blk.*//' >>ref.stdout 2>>ref.stderr
+./test_fs.x ls pdisk.fs | sed 's/, data_blk.*//' >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs pdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3 file4 file5
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x rdisk.fs 100
+./fs_make.x tdisk.fs 100
+
+# files of 12, 10 and 15 blocks
+for i in $(seq -w 1 3600); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 4000); do echo "bye world" >> file2; done
+for i in $(seq -w 1 4200); do echo "hi world, hi!" >> file3; done
+
+# written at the same time, a block at a time, with the calls recorded: mount,
+# 3 creations, opens and closes, 37 writes and umount
+./test_fs.x add_traced disk.fs trace.bin file1 file2 file3 >/dev/null
+./fs_ref.x ls disk.fs >ref.stdout 2>ref.stderr
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+cat >>ref.stdout <<END
+Replayed 48 calls, 0 with a different result
+Replayed 48 calls, 0 with a different result
+END
+
+# replayed as fast as possible, and with the original timing on a RAM disk:
+# the same files, in the same blocks
+./fs_replay.x trace.bin rdisk.fs >replay.stdout 2>lib.stderr
+./fs_ref.x ls rdisk.fs >lib.stdout 2>>lib.stderr
+./fs_replay.x -t trace.bin ram:tdisk.fs >>replay.stdout 2>>lib.stderr
+./fs_ref.x ls tdisk.fs >>lib.stdout 2>>lib.stderr
+grep "^Replayed" replay.stdout >>lib.stdout
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs rdisk.fs tdisk.fs trace.bin
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr replay.stdout
+rm file1 file2 file3
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x vdisk.fs 100
+
+# a file spanning several blocks, stored plain, packed and compressed
+for i in $(seq -w 1 1000); do echo "hello world!" >> file1; done
+cp file1 file2
+cp file1 file3
+./fs_ref.x add disk.fs file1
+./test_fs.x add vdisk.fs file1
+./test_fs.x add_packed vdisk.fs file2
+./test_fs.x add_compressed vdisk.fs file3
+
+# scattered reads, over small and block crossing pieces, must give back the
+# same content
+./fs_ref.x cat disk.fs file1 >ref.stdout 2>ref.stderr
+./fs_ref.x cat disk.fs file1 | sed 's/file1/file2/' >>ref.stdout 2>>ref.stderr
+./fs_ref.x cat disk.fs file1 | sed 's/file1/file3/' >>ref.stdout 2>>ref.stderr
+./test_fs.x cat_vec vdisk.fs file1 7 >lib.stdout 2>lib.stderr
+./test_fs.x cat_vec vdisk.fs file2 5000 >>lib.stdout 2>>lib.stderr
+./test_fs.x cat_vec vdisk.fs file3 333 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs vdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3
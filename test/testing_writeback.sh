@@ -0,0 +1,61 @@
+#!/bin/sh
+
+# make fresh virtual disks
+./fs_make.x disk.fs 100
+./fs_make.x wdisk.fs 100
+
+# files of many blocks, and one ending mid-block
+for i in $(seq -w 1 4000); do echo "hello world!" >> file1; done
+for i in $(seq -w 1 3000); do echo "bye world" >> file2; done
+for i in $(seq -w 1 100); do echo "hi" >> file3; done
+
+# same operations on a plain disk with the reference lib, and with ours
+# appending through a write-back cache of a few blocks, which writers keep
+# waiting for
+for f in file1 file2 file3; do
+    ./fs_ref.x add disk.fs $f >ref.stdout 2>ref.stderr
+    ./test_fs.x add_writeback wdisk.fs $f >lib.stdout 2>lib.stderr
+done
+./fs_ref.x rm disk.fs file1 >/dev/null
+./test_fs.x rm wdisk.fs file1 >/dev/null
+./fs_ref.x add disk.fs file1 >>ref.stdout 2>>ref.stderr
+./test_fs.x add_writeback wdisk.fs file1 >>lib.stdout 2>>lib.stderr
+
+# everything reached the image by the unmount
+./fs_ref.x ls disk.fs >>ref.stdout 2>>ref.stderr
+./fs_ref.x ls wdisk.fs >>lib.stdout 2>>lib.stderr
+for f in file1 file2 file3; do
+    ./fs_ref.x cat disk.fs $f >>ref.stdout 2>>ref.stderr
+    ./fs_ref.x cat wdisk.fs $f >>lib.stdout 2>>lib.stderr
+done
+echo "Found 0 problems" >>ref.stdout
+./test_fs.x check wdisk.fs | tail -1 >>lib.stdout 2>>lib.stderr
+
+# put output files into variables
+REF_STDOUT=$(cat ref.stdout)
+REF_STDERR=$(cat ref.stderr)
+
+LIB_STDOUT=$(cat lib.stdout)
+LIB_STDERR=$(cat lib.stderr)
+
+# compare stdout
+if [ "$REF_STDOUT" != "$LIB_STDOUT" ]; then
+    echo "Stdout outputs don't match..."
+    diff -u ref.stdout lib.stdout
+else
+    echo "Stdout outputs match!"
+fi
+
+# compare stderr
+if [ "$REF_STDERR" != "$LIB_STDERR" ]; then
+    echo "Stderr outputs don't match..."
+    diff -u ref.stderr lib.stderr
+else
+    echo "Stderr outputs match!"
+fi
+
+# clean
+rm disk.fs wdisk.fs
+rm ref.stdout ref.stderr
+rm lib.stdout lib.stderr
+rm file1 file2 file3